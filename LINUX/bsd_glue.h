@@ -219,6 +219,7 @@ struct thread;
 #define m_copydata(m, o, l, b)          skb_copy_bits(m, o, b, l)
 
 #define copyin(_from, _to, _len)	copy_from_user(_to, _from, _len)
+#define copyout(_from, _to, _len)	copy_to_user(_to, _from, _len)
 
 /*
  * struct ifnet is remapped into struct net_device on linux.
@@ -328,14 +329,23 @@ static inline int ilog2(uint64_t n)
 }
 #endif /* ilog2 */
 
-#define contigmalloc(sz, ty, flags, a, b, pgsz, c) ({		\
+/*
+ * alloc_pages() returns naturally aligned blocks, so the alignment
+ * argument is implied, but it cannot go beyond MAX_ORDER
+ */
+#define NM_CONTIG_MAX	(PAGE_SIZE << (MAX_ORDER - 1))
+
+#define contigmalloc_node(sz, ty, flags, a, b, pgsz, c, node) ({	\
 	unsigned int order_ =					\
 		ilog2(roundup_pow_of_two(sz)/PAGE_SIZE);	\
-	struct page *p_ = alloc_pages(GFP_ATOMIC | __GFP_ZERO,  \
-		order_);					\
+	struct page *p_ = alloc_pages_node(node,		\
+		GFP_ATOMIC | __GFP_ZERO, order_);		\
 	if (p_ != NULL) 					\
 		split_page(p_, order_);				\
 	(p_ != NULL ? (char*)page_address(p_) : NULL); })
+
+#define contigmalloc(sz, ty, flags, a, b, pgsz, c)		\
+	contigmalloc_node(sz, ty, flags, a, b, pgsz, c, NUMA_NO_NODE)
 	
 #define contigfree(va, sz, ty)					\
 	do {							\
@@ -873,6 +873,16 @@ linux_netmap_poll(struct file * file, struct poll_table_struct *pwait)
 	return netmap_poll(priv, events, &sr);
 }
 
+/*
+ * When the buffer pool is made of huge clusters (dev.netmap.buf_hugepage)
+ * and the kernel supports it, the clusters are mapped in userspace with
+ * PMD entries. The vma is then VM_PFNMAP, so the base page faults
+ * (netmap_if, rings) insert pfns as well.
+ */
+#if defined(NETMAP_LINUX_HAVE_PMD_FAULT) && defined(CONFIG_TRANSPARENT_HUGEPAGE)
+#define NM_HUGE_MMAP
+#endif
+
 static int
 linux_netmap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 {
@@ -889,14 +899,86 @@ linux_netmap_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
 	pfn = pa >> PAGE_SHIFT;
 	if (!pfn_valid(pfn))
 		return VM_FAULT_SIGBUS;
+#ifdef NM_HUGE_MMAP
+	if (vma->vm_flags & VM_PFNMAP) {
+		unsigned long addr = vma->vm_start +
+			((vmf->pgoff - vma->vm_pgoff) << PAGE_SHIFT);
+		int error = vm_insert_pfn(vma, addr, pfn);
+
+		if (error && error != -EBUSY)
+			return VM_FAULT_SIGBUS;
+		return VM_FAULT_NOPAGE;
+	}
+#endif /* NM_HUGE_MMAP */
 	page = pfn_to_page(pfn);
 	get_page(page);
 	vmf->page = page;
 	return 0;
 }
 
+#ifdef NM_HUGE_MMAP
+static int
+linux_netmap_pmd_fault(struct vm_area_struct *vma, unsigned long addr,
+		pmd_t *pmd, unsigned int flags)
+{
+	struct netmap_priv_d *priv = vma->vm_private_data;
+	struct netmap_adapter *na = priv->np_na;
+	unsigned long haddr = addr & HPAGE_PMD_MASK;
+	unsigned long off, pa;
+	vm_ooffset_t bufofs, buflen;
+	u_int hugepage;
+
+	if (haddr < vma->vm_start || haddr + HPAGE_PMD_SIZE > vma->vm_end)
+		return VM_FAULT_FALLBACK;
+	off = haddr - vma->vm_start + (vma->vm_pgoff << PAGE_SHIFT);
+	hugepage = netmap_mem_hugepage(na->nm_mem, &bufofs, &buflen);
+	if (hugepage < HPAGE_PMD_SIZE || off < bufofs ||
+	    off + HPAGE_PMD_SIZE > bufofs + buflen ||
+	    ((off - bufofs) & (HPAGE_PMD_SIZE - 1)))
+		return VM_FAULT_FALLBACK;
+	pa = netmap_mem_ofstophys(na->nm_mem, off);
+	ND("pmd fault off %lx -> phys addr %lx", off, pa);
+	if (pa == 0 || (pa & (HPAGE_PMD_SIZE - 1)))
+		return VM_FAULT_FALLBACK;
+	return vmf_insert_pfn_pmd(vma, haddr, pmd, phys_to_pfn_t(pa, 0),
+			flags & FAULT_FLAG_WRITE);
+}
+
+/*
+ * Place the mapping so that the buffer pool starts on a
+ * huge page boundary, otherwise no PMD can map it.
+ */
+static unsigned long
+linux_netmap_get_unmapped_area(struct file *f, unsigned long addr,
+		unsigned long len, unsigned long pgoff, unsigned long flags)
+{
+	struct netmap_priv_d *priv = f->private_data;
+	unsigned long ofs, ret;
+	vm_ooffset_t bufofs = 0;
+	u_int hugepage = 0;
+
+	if (priv->np_nifp != NULL && !(flags & MAP_FIXED))
+		hugepage = netmap_mem_hugepage(priv->np_na->nm_mem, &bufofs,
+				NULL);
+	if (hugepage < HPAGE_PMD_SIZE || (pgoff << PAGE_SHIFT) > bufofs)
+		return current->mm->get_unmapped_area(f, addr, len,
+				pgoff, flags);
+	ret = current->mm->get_unmapped_area(f, 0, len + HPAGE_PMD_SIZE,
+			pgoff, flags);
+	if (IS_ERR_VALUE(ret))
+		return ret;
+	ofs = bufofs - (pgoff << PAGE_SHIFT);
+	ret += (HPAGE_PMD_SIZE - ((ret + ofs) & (HPAGE_PMD_SIZE - 1))) &
+		(HPAGE_PMD_SIZE - 1);
+	return ret;
+}
+#endif /* NM_HUGE_MMAP */
+
 static struct vm_operations_struct linux_netmap_mmap_ops = {
 	.fault = linux_netmap_fault,
+#ifdef NM_HUGE_MMAP
+	.pmd_fault = linux_netmap_pmd_fault,
+#endif /* NM_HUGE_MMAP */
 };
 
 static int
@@ -945,6 +1027,12 @@ linux_netmap_mmap(struct file *f, struct vm_area_struct *vma)
 		 */
 		vma->vm_private_data = priv;
 		vma->vm_ops = &linux_netmap_mmap_ops;
+#ifdef NM_HUGE_MMAP
+		if ((vma->vm_flags & VM_SHARED) &&
+		    netmap_mem_hugepage(na->nm_mem, NULL, NULL) >= HPAGE_PMD_SIZE)
+			vma->vm_flags |= VM_PFNMAP | VM_HUGEPAGE |
+				VM_DONTEXPAND | VM_DONTDUMP;
+#endif /* NM_HUGE_MMAP */
 	}
 	return 0;
 }
@@ -1058,6 +1146,9 @@ static struct file_operations netmap_fops = {
     .owner = THIS_MODULE,
     .open = linux_netmap_open,
     .mmap = linux_netmap_mmap,
+#ifdef NM_HUGE_MMAP
+    .get_unmapped_area = linux_netmap_get_unmapped_area,
+#endif /* NM_HUGE_MMAP */
     LIN_IOCTL_NAME = linux_netmap_ioctl,
     .poll = linux_netmap_poll,
     .release = linux_netmap_release,
@@ -1748,8 +1839,7 @@ int netmap_bns_id;
 
 struct netmap_bns {
 	struct net *net;
-	struct nm_bridge *bridges;
-	u_int num_bridges;
+	struct nm_bdg_set *bridges;
 };
 
 #ifdef NETMAP_LINUX_HAVE_PERNET_OPS_ID
@@ -1799,13 +1889,12 @@ netmap_bns_put(struct net *net_ns)
 }
 
 void
-netmap_bns_getbridges(struct nm_bridge **b, u_int *n)
+netmap_bns_getbridges(struct nm_bdg_set **b)
 {
 	struct net *net_ns = current->nsproxy->net_ns;
 	struct netmap_bns *ns = net_generic(net_ns, netmap_bns_id);
 
 	*b = ns->bridges;
-	*n = ns->num_bridges;
 }
 
 static int __net_init
@@ -1819,8 +1908,7 @@ netmap_pernet_init(struct net *net)
 		return error;
 
 	ns->net = net;
-	ns->num_bridges = 8;
-	ns->bridges = netmap_init_bridges2(ns->num_bridges);
+	ns->bridges = netmap_init_bridges2();
 	if (ns->bridges == NULL) {
 		nm_bns_destroy(net, ns);
 		return -ENOMEM;
@@ -1834,7 +1922,7 @@ netmap_pernet_exit(struct net *net)
 {
 	struct netmap_bns *ns = net_generic(net, netmap_bns_id);
 
-	netmap_uninit_bridges2(ns->bridges, ns->num_bridges);
+	netmap_uninit_bridges2(ns->bridges);
 	ns->bridges = NULL;
 
 	nm_bns_destroy(net, ns);
@@ -1887,6 +1975,109 @@ nm_os_ncpus(void)
 	return nr_cpu_ids;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return raw_smp_processor_id();
+}
+
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+	/* pdev is the struct device of native adapters */
+	return na->pdev ? dev_to_node(na->pdev) : NUMA_NO_NODE;
+}
+
+int
+nm_os_numa_node_online(int node)
+{
+	return node >= 0 && node < nr_node_ids && node_online(node);
+}
+
+/* pages of a user memory area, pinned and mapped in the kernel */
+struct nm_os_extmem {
+	struct page **pages;
+	u_int nr_pages;
+	void *kaddr;
+};
+
+void
+nm_os_extmem_delete(struct nm_os_extmem *e)
+{
+	u_int i;
+
+	if (e->kaddr)
+		vunmap(e->kaddr);
+	for (i = 0; i < e->nr_pages; i++) {
+		set_page_dirty_lock(e->pages[i]);
+		put_page(e->pages[i]);
+	}
+	vfree(e->pages);
+	kfree(e);
+}
+
+struct nm_os_extmem *
+nm_os_extmem_create(unsigned long p, u_int size, int *perror)
+{
+	struct nm_os_extmem *e;
+	u_int nr_pages = size >> PAGE_SHIFT;
+	int res;
+
+	e = kzalloc(sizeof(*e), GFP_KERNEL);
+	if (e == NULL) {
+		*perror = ENOMEM;
+		return NULL;
+	}
+	e->pages = vmalloc(nr_pages * sizeof(*e->pages));
+	if (e->pages == NULL) {
+		*perror = ENOMEM;
+		goto out;
+	}
+	res = get_user_pages_fast(p, nr_pages, 1 /* write */, e->pages);
+	if (res > 0)
+		e->nr_pages = res;
+	if (res != nr_pages) {
+		D("pinned %d of %u pages at %lx", res, nr_pages, p);
+		*perror = EFAULT;
+		goto out;
+	}
+	e->kaddr = vmap(e->pages, nr_pages, VM_MAP, PAGE_KERNEL);
+	if (e->kaddr == NULL) {
+		*perror = ENOMEM;
+		goto out;
+	}
+	return e;
+
+out:
+	nm_os_extmem_delete(e);
+	return NULL;
+}
+
+char *
+nm_os_extmem_kaddr(struct nm_os_extmem *e)
+{
+	return e->kaddr;
+}
+
+vm_paddr_t
+nm_os_extmem_paddr(struct nm_os_extmem *e, vm_ooffset_t off)
+{
+	return page_to_phys(e->pages[off >> PAGE_SHIFT]) +
+		(off & (PAGE_SIZE - 1));
+}
+
+uint64_t
+nm_os_uptime_ns(void)
+{
+	return ktime_to_ns(ktime_get());
+}
+
+void
+nm_os_kthread_usleep(u_int usec)
+{
+	usleep_range(usec, usec + usec / 4 + 1);
+}
+
 /* kthread context */
 struct nm_kthread_ctx {
     /* files to exchange notifications */
@@ -946,3 +946,27 @@ nm_os_put_module(void)
 {
 	// TODO
 }
+
+u_int
+nm_os_ncpus(void)
+{
+	return KeQueryActiveProcessorCount(NULL);
+}
+
+u_int
+nm_os_curcpu(void)
+{
+	return KeGetCurrentProcessorNumber();
+}
+
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+	return -1;
+}
+
+int
+nm_os_numa_node_online(int node)
+{
+	return node == 0;
+}
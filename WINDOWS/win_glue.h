@@ -141,6 +141,15 @@ typedef ULONG 			vm_ooffset_t;
 #ifdef _MSC_VER
 #define inline			__inline
 #define __builtin_prefetch(x)	_mm_prefetch(x, _MM_HINT_T2)
+
+/* as in the BSD kernel: index of the first bit set, from 1, or 0 */
+static __inline int
+ffs(uint32_t x)
+{
+	unsigned long i;
+
+	return _BitScanForward(&i, x) ? (int)i + 1 : 0;
+}
 #endif /* _MSC_VER */
 
 static void panic(const char *fmt, ...)
@@ -253,6 +262,7 @@ static int time_uptime_w32()
  * Is it ok to use RtlCopyMemory for user buffers ?
  */
 #define copyin(src, dst, copy_len)		RtlCopyMemory(dst, src, copy_len)
+#define copyout(src, dst, copy_len)		RtlCopyMemory(dst, src, copy_len)
 
 
 /*
@@ -0,0 +1,175 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the cost of the netmap buffer allocator.
+ *
+ * Each iteration registers a VALE port, which allocates the buffers
+ * of its rings and the requested extra buffers, and unregisters it,
+ * which frees them. Only the registration is timed.
+ *
+ *	mem-bench [-s slots] [-r rings] [-e extra] [-n iterations]
+ *		[-f ports] [-t]
+ *
+ * -f first opens 2 * ports other ports and closes every other one,
+ * so that the free buffers are scattered over the pool.
+ *
+ * -t also times a write to every page of the region after the
+ * registration, to account for memory populated on first touch
+ * (dev.netmap.priv_buf_lazy). Each port has its own region, so the
+ * startup latency across region sizes is measured varying -s and -e.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+#define MAXFRAG	512
+#define PGSZ	4096
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s slots] [-r rings] [-e extra] "
+		"[-n iterations] [-f ports] [-t]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct nm_desc *frag[2 * MAXFRAG] = { NULL };
+	struct nmreq req;
+	uint64_t total = 0, best = ~0ULL, bufs = 0, touch = 0;
+	int ch, i, slots = 1024, rings = 1, extra = 0, iters = 100;
+	int nfrag = 0, do_touch = 0;
+	u_int memsize = 0;
+	char name[64];
+
+	while ((ch = getopt(argc, argv, "s:r:e:n:f:t")) != -1) {
+		switch (ch) {
+		case 's':
+			slots = atoi(optarg);
+			break;
+		case 'r':
+			rings = atoi(optarg);
+			break;
+		case 'e':
+			extra = atoi(optarg);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 'f':
+			nfrag = atoi(optarg);
+			break;
+		case 't':
+			do_touch = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (slots < 1 || rings < 1 || extra < 0 || iters < 1 ||
+	    nfrag < 0 || nfrag > MAXFRAG)
+		usage(argv[0]);
+
+	bzero(&req, sizeof(req));
+	req.nr_tx_slots = req.nr_rx_slots = slots;
+	req.nr_tx_rings = req.nr_rx_rings = rings;
+
+	/* scatter the free buffers */
+	for (i = 0; i < 2 * nfrag; i++) {
+		snprintf(name, sizeof(name), "vale-mb:f%d", i);
+		frag[i] = nm_open(name, &req, 0, NULL);
+		if (frag[i] == NULL) {
+			D("cannot open %s", name);
+			break;
+		}
+	}
+	for (i = 1; i < 2 * nfrag; i += 2) {
+		nm_close(frag[i]);
+		frag[i] = NULL;
+	}
+
+	req.nr_arg3 = extra;
+	for (i = 0; i < iters; i++) {
+		struct nm_desc *d;
+		uint64_t t = now_ns();
+
+		d = nm_open("vale-mb:bench", &req, 0, NULL);
+		t = now_ns() - t;
+		if (d == NULL) {
+			D("cannot open vale-mb:bench");
+			break;
+		}
+		total += t;
+		if (t < best)
+			best = t;
+		memsize = d->memsize;
+		if (do_touch) {
+			volatile char *p = d->mem;
+			u_int ofs;
+
+			t = now_ns();
+			for (ofs = 0; ofs < memsize; ofs += PGSZ)
+				p[ofs] = p[ofs];
+			touch += now_ns() - t;
+		}
+		/* ring buffers, host rings excluded, plus the extra ones */
+		bufs = (uint64_t)d->req.nr_tx_rings * d->req.nr_tx_slots +
+			(uint64_t)d->req.nr_rx_rings * d->req.nr_rx_slots +
+			d->req.nr_arg3;
+		nm_close(d);
+	}
+	if (i > 0) {
+		printf("%" PRIu64 " buffers, %u KB: %10.0f ns/register (best %"
+			PRIu64 ") %6.1f ns/buffer", bufs, memsize >> 10,
+			(double)total / i, best,
+			bufs ? (double)total / i / bufs : 0);
+		if (do_touch)
+			printf(" %10.0f ns/touch", (double)touch / i);
+		printf("\n");
+	}
+
+	for (i = 0; i < 2 * nfrag; i++)
+		if (frag[i])
+			nm_close(frag[i]);
+	return 0;
+}
@@ -271,6 +271,8 @@ struct glob_arg {
 	int virt_header;	/* send also the virt_header */
 	int extra_bufs;		/* goes in nr_arg3 */
 	int extra_pipes;	/* goes in nr_arg1 */
+	int numa_node;		/* goes in nr_numa_node, -1 for default */
+	int large_bufs;		/* NR_RX_LARGE_BUFS in nr_flags */
 	char *packet_file;	/* -P option */
 };
 enum dev_type { DEV_NONE, DEV_NETMAP, DEV_PCAP, DEV_TAP };
@@ -1889,6 +1891,8 @@ usage(void)
 		"\t-z			use random IPv4 src address/port\n"
 		"\t-Z			use random IPv4 dst address/port\n"
 		"\t-F num_frags		send multi-slot packets\n"
+		"\t-N node		allocate the netmap memory on NUMA node\n"
+		"\t-J			use large rx buffers (VALE ports)\n"
 		"",
 		cmd);
 
@@ -2182,9 +2186,10 @@ main(int arc, char **argv)
 	g.frags = 1;
 	g.nmr_config = "";
 	g.virt_header = 0;
+	g.numa_node = -1;
 
 	while ( (ch = getopt(arc, argv,
-			"a:f:F:n:i:Il:d:s:D:S:b:c:o:p:T:w:WvR:XC:H:e:E:m:rP:zZ")) != -1) {
+			"a:f:F:n:i:Il:d:s:D:S:b:c:o:p:T:w:WvR:XC:H:e:E:m:rP:zZN:J")) != -1) {
 		struct td_desc *fn;
 
 		switch(ch) {
@@ -2338,6 +2343,12 @@ main(int arc, char **argv)
 		case 'Z':
 			g.options |= OPT_RANDOM_DST;
 			break;
+		case 'N':
+			g.numa_node = atoi(optarg);
+			break;
+		case 'J':
+			g.large_bufs = 1;
+			break;
 		}
 	}
 
@@ -2421,6 +2432,12 @@ D("running on %d cpus (have %d)", g.cpus, i);
 	if (g.extra_pipes) {
 	    base_nmd.nr_arg1 = g.extra_pipes;
 	}
+	if (g.numa_node >= 0) {
+		base_nmd.nr_flags |= NR_NUMA_NODE;
+		base_nmd.nr_numa_node = g.numa_node;
+	}
+	if (g.large_bufs)
+		base_nmd.nr_flags |= NR_RX_LARGE_BUFS;
 
 	base_nmd.nr_flags |= NR_ACCEPT_VNET_HDR;
 
@@ -2453,6 +2470,11 @@ D("running on %d cpus (have %d)", g.cpus, i);
 	}
 	g.main_fd = g.nmd->fd;
 	D("mapped %dKB at %p", g.nmd->req.nr_memsize>>10, g.nmd->mem);
+	if (g.nmd->req.nr_numa_node != NETMAP_NUMA_ANY)
+		D("memory on NUMA node %d", g.nmd->req.nr_numa_node);
+	if (g.large_bufs)
+		D("rx buffers of %d bytes", NETMAP_RXRING(g.nmd->nifp,
+			g.nmd->first_rx_ring)->nr_buf_size);
 
 	if (g.virt_header) {
 		/* Set the virtio-net header length, since the user asked
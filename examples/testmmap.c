@@ -534,7 +534,8 @@ do_if()
 	printf("tx_rings   %u\n", nifp->ni_tx_rings);
 	printf("rx_rings   %u\n", nifp->ni_rx_rings);
 	printf("bufs_head  %u\n", nifp->ni_bufs_head);
-	for (i = 0; i < 5; i++)
+	printf("memsize    %u\n", nifp->ni_memsize);
+	for (i = 0; i < 4; i++)
 		printf("spare1[%d]  %u\n", i, nifp->ni_spare1[i]);
 	for (i = 0; i < (nifp->ni_tx_rings + nifp->ni_rx_rings + 2); i++)
 		printf("ring_ofs[%d] %zd\n", i, nifp->ring_ofs[i]);
@@ -947,7 +948,7 @@ do_nmr_dump()
 		printf(", PTNETMAP_HOST");
 	}
 	printf("]\n");
-	printf("spare2[0]: %x\n", curr_nmr.spare2[0]);
+	printf("nr_numa_node: %x\n", curr_nmr.nr_numa_node);
 }
 
 void
@@ -1022,6 +1023,8 @@ do_nmr_cmd()
 		curr_nmr.nr_cmd = NETMAP_PT_HOST_CREATE;
 	} else if (strcmp(arg, "pt-host-delete") == 0) {
 		curr_nmr.nr_cmd = NETMAP_PT_HOST_DELETE;
+	} else if (strcmp(arg, "mem-grow") == 0) {
+		curr_nmr.nr_cmd = NETMAP_MEM_GROW;
 	}
 out:
 	output("cmd=%x", curr_nmr.nr_cmd);
@@ -0,0 +1,224 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure packet rate and data TLB misses when moving packets
+ * between two VALE ports, to compare buffer pools backed by base
+ * pages and by huge pages (dev.netmap.priv_buf_hugepage).
+ *
+ * The sender fills every slot of its tx ring, the switch copies the
+ * frames into the receiver's buffers, and the receiver reads them
+ * back. With large rings the buffers span many pages, so both the
+ * userspace loops and the kernel copy touch more pages than the TLB
+ * can hold unless the pool uses huge pages.
+ *
+ *	tlb-bench [-s slots] [-l len] [-n iterations]
+ *
+ * On Linux the dTLB load misses are read from perf counters, split
+ * in user and kernel (the latter needs perf_event_paranoid <= 1).
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif /* __linux__ */
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* open a dTLB load miss counter for this thread, -1 if not available */
+static int
+tlb_counter(int kernel)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	bzero(&attr, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = PERF_TYPE_HW_CACHE;
+	attr.config = PERF_COUNT_HW_CACHE_DTLB |
+		(PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+	attr.exclude_user = kernel;
+	attr.exclude_kernel = !kernel;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	(void)kernel;
+	return -1;
+#endif /* __linux__ */
+}
+
+static uint64_t
+tlb_read(int fd)
+{
+	uint64_t v = 0;
+
+	if (fd < 0 || read(fd, &v, sizeof(v)) != sizeof(v))
+		return 0;
+	return v;
+}
+
+/* fill and send the whole tx ring */
+static u_int
+send_ring(struct nm_desc *d, u_int len)
+{
+	struct netmap_ring *ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+	u_int i = ring->cur, n = 0;
+
+	while (nm_ring_space(ring) > 0 && n < ring->num_slots - 1) {
+		struct netmap_slot *slot = &ring->slot[i];
+		char *buf = NETMAP_BUF(ring, slot->buf_idx);
+
+		memset(buf, 0xff, 6);	/* broadcast */
+		memset(buf + 6, n, len - 6);
+		slot->len = len;
+		slot->flags = 0;
+		i = nm_ring_next(ring, i);
+		n++;
+	}
+	ring->head = ring->cur = i;
+	ioctl(d->fd, NIOCTXSYNC, NULL);
+	return n;
+}
+
+/* read every received frame and release the slots */
+static u_int
+recv_ring(struct nm_desc *d, uint64_t *sum)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(d->nifp, d->first_rx_ring);
+	u_int i, n = 0;
+
+	ioctl(d->fd, NIOCRXSYNC, NULL);
+	for (i = ring->cur; i != ring->tail; i = nm_ring_next(ring, i), n++) {
+		struct netmap_slot *slot = &ring->slot[i];
+		const uint8_t *buf = (uint8_t *)NETMAP_BUF(ring, slot->buf_idx);
+		u_int k;
+
+		for (k = 0; k < slot->len; k += 64)
+			*sum += buf[k];
+	}
+	ring->head = ring->cur = i;
+	return n;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-s slots] [-l len] [-n iterations]\n",
+		prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct nm_desc *tx, *rx;
+	struct nmreq req;
+	uint64_t t, pkts = 0, sum = 0, utlb, ktlb;
+	int ch, i, slots = 2048, len = 60, iters = 1000;
+	int ufd, kfd;
+
+	while ((ch = getopt(argc, argv, "s:l:n:")) != -1) {
+		switch (ch) {
+		case 's':
+			slots = atoi(optarg);
+			break;
+		case 'l':
+			len = atoi(optarg);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (slots < 2 || len < 60 || len > 2048 || iters < 1)
+		usage(argv[0]);
+
+	bzero(&req, sizeof(req));
+	req.nr_tx_slots = req.nr_rx_slots = slots;
+	req.nr_tx_rings = req.nr_rx_rings = 1;
+	tx = nm_open("vale-tlb:tx", &req, 0, NULL);
+	rx = nm_open("vale-tlb:rx", &req, 0, NULL);
+	if (tx == NULL || rx == NULL) {
+		D("cannot open the VALE ports");
+		return 1;
+	}
+	/* fault in both regions before measuring */
+	send_ring(tx, len);
+	while (recv_ring(rx, &sum) > 0)
+		;
+
+	ufd = tlb_counter(0);
+	kfd = tlb_counter(1);
+	utlb = tlb_read(ufd);
+	ktlb = tlb_read(kfd);
+	t = now_ns();
+	for (i = 0; i < iters; i++) {
+		pkts += send_ring(tx, len);
+		recv_ring(rx, &sum);
+	}
+	t = now_ns() - t;
+	utlb = tlb_read(ufd) - utlb;
+	ktlb = tlb_read(kfd) - ktlb;
+	if (pkts == 0) {
+		D("no packets sent");
+		return 1;
+	}
+
+	printf("%" PRIu64 " pkts of %d bytes, %d slots: %.3f Mpps",
+		pkts, len, slots, t ? pkts * 1000.0 / t : 0.0);
+	if (ufd >= 0)
+		printf(", dTLB misses/pkt user %.3f", (double)utlb / pkts);
+	if (kfd >= 0)
+		printf(" kernel %.3f", (double)ktlb / pkts);
+	printf("\n");
+	ND("checksum %" PRIu64, sum);
+
+	if (ufd >= 0)
+		close(ufd);
+	if (kfd >= 0)
+		close(kfd);
+	nm_close(tx);
+	nm_close(rx);
+	return 0;
+}
@@ -0,0 +1,235 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Measure the per-batch cost of a VALE switch as a function of
+ * the number of ports.
+ *
+ * For each port count, create a switch with that many ports,
+ * send batches from port 0 and time the txsync, which runs the
+ * whole forwarding path (lookup, destination queues, copies).
+ * The receive rings are emptied between batches, outside of the
+ * measured interval.
+ *
+ *	vale-bench [-p 2,16,64,254] [-b batch] [-n iterations] [-B]
+ *
+ * -B sends broadcast frames (copied to every port), otherwise
+ * frames go to port 1 and the other ports are idle, which shows
+ * the fixed per-batch overhead of the switch.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#define NETMAP_WITH_LIBS
+#include <net/netmap_user.h>
+
+#define MAXPORTS	1024
+
+static const char *bdg_name = "valebench";
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* create or destroy the switch with NETMAP_BDG_NEWBDG/DELBDG */
+static int
+bdg_cmd(int cmd, int ports)
+{
+	struct nmreq nmr;
+	int fd, error;
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd < 0) {
+		perror("/dev/netmap");
+		return -1;
+	}
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	snprintf(nmr.nr_name, sizeof(nmr.nr_name), "%s:", bdg_name);
+	nmr.nr_cmd = cmd;
+	nmr.nr_arg1 = ports;
+	error = ioctl(fd, NIOCREGIF, &nmr);
+	if (error)
+		perror(nmr.nr_name);
+	close(fd);
+	return error;
+}
+
+/* a minimal ethernet frame from port src to dst (NULL is broadcast) */
+static void
+fill_frame(char *buf, int src, const uint8_t *dst)
+{
+	static const uint8_t bcast[6] = { 0xff, 0xff, 0xff, 0xff, 0xff, 0xff };
+
+	bzero(buf, 60);
+	memcpy(buf, dst ? dst : bcast, 6);
+	buf[6] = 0x02;	/* locally administered */
+	buf[10] = src >> 8;
+	buf[11] = src & 0xff;
+	buf[12] = 0x08;	/* IPv4, not that anyone looks */
+}
+
+/* send n frames from d and flush them through the switch */
+static uint64_t
+send_batch(struct nm_desc *d, int src, const uint8_t *dst, int n)
+{
+	struct netmap_ring *ring = NETMAP_TXRING(d->nifp, d->first_tx_ring);
+	uint64_t t;
+	u_int i = ring->cur;
+
+	while (n-- > 0 && nm_ring_space(ring) > 0) {
+		struct netmap_slot *slot = &ring->slot[i];
+
+		fill_frame(NETMAP_BUF(ring, slot->buf_idx), src, dst);
+		slot->len = 60;
+		slot->flags = 0;
+		i = nm_ring_next(ring, i);
+	}
+	ring->head = ring->cur = i;
+	t = now_ns();
+	ioctl(d->fd, NIOCTXSYNC, NULL);
+	return now_ns() - t;
+}
+
+/* release all received slots */
+static void
+drain(struct nm_desc *d)
+{
+	struct netmap_ring *ring = NETMAP_RXRING(d->nifp, d->first_rx_ring);
+
+	ioctl(d->fd, NIOCRXSYNC, NULL);
+	ring->head = ring->cur = ring->tail;
+	ioctl(d->fd, NIOCRXSYNC, NULL);
+}
+
+static int
+run(int nports, int batch, int iters, int broadcast)
+{
+	struct nm_desc *d[MAXPORTS] = { NULL };
+	uint8_t dmac[6] = { 0x02, 0, 0, 0, 0, 1 };	/* port 1 */
+	uint64_t total = 0, best = ~0ULL;
+	char name[64];
+	int i, k, error = 0;
+
+	/* two spare ports, attaching needs room for a host port */
+	if (bdg_cmd(NETMAP_BDG_NEWBDG, nports + 2))
+		return -1;
+	for (i = 0; i < nports; i++) {
+		snprintf(name, sizeof(name), "%s:%d", bdg_name, i);
+		d[i] = nm_open(name, NULL, 0, NULL);
+		if (d[i] == NULL) {
+			D("cannot open %s", name);
+			error = -1;
+			nports = i;
+			goto done;
+		}
+	}
+	/* port 1 announces itself, so port 0 can send unicast to it */
+	send_batch(d[1], 1, NULL, 1);
+	for (i = 0; i < nports; i++)
+		drain(d[i]);
+
+	for (k = 0; k < iters; k++) {
+		uint64_t t = send_batch(d[0], 0, broadcast ? NULL : dmac,
+				batch);
+
+		total += t;
+		if (t < best)
+			best = t;
+		if (broadcast) {
+			for (i = 1; i < nports; i++)
+				drain(d[i]);
+		} else {
+			drain(d[1]);
+		}
+	}
+	printf("%5d ports %s batch %4d: %8.0f ns/batch (best %" PRIu64
+		") %6.1f ns/pkt\n", nports, broadcast ? "brd" : "uni", batch,
+		(double)total / iters, best, (double)total / iters / batch);
+done:
+	for (i = 0; i < nports; i++)
+		nm_close(d[i]);
+	bdg_cmd(NETMAP_BDG_DELBDG, 0);
+	return error;
+}
+
+static void
+usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-p ports,...] [-b batch] "
+		"[-n iterations] [-B]\n", prog);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	char *ports = strdup("2,16,64,254"), *p;
+	int ch, batch = 64, iters = 10000, broadcast = 0;
+
+	while ((ch = getopt(argc, argv, "p:b:n:B")) != -1) {
+		switch (ch) {
+		case 'p':
+			free(ports);
+			ports = strdup(optarg);
+			break;
+		case 'b':
+			batch = atoi(optarg);
+			break;
+		case 'n':
+			iters = atoi(optarg);
+			break;
+		case 'B':
+			broadcast = 1;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (batch < 1 || iters < 1)
+		usage(argv[0]);
+	for (p = strtok(ports, ","); p != NULL; p = strtok(NULL, ",")) {
+		int n = atoi(p);
+
+		if (n < 2 || n > MAXPORTS) {
+			D("bad port count %s (2..%d)", p, MAXPORTS);
+			continue;
+		}
+		if (run(n, batch, iters, broadcast))
+			break;
+	}
+	free(ports);
+	return 0;
+}
@@ -41,6 +41,8 @@
 #include <net/if.h>	/* ifreq */
 #include <libgen.h>	/* basename */
 #include <stdlib.h>	/* atoi, free */
+#include <netinet/in.h>	/* IPPROTO_* */
+#include <arpa/inet.h>	/* inet_pton */
 
 /* XXX cut and paste from pkt-gen.c because I'm not sure whether this
  * program may include nm_util.h
@@ -81,10 +83,170 @@ void parse_nmr_config(const char* conf, struct nmreq *nmr)
 	free(w);
 }
 
+/*
+ * Configure the flow table of a switch (-f). conf is one of
+ *	add,proto,src,sport,dst,dport,port[,ring]
+ *	del,proto,src,sport,dst,dport
+ *	default,port
+ *	flush
+ * where proto is tcp, udp, sctp or a number, and port is a port
+ * index (see -l), drop or flood.
+ */
+static int
+flow_ctl(const char *name, char *conf)
+{
+	struct nm_ifreq ifr;
+	struct nm_flow_req *req = (struct nm_flow_req *)ifr.data;
+	char *tok[8], *w;
+	int n = 0, error, fd;
+
+	bzero(&ifr, sizeof(ifr));
+	strncpy(ifr.nifr_name, name, sizeof(ifr.nifr_name));
+	for (w = strtok(conf ? conf : "", ","); w && n < 8;
+			w = strtok(NULL, ","))
+		tok[n++] = w;
+	if (n == 0)
+		goto bad;
+	if (!strcmp(tok[0], "flush")) {
+		req->fr_cmd = NM_FLOW_FLUSH;
+	} else if (!strcmp(tok[0], "default") && n == 2) {
+		req->fr_cmd = NM_FLOW_DEFAULT;
+	} else if ((!strcmp(tok[0], "add") && n >= 7) ||
+		   (!strcmp(tok[0], "del") && n == 6)) {
+		req->fr_cmd = tok[0][0] == 'a' ? NM_FLOW_ADD : NM_FLOW_DEL;
+		if (!strcmp(tok[1], "tcp"))
+			req->fr_proto = IPPROTO_TCP;
+		else if (!strcmp(tok[1], "udp"))
+			req->fr_proto = IPPROTO_UDP;
+		else if (!strcmp(tok[1], "sctp"))
+			req->fr_proto = IPPROTO_SCTP;
+		else
+			req->fr_proto = atoi(tok[1]);
+		req->fr_af = strchr(tok[2], ':') ? 6 : 4;
+		if (inet_pton(req->fr_af == 4 ? AF_INET : AF_INET6, tok[2],
+		    req->fr_src) != 1 ||
+		    inet_pton(req->fr_af == 4 ? AF_INET : AF_INET6, tok[4],
+		    req->fr_dst) != 1)
+			goto bad;
+		req->fr_sport = htons(atoi(tok[3]));
+		req->fr_dport = htons(atoi(tok[5]));
+		if (n >= 8)
+			req->fr_ring = atoi(tok[7]);
+	} else {
+		goto bad;
+	}
+	if (req->fr_cmd == NM_FLOW_ADD || req->fr_cmd == NM_FLOW_DEFAULT) {
+		const char *p = tok[req->fr_cmd == NM_FLOW_ADD ? 6 : 1];
+
+		if (!strcmp(p, "drop"))
+			req->fr_port = NM_FLOW_DROP;
+		else if (!strcmp(p, "flood"))
+			req->fr_port = NM_FLOW_FLOOD;
+		else
+			req->fr_port = atoi(p);
+	}
+
+	fd = open("/dev/netmap", O_RDWR);
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	error = ioctl(fd, NIOCCONFIG, &ifr);
+	if (error)
+		perror(name);
+	else
+		D("%s: %u flows", name, req->fr_count);
+	close(fd);
+	return error;
+
+bad:
+	D("invalid flow configuration");
+	return -1;
+}
+
+/* print the counters of the polling kthreads of a NIC, if any */
+static void
+pollstats(int fd, const char *name)
+{
+	static const char *modes[] = { "busy", "backoff", "idle" };
+	struct nm_bdg_pollstats st;
+	struct nmreq nmr;
+	u_int i;
+
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	strncpy(nmr.nr_name, name, sizeof(nmr.nr_name));
+	nmr.nr_cmd = NETMAP_BDG_POLLSTATS;
+	bzero(&st, sizeof(st));
+	nmreq_pointer_put(&nmr, &st);
+	if (ioctl(fd, NIOCGINFO, &nmr))
+		return; /* not polled */
+	D("  polling: busy %u us, interrupts enabled %" PRIu64 " times",
+	    st.pl_busy_us, st.pl_intr_on);
+	for (i = 0; i < st.pl_nthreads; i++) {
+		struct nm_bdg_pollstat *pk = &st.pl_kt[i];
+		uint64_t tot = pk->pk_busy_ns + pk->pk_spin_ns +
+			pk->pk_sleep_ns;
+
+		D("  cpu%u: %s %" PRIu64 " polls %" PRIu64 " busy, "
+		    "utilization %.1f%% sleeping %.1f%%, idle %" PRIu64
+		    " times", pk->pk_cpu,
+		    pk->pk_mode < 3 ? modes[pk->pk_mode] : "?",
+		    pk->pk_polls, pk->pk_busy_polls,
+		    tot ? 100.0 * pk->pk_busy_ns / tot : 0,
+		    tot ? 100.0 * pk->pk_sleep_ns / tot : 0, pk->pk_idle);
+		D("        %u rings, %" PRIu64 " pkts/s, %" PRIu64
+		    " rings stolen", pk->pk_rings, pk->pk_load,
+		    pk->pk_stolen);
+	}
+}
+
+/* print the usage of the memory region of a port, or the global one */
+static int
+mem_stats(const char *name)
+{
+	static const char *pools[] = { "if", "ring", "buf", "lbuf" };
+	struct netmap_mem_stats ms;
+	struct nmreq nmr;
+	int i, fd = open("/dev/netmap", O_RDWR);
+
+	if (fd == -1) {
+		D("Unable to open /dev/netmap");
+		return -1;
+	}
+	bzero(&nmr, sizeof(nmr));
+	nmr.nr_version = NETMAP_API;
+	strncpy(nmr.nr_name, name, sizeof(nmr.nr_name) - 1);
+	nmr.nr_cmd = NETMAP_MEM_STATS;
+	nmreq_pointer_put(&nmr, &ms);
+	if (ioctl(fd, NIOCGINFO, &nmr)) {
+		perror(name[0] ? name : "global region");
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	D("memid %u size %u KB, extra buffers %u (%u by this port)",
+	    ms.ms_memid, ms.ms_memsize >> 10, ms.ms_extra_bufs,
+	    ms.ms_na_extra_bufs);
+	for (i = 0; i < ms.ms_npools && i < NETMAP_MEM_POOLS; i++) {
+		struct netmap_pool_stats *ps = &ms.ms_pool[i];
+
+		if (ps->ps_total == 0)
+			continue;
+		D("  %-4s %8u x %5u: free %u (cached %u) peak %u, "
+		    "%" PRIu64 " failures, %u free runs (longest %u)",
+		    pools[i], ps->ps_total, ps->ps_size, ps->ps_free,
+		    ps->ps_cached, ps->ps_peak, ps->ps_fail, ps->ps_runs,
+		    ps->ps_maxrun);
+	}
+	return 0;
+}
+
 static int
 bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 {
 	struct nmreq nmr;
+	char *p;
 	int error = 0;
 	int fd = open("/dev/netmap", O_RDWR);
 
@@ -98,7 +260,10 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 	if (name != NULL) /* might be NULL */
 		strncpy(nmr.nr_name, name, sizeof(nmr.nr_name));
 	nmr.nr_cmd = nr_cmd;
-	parse_nmr_config(nmr_config, &nmr);
+	if (nr_cmd != NETMAP_BDG_NEWBDG && nr_cmd != NETMAP_BDG_REGOPS &&
+	    nr_cmd != NETMAP_BDG_VLAN && nr_cmd != NETMAP_BDG_MCAST &&
+	    nr_cmd != NETMAP_BDG_QOS && nr_cmd != NETMAP_BDG_BATCHING)
+		parse_nmr_config(nmr_config, &nmr);
 
 	switch (nr_cmd) {
 	case NETMAP_BDG_DELIF:
@@ -151,6 +316,175 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 
 		break;
 
+	case NETMAP_BDG_NEWBDG:
+	case NETMAP_BDG_DELBDG:
+		/* -C entries,age,ports configures the forwarding table
+		 * and the maximum number of ports
+		 */
+		if (nr_cmd == NETMAP_BDG_NEWBDG && nmr_config) {
+			char *age = strchr(nmr_config, ','), *ports = NULL;
+
+			nmr.nr_arg3 = atoi(nmr_config);
+			if (age) {
+				nmr.nr_arg2 = strncmp(age + 1, "never", 5) ?
+				    atoi(age + 1) : NETMAP_BDG_NOAGE;
+				ports = strchr(age + 1, ',');
+			}
+			if (ports)
+				nmr.nr_arg1 = atoi(ports + 1);
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1) {
+			ND("Unable to %s %s", nr_cmd == NETMAP_BDG_DELBDG ?
+			    "destroy" : "create", name);
+			perror(name);
+		}
+		break;
+
+	case NETMAP_BDG_REGOPS:
+		/* -C learning, or -C flow[,entries] (the default) */
+		nmr.nr_arg1 = NETMAP_BDG_OPS_FLOW;
+		if (nmr_config && !strncmp(nmr_config, "learning", 8)) {
+			nmr.nr_arg1 = NETMAP_BDG_OPS_LEARNING;
+		} else if (nmr_config && strchr(nmr_config, ',')) {
+			nmr.nr_arg3 = atoi(strchr(nmr_config, ',') + 1);
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		break;
+
+	case NETMAP_BDG_VLAN:
+		/* -C vid[,tagged|pvid|del], tagged is the default */
+		if (nmr_config == NULL) {
+			D("missing -C vid[,tagged|pvid|del]");
+			error = -1;
+			break;
+		}
+		nmr.nr_arg1 = atoi(nmr_config);
+		nmr.nr_arg2 = NETMAP_BDG_VLAN_TAGGED;
+		if (strstr(nmr_config, ",pvid"))
+			nmr.nr_arg2 = NETMAP_BDG_VLAN_PVID;
+		else if (strstr(nmr_config, ",del"))
+			nmr.nr_arg2 = NETMAP_BDG_VLAN_DEL;
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		break;
+
+	case NETMAP_BDG_MCAST: {
+		/* -C join|leave,mac[,vid] */
+		struct nm_bdg_mcast_req req;
+		char *mac = nmr_config ? strchr(nmr_config, ',') : NULL;
+		unsigned int m[6], vid = 0;
+		int i;
+
+		bzero(&req, sizeof(req));
+		if (mac == NULL || sscanf(mac + 1, "%x:%x:%x:%x:%x:%x,%u",
+		    &m[0], &m[1], &m[2], &m[3], &m[4], &m[5], &vid) < 6) {
+			D("bad -C, need join|leave,mac[,vid]");
+			error = -1;
+			break;
+		}
+		req.mr_cmd = strncmp(nmr_config, "leave", 5) ?
+			NM_MCAST_JOIN : NM_MCAST_LEAVE;
+		req.mr_vid = vid;
+		for (i = 0; i < 6; i++)
+			req.mr_mac[i] = m[i];
+		nmreq_pointer_put(&nmr, &req);
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		break;
+	}
+
+	case NETMAP_BDG_QOS:
+		/* -C rate[,burst[,share]], kbit/s, Kbytes, percent */
+		if (nmr_config == NULL) {
+			D("missing -C rate[,burst[,share]]");
+			error = -1;
+			break;
+		}
+		nmr.nr_arg3 = atoi(nmr_config);
+		if (strchr(nmr_config, ',')) {
+			char *share = strchr(nmr_config, ',') + 1;
+
+			nmr.nr_arg2 = atoi(share);
+			share = strchr(share, ',');
+			if (share)
+				nmr.nr_arg1 = atoi(share + 1);
+		}
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		break;
+
+	case NETMAP_BDG_BATCHING:
+		/* -C batch[,latency], 0 is adaptive (or bridge_batch) */
+		if (nmr_config == NULL) {
+			D("missing -C batch[,latency_us]");
+			error = -1;
+			break;
+		}
+		nmr.nr_arg1 = atoi(nmr_config);
+		if (strchr(nmr_config, ','))
+			nmr.nr_arg3 = atoi(strchr(nmr_config, ',') + 1);
+		error = ioctl(fd, NIOCREGIF, &nmr);
+		if (error == -1)
+			perror(name);
+		break;
+
+	case NETMAP_BDG_FTSTATS: {
+		struct nm_bdg_ftstats st;
+
+		bzero(&st, sizeof(st));
+		nmreq_pointer_put(&nmr, &st);
+		error = ioctl(fd, NIOCGINFO, &nmr);
+		if (error) {
+			perror(name);
+			break;
+		}
+		D("%s: %u/%u entries (%u ways) age %us learned %" PRIu64
+		    " evicted %" PRIu64 " missed %" PRIu64, name,
+		    st.ft_used, st.ft_entries, st.ft_ways, st.ft_age,
+		    st.ft_learned, st.ft_evictions, st.ft_misses);
+		break;
+	}
+
+	case NETMAP_BDG_PORTSTATS: {
+		struct nm_bdg_portstats st;
+		int i;
+
+		bzero(&st, sizeof(st));
+		nmreq_pointer_put(&nmr, &st);
+		error = ioctl(fd, NIOCGINFO, &nmr);
+		if (error) {
+			perror(name);
+			break;
+		}
+		D("%s: port %u", name, st.ps_port);
+		for (i = 0; i < st.ps_tx_rings; i++) {
+			struct nm_bdg_ringstats *rs = &st.ps_tx[i];
+
+			D("  tx%d: %" PRIu64 " pkts %" PRIu64 " bytes %" PRIu64
+			    " brd %" PRIu64 " noport %" PRIu64 " dropped %"
+			    PRIu64 " policed", i,
+			    rs->rs_packets, rs->rs_bytes, rs->rs_broadcast,
+			    rs->rs_noport, rs->rs_dropped, rs->rs_policed);
+			D("       %" PRIu64 " flushes batch %u %u ns/pkt",
+			    rs->rs_flushes, rs->rs_batch, rs->rs_pkt_ns);
+		}
+		for (i = 0; i < st.ps_rx_rings; i++) {
+			struct nm_bdg_ringstats *rs = &st.ps_rx[i];
+
+			D("  rx%d: %" PRIu64 " pkts %" PRIu64 " bytes %" PRIu64
+			    " dropped", i, rs->rs_packets, rs->rs_bytes,
+			    rs->rs_dropped);
+		}
+		pollstats(fd, name);
+		break;
+	}
+
 	case NETMAP_BDG_POLLING_ON:
 	case NETMAP_BDG_POLLING_OFF:
 		/* We reuse nmreq fields as follows:
@@ -158,17 +492,25 @@ bdg_ctl(const char *name, int nr_cmd, int nr_arg, char *nmr_config)
 		 *                REG_ONE_NIC, respectively.
 		 *   nr_rx_slots: CPU core index. This also indicates the
 		 *                first queue in the case of REG_ONE_NIC
-		 *   nr_tx_rings: (REG_ONE_NIC only) indicates the
-		 *                number of CPU cores or the last queue
+		 *   nr_tx_rings: indicates the number of CPU cores
+		 *                (REG_ALL_NIC, 1 if not given) or the
+		 *                last queue (REG_ONE_NIC)
 		 */
 		nmr.nr_flags |= nmr.nr_tx_slots ?
 			NR_REG_ONE_NIC : NR_REG_ALL_NIC;
 		nmr.nr_ringid = nmr.nr_rx_slots;
 		/* number of cores/rings */
-		if (nmr.nr_flags == NR_REG_ALL_NIC)
+		if (nmr.nr_flags == NR_REG_ALL_NIC && nmr.nr_tx_rings == 0)
 			nmr.nr_arg1 = 1;
 		else
 			nmr.nr_arg1 = nmr.nr_tx_rings;
+		/*   nr_rx_rings: if given, the busy-poll time (us) of
+		 *                the hybrid polling
+		 */
+		if (nr_cmd == NETMAP_BDG_POLLING_ON && nmr_config &&
+		    (p = strchr(nmr_config, ',')) && (p = strchr(p + 1, ',')) &&
+		    strchr(p + 1, ','))
+			nmr.nr_arg3 = nmr.nr_rx_rings;
 
 		error = ioctl(fd, NIOCREGIF, &nmr);
 		if (!error)
@@ -218,13 +560,41 @@ usage:
 			"\t-p interface start polling. Additional -C x,y,z configures\n"
 			"\t\t x: 0 (REG_ALL_NIC) or 1 (REG_ONE_NIC),\n"
 			"\t\t y: CPU core id for ALL_NIC and core/ring for ONE_NIC\n"
-			"\t\t z: (ONE_NIC only) num of total cores/rings\n"
+			"\t\t z: num of cores sharing all the rings (ALL_NIC,\n"
+			"\t\t default 1) or of total cores/rings (ONE_NIC)\n"
+			"\t\t and an optional w: busy-poll time (us) before\n"
+			"\t\t backing off to interrupts when idle\n"
 			"\t-P interface stop polling\n"
+			"\t-b bridge create a bridge (e.g. vale1:). Additional -C x,y,z\n"
+			"\t\t x: forwarding table entries, y: ageing time (s)\n"
+			"\t\t or 'never',\n"
+			"\t\t z: max number of ports\n"
+			"\t-B bridge destroy a bridge created by -b\n"
+			"\t-s bridge show forwarding table statistics\n"
+			"\t-S interface show the counters of a port\n"
+			"\t-F bridge select the lookup function. -C flow[,entries]\n"
+			"\t\t (exact match flow table, default) or -C learning\n"
+			"\t-f bridge configure the flow table with -C\n"
+			"\t\t add,proto,src,sport,dst,dport,port[,ring]\n"
+			"\t\t del,proto,src,sport,dst,dport\n"
+			"\t\t default,port (port may be drop or flood), flush\n"
+			"\t-V interface configure the VLANs of a port with\n"
+			"\t\t -C vid[,tagged|pvid|del]\n"
+			"\t-M interface join or leave a multicast group with\n"
+			"\t\t -C join|leave,mac[,vid]\n"
+			"\t-Q interface limit the traffic of a port with\n"
+			"\t\t -C rate[,burst[,share]] (kbit/s, Kbytes, percent\n"
+			"\t\t of a destination ring)\n"
+			"\t-T interface set the tx batch of a port with\n"
+			"\t\t -C batch[,latency_us] (batch 0 adapts the batch\n"
+			"\t\t to the latency target)\n"
+			"\t-m interface show the usage of the memory region of\n"
+			"\t\t a port (-m '' for the global region)\n"
 			"", command);
 		return 0;
 	}
 
-	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:")) != -1) {
+	while ((ch = getopt(argc, argv, "d:a:h:g:l:n:r:C:p:P:b:B:s:S:F:f:V:M:Q:T:m:")) != -1) {
 		if (ch != 'C')
 			name = optarg; /* default */
 		switch (ch) {
@@ -264,6 +634,39 @@ usage:
 		case 'P':
 			nr_cmd = NETMAP_BDG_POLLING_OFF;
 			break;
+		case 'b':
+			nr_cmd = NETMAP_BDG_NEWBDG;
+			break;
+		case 'B':
+			nr_cmd = NETMAP_BDG_DELBDG;
+			break;
+		case 's':
+			nr_cmd = NETMAP_BDG_FTSTATS;
+			break;
+		case 'S':
+			nr_cmd = NETMAP_BDG_PORTSTATS;
+			break;
+		case 'F':
+			nr_cmd = NETMAP_BDG_REGOPS;
+			break;
+		case 'f':
+			nr_cmd = -1; /* flow_ctl() */
+			break;
+		case 'V':
+			nr_cmd = NETMAP_BDG_VLAN;
+			break;
+		case 'M':
+			nr_cmd = NETMAP_BDG_MCAST;
+			break;
+		case 'Q':
+			nr_cmd = NETMAP_BDG_QOS;
+			break;
+		case 'T':
+			nr_cmd = NETMAP_BDG_BATCHING;
+			break;
+		case 'm':
+			nr_cmd = -2; /* mem_stats() */
+			break;
 		}
 	}
 	if (optind != argc) {
@@ -272,5 +675,9 @@ usage:
 	}
 	if (argc == 1)
 		nr_cmd = NETMAP_BDG_LIST;
+	if (nr_cmd == -1)
+		return flow_ctl(name, nmr_config) ? 1 : 0;
+	if (nr_cmd == -2)
+		return mem_stats(name) ? 1 : 0;
 	return bdg_ctl(name, nr_cmd, nr_arg, nmr_config) ? 1 : 0;
 }
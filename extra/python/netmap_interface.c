@@ -64,22 +64,22 @@ NetmapInterface_repr(NetmapInterface *self)
             "tx_rings:   %u\n"
             "rx_rings:   %u\n"
             "bufs_head:  %u\n"
+            "memsize:    %u\n"
             "spare1[0]:  0x%08x\n"
             "spare1[1]:  0x%08x\n"
             "spare1[2]:  0x%08x\n"
-            "spare1[3]:  0x%08x\n"
-            "spare1[4]:  0x%08x\n",
+            "spare1[3]:  0x%08x\n",
             nifp->ni_name,
             nifp->ni_version,
             nifp->ni_flags,
             nifp->ni_tx_rings,
             nifp->ni_rx_rings,
             nifp->ni_bufs_head,
+            nifp->ni_memsize,
             nifp->ni_spare1[0],
             nifp->ni_spare1[1],
             nifp->ni_spare1[2],
-            nifp->ni_spare1[3],
-            nifp->ni_spare1[4]
+            nifp->ni_spare1[3]
                 );
 
     return result;
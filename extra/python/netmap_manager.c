@@ -166,14 +166,14 @@ NetmapManager_repr(NetmapManager *self)
             "arg2:      %d\n"
             "arg3:      %d\n"
             "flags:     %s\n"
-            "spare2:    %d\n",
+            "numa_node: %d\n",
             PyString_AsString(self->dev_name),
             PyString_AsString(self->if_name), req->nr_version,
             req->nr_memsize / 1024, req->nr_offset,
             req->nr_tx_slots, req->nr_rx_slots,
             req->nr_tx_rings, req->nr_rx_rings,
             ringid, req->nr_cmd, cmd, req->nr_arg1,
-            req->nr_arg2, req->nr_arg3, flags, req->spare2[0]
+            req->nr_arg2, req->nr_arg3, flags, req->nr_numa_node
                 );
 
     return result;
@@ -205,8 +205,8 @@ static PyMemberDef NetmapManager_members[] = {
         "arg3 field"},
     {"flags", T_UINT, offsetof(NetmapManager, nmreq.nr_flags), 0,
         "flags"},
-    {"spare2", T_UINT, offsetof(NetmapManager, nmreq.spare2[0]), 0,
-        "spare2 field"},
+    {"numa_node", T_UINT, offsetof(NetmapManager, nmreq.nr_numa_node), 0,
+        "numa_node field"},
     {NULL}  /* Sentinel */
 };
 
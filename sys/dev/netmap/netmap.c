@@ -993,6 +993,8 @@ netmap_priv_delete(struct netmap_priv_d *priv)
 		netmap_do_unregif(priv);
 	}
 	netmap_unget_na(na, priv->np_ifp);
+	if (priv->np_extmem)
+		netmap_mem_put(priv->np_extmem);
 	bzero(priv, sizeof(*priv));	/* for safety */
 	free(priv, M_DEVBUF);
 }
@@ -1075,7 +1077,8 @@ netmap_grab_packets(struct netmap_kring *kring, struct mbq *q, int force)
 
 		if ((slot->flags & NS_FORWARD) == 0 && !force)
 			continue;
-		if (slot->len < 14 || slot->len > NETMAP_BUF_SIZE(na)) {
+		if (slot->len < 14 ||
+		    slot->len > NETMAP_BUF_SIZE_IDX(na, slot->buf_idx)) {
 			RD(5, "bad pkt at %d len %d", n, slot->len);
 			continue;
 		}
@@ -1643,7 +1646,7 @@ netmap_ring_reinit(struct netmap_kring *kring)
 			RD(5, "bad index at slot %d idx %d len %d ", i, idx, len);
 			ring->slot[i].buf_idx = 0;
 			ring->slot[i].len = 0;
-		} else if (len > NETMAP_BUF_SIZE(kring->na)) {
+		} else if (len > NETMAP_BUF_SIZE_IDX(kring->na, idx)) {
 			ring->slot[i].len = 0;
 			RD(5, "bad len at slot %d idx %d len %d", i, idx, len);
 		}
@@ -1983,6 +1986,15 @@ netmap_do_regif(struct netmap_priv_d *priv, struct netmap_adapter *na,
 		if (error)
 			goto err_drop_mem;
 
+		if ((flags & NR_RX_LARGE_BUFS) &&
+		    (na->na_flags & NAF_LARGE_BUFS)) {
+			u_int i;
+
+			/* the host ring keeps the regular buffers */
+			for (i = 0; i < na->num_rx_rings; i++)
+				na->rx_rings[i].nr_kflags |= NKR_LBUF;
+		}
+
 		/* create all missing netmap rings */
 		error = netmap_mem_rings_create(na);
 		if (error)
@@ -2072,6 +2084,71 @@ nm_sync_finalize(struct netmap_kring *kring)
 		kring->rhead, kring->rcur, kring->rtail);
 }
 
+/*
+ * NETMAP_MEM_GROW: grow the buffer pool of the region bound to priv
+ * if needed, and prepend nr_arg3 extra buffers to ni_bufs_head.
+ * Call with NMG_LOCK held.
+ */
+static int
+netmap_extra_grow(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	struct netmap_adapter *na = priv->np_na;
+	struct netmap_if *nifp = priv->np_nifp;
+	uint32_t head, cur, n;
+	int error;
+
+	if (nifp == NULL || na == NULL)
+		return ENXIO;
+	error = netmap_mem_grow(na->nm_mem, nmr->nr_arg3);
+	if (error)
+		return error;
+	n = netmap_extra_alloc(na, &head, nmr->nr_arg3);
+	if (n > 0) {
+		/* append the current list to the new one */
+		for (cur = head; ; ) {
+			uint32_t *buf = na->na_lut.lut[cur].vaddr;
+
+			if (*buf == 0) {
+				*buf = nifp->ni_bufs_head;
+				break;
+			}
+			cur = *buf;
+		}
+		nifp->ni_bufs_head = head;
+	}
+	nmr->nr_arg3 = n;
+	return netmap_mem_get_info(na->nm_mem, &nmr->nr_memsize, NULL, NULL);
+}
+
+/*
+ * NETMAP_MEM_EXTMEM: create a memory region in the user memory
+ * described by the struct netmap_extmem_req at nmreq_pointer_get(nmr).
+ * The file descriptor keeps a reference to it.
+ * Call with NMG_LOCK held.
+ */
+static int
+netmap_extmem_reg(struct netmap_priv_d *priv, struct nmreq *nmr)
+{
+	void *uer = nmreq_pointer_get(nmr);
+	struct netmap_extmem_req er;
+	struct netmap_mem_d *nmd;
+	int error;
+
+	if (priv->np_extmem != NULL)
+		return EBUSY;
+	if (copyin(uer, &er, sizeof(er)))
+		return EFAULT;
+	nmd = netmap_mem_ext_create(&er, &error);
+	if (nmd == NULL)
+		return error;
+	if (copyout(&er, uer, sizeof(er))) {
+		netmap_mem_put(nmd);
+		return EFAULT;
+	}
+	priv->np_extmem = nmd;
+	return 0;
+}
+
 /*
  * ioctl(2) support for the "netmap" device.
  *
@@ -2094,6 +2171,9 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 	u_int i, qfirst, qlast;
 	struct netmap_if *nifp;
 	struct netmap_kring *krings;
+	struct netmap_buf_classes bc;
+	struct netmap_mem_stats ms;
+	void *uptr;
 	enum txrx t;
 
 	if (cmd == NIOCGINFO || cmd == NIOCREGIF) {
@@ -2113,11 +2193,18 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 
 	switch (cmd) {
 	case NIOCGINFO:		/* return capabilities etc */
-		if (nmr->nr_cmd == NETMAP_BDG_LIST) {
+		if (nmr->nr_cmd == NETMAP_BDG_LIST ||
+		    nmr->nr_cmd == NETMAP_BDG_FTSTATS ||
+		    nmr->nr_cmd == NETMAP_BDG_PORTSTATS ||
+		    nmr->nr_cmd == NETMAP_BDG_POLLSTATS) {
 			error = netmap_bdg_ctl(nmr, NULL);
 			break;
 		}
 
+		/* the pointer overlays nr_arg2, which is overwritten */
+		uptr = nmr->nr_cmd == NETMAP_MEM_CLASSES ||
+			nmr->nr_cmd == NETMAP_MEM_STATS ?
+			nmreq_pointer_get(nmr) : NULL;
 		NMG_LOCK();
 		do {
 			/* memsize is always valid */
@@ -2140,6 +2227,17 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				&nmr->nr_arg2);
 			if (error)
 				break;
+			nmr->nr_numa_node = netmap_mem_numa_node(nmd);
+			if (nmr->nr_cmd == NETMAP_MEM_STATS && uptr != NULL) {
+				error = netmap_mem_stats(nmd, &ms);
+				if (na != NULL)
+					ms.ms_na_extra_bufs = na->na_extra_bufs;
+				break;
+			}
+			if (uptr != NULL) {
+				error = netmap_mem_buf_classes(nmd, &bc);
+				break;
+			}
 			if (na == NULL) /* only memory info */
 				break;
 			nmr->nr_offset = 0;
@@ -2152,6 +2250,12 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 		} while (0);
 		netmap_unget_na(na, ifp);
 		NMG_UNLOCK();
+		if (uptr != NULL && error == 0) {
+			if (nmr->nr_cmd == NETMAP_MEM_STATS)
+				error = copyout(&ms, uptr, sizeof(ms)) ? EFAULT : 0;
+			else
+				error = copyout(&bc, uptr, sizeof(bc)) ? EFAULT : 0;
+		}
 		break;
 
 	case NIOCREGIF:
@@ -2161,6 +2265,13 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				|| i == NETMAP_BDG_VNET_HDR
 				|| i == NETMAP_BDG_NEWIF
 				|| i == NETMAP_BDG_DELIF
+				|| i == NETMAP_BDG_NEWBDG
+				|| i == NETMAP_BDG_DELBDG
+				|| i == NETMAP_BDG_REGOPS
+				|| i == NETMAP_BDG_VLAN
+				|| i == NETMAP_BDG_MCAST
+				|| i == NETMAP_BDG_QOS
+				|| i == NETMAP_BDG_BATCHING
 				|| i == NETMAP_BDG_POLLING_ON
 				|| i == NETMAP_BDG_POLLING_OFF) {
 			error = netmap_bdg_ctl(nmr, NULL);
@@ -2179,6 +2290,16 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 			netmap_unget_na(na, ifp);
 			NMG_UNLOCK();
 			break;
+		} else if (i == NETMAP_MEM_GROW) {
+			NMG_LOCK();
+			error = netmap_extra_grow(priv, nmr);
+			NMG_UNLOCK();
+			break;
+		} else if (i == NETMAP_MEM_EXTMEM) {
+			NMG_LOCK();
+			error = netmap_extmem_reg(priv, nmr);
+			NMG_UNLOCK();
+			break;
 		} else if (i != 0) {
 			D("nr_cmd must be 0 not %d", i);
 			error = EINVAL;
@@ -2212,6 +2333,15 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				break;
 			}
 
+			if (nmr->nr_flags & NR_NUMA_NODE) {
+				error = netmap_mem_set_numa_node(na->nm_mem,
+						nmr->nr_numa_node);
+				if (error) {
+					netmap_unget_na(na, ifp);
+					break;
+				}
+			}
+
 			error = netmap_do_regif(priv, na, nmr->nr_ringid, nmr->nr_flags);
 			if (error) {    /* reg. failed, release priv and ref */
 				netmap_unget_na(na, ifp);
@@ -2232,6 +2362,7 @@ netmap_ioctl(struct netmap_priv_d *priv, u_long cmd, caddr_t data, struct thread
 				netmap_unget_na(na, ifp);
 				break;
 			}
+			nmr->nr_numa_node = netmap_mem_numa_node(na->nm_mem);
 			if (memflags & NETMAP_MEM_PRIVATE) {
 				*(uint32_t *)(uintptr_t)&nifp->ni_flags |= NI_PRIV_MEM;
 			}
@@ -45,6 +45,9 @@
 #include <vm/vm_object.h>
 #include <vm/vm_page.h>
 #include <vm/vm_pager.h>
+#include <vm/vm_phys.h>	/* vm_ndomains */
+#include <vm/vm_map.h>
+#include <vm/vm_extern.h>	/* vm_fault_quick_hold_pages(), kva_alloc() */
 #include <vm/uma.h>
 
 
@@ -1006,6 +1009,111 @@ nm_os_ncpus(void)
 	return mp_maxid + 1;
 }
 
+u_int
+nm_os_curcpu(void)
+{
+	return curcpu;
+}
+
+/* XXX regions are not placed on FreeBSD, see contigmalloc_node */
+int
+nm_os_numa_node(struct netmap_adapter *na)
+{
+	return -1;
+}
+
+int
+nm_os_numa_node_online(int node)
+{
+	return node >= 0 && node < vm_ndomains;
+}
+
+/* pages of a user memory area, held and mapped in the kernel */
+struct nm_os_extmem {
+	vm_page_t *pages;
+	u_int nr_pages;
+	vm_offset_t kva;
+};
+
+void
+nm_os_extmem_delete(struct nm_os_extmem *e)
+{
+	if (e->kva) {
+		pmap_qremove(e->kva, e->nr_pages);
+		kva_free(e->kva, ptoa(e->nr_pages));
+	}
+	if (e->nr_pages)
+		vm_page_unhold_pages(e->pages, e->nr_pages);
+	free(e->pages, M_DEVBUF);
+	free(e, M_DEVBUF);
+}
+
+struct nm_os_extmem *
+nm_os_extmem_create(unsigned long p, u_int size, int *perror)
+{
+	struct nm_os_extmem *e;
+	u_int nr_pages = atop(size);
+	int res;
+
+	e = malloc(sizeof(*e), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (e == NULL) {
+		*perror = ENOMEM;
+		return NULL;
+	}
+	e->pages = malloc(nr_pages * sizeof(*e->pages), M_DEVBUF,
+		M_NOWAIT | M_ZERO);
+	if (e->pages == NULL) {
+		*perror = ENOMEM;
+		goto out;
+	}
+	res = vm_fault_quick_hold_pages(&curproc->p_vmspace->vm_map,
+		p, size, VM_PROT_READ | VM_PROT_WRITE, e->pages, nr_pages);
+	if (res != (int)nr_pages) {
+		D("cannot hold %u pages at %lx", nr_pages, p);
+		*perror = EFAULT;
+		goto out;
+	}
+	e->nr_pages = nr_pages;
+	e->kva = kva_alloc(size);
+	if (e->kva == 0) {
+		*perror = ENOMEM;
+		goto out;
+	}
+	pmap_qenter(e->kva, e->pages, nr_pages);
+	return e;
+
+out:
+	nm_os_extmem_delete(e);
+	return NULL;
+}
+
+char *
+nm_os_extmem_kaddr(struct nm_os_extmem *e)
+{
+	return (char *)e->kva;
+}
+
+vm_paddr_t
+nm_os_extmem_paddr(struct nm_os_extmem *e, vm_ooffset_t off)
+{
+	return VM_PAGE_TO_PHYS(e->pages[atop(off)]) + (off & PAGE_MASK);
+}
+
+uint64_t
+nm_os_uptime_ns(void)
+{
+	struct timespec ts;
+
+	nanouptime(&ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void
+nm_os_kthread_usleep(u_int usec)
+{
+	pause_sbt("nm_poll", SBT_1US * usec, 0, 0);
+}
+
 struct nm_kthread_ctx {
 	struct thread *user_td;		/* thread user-space (kthread creator) to send ioctl */
 	/* notification to guest (interrupt) */
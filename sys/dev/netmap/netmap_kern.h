@@ -267,7 +267,9 @@ typedef struct hrtimer{
 
 struct netmap_adapter;
 struct nm_bdg_fwd;
+struct nm_bdg_dst;
 struct nm_bridge;
+struct nm_bdg_set;
 struct netmap_priv_d;
 
 /* os-specific NM_SELINFO_T initialzation/destruction functions */
@@ -396,6 +398,7 @@ struct netmap_kring {
 #define NKR_FORWARD	0x4		/* (host ring only) there are
 					   packets to forward
 					 */
+#define NKR_LBUF	0x8		/* the ring uses large buffers */
 
 	uint32_t	nr_mode;
 	uint32_t	nr_pending_mode;
@@ -432,6 +435,31 @@ struct netmap_kring {
 #define NR_NOSLOT	((uint32_t)~0)	/* used in nkr_*lease* */
 	uint32_t	nkr_hwlease;
 	uint32_t	nkr_lease_idx;
+	/* on tx rings of VALE ports, the bridge epoch seen by the
+	 * txsync currently forwarding from this ring, 0 if none
+	 * (see nm_bdg_sync() in netmap_vale.c)
+	 */
+	volatile uint32_t nkr_bdg_epoch;
+
+	/* counters of VALE ports. Tx rings are only updated by the
+	 * thread that forwards from the ring, rx rings under q_lock
+	 * (see nm_bdg_flush() in netmap_vale.c)
+	 */
+	struct nm_bdg_ringstats nkr_bdg_stats;
+
+	/* token bucket of the ingress policer of a VALE tx ring
+	 * (bytes, and microseconds of the last refill), used only
+	 * by the thread that forwards from the ring.
+	 */
+	uint64_t	nkr_bdg_tokens;
+	uint64_t	nkr_bdg_tstamp;
+
+	/* adaptive batching of VALE tx rings (see nm_bdg_batch()):
+	 * moving averages of the cost of a slot (ns * 16) and of
+	 * the slots per txsync (* 16).
+	 */
+	uint32_t	nkr_bdg_pktns;
+	uint32_t	nkr_bdg_arrival;
 
 	/* while nkr_stopped is set, no new [tr]xsync operations can
 	 * be started on this kring.
@@ -594,6 +622,9 @@ struct netmap_lut {
 	struct lut_entry *lut;
 	uint32_t objtotal;	/* max buffer index */
 	uint32_t objsize;	/* buffer size */
+	/* large buffers, if any, are [lfirst, objtotal) */
+	uint32_t lfirst;
+	uint32_t lobjsize;	/* their size (objsize if none) */
 };
 
 struct netmap_vp_adapter; // forward
@@ -639,6 +670,7 @@ struct netmap_adapter {
 #define NAF_HOST_RINGS  64	/* the adapter supports the host rings */
 #define NAF_FORCE_NATIVE 128	/* the adapter is always NATIVE */
 #define NAF_PTNETMAP_HOST 256	/* the adapter supports ptnetmap in the host */
+#define NAF_LARGE_BUFS	512	/* the rx rings may use large buffers */
 #define NAF_ZOMBIE	(1U<<30) /* the nic driver has been unloaded */
 #define	NAF_BUSY	(1U<<31) /* the adapter is used internally and
 				  * cannot be registered from userspace
@@ -774,6 +806,7 @@ struct netmap_adapter {
 	 */
  	struct netmap_mem_d *nm_mem;
 	struct netmap_lut na_lut;
+	u_int na_extra_bufs;	/* held through netmap_extra_alloc() */
 
 	/* additional information attached to this adapter
 	 * by other netmap subsystems. Currently used by
@@ -856,9 +889,39 @@ struct netmap_vp_adapter {	/* VALE software port */
 
 	/* Maximum Frame Size, used in bdg_mismatch_datapath() */
 	u_int mfs;
-	/* Last source MAC on this port */
+	/* Last source MAC on this port, and when it was learned */
 	uint64_t last_smac;
+	uint32_t last_stamp;
+
+	/*
+	 * VLAN configuration, only used if the bridge is VLAN aware.
+	 * Untagged frames belong to bdg_pvid (0 means they are dropped)
+	 * and frames in bdg_pvid leave the port untagged.
+	 * bdg_vlans is the bitmap of the VLANs of the port.
+	 */
+	uint16_t bdg_pvid;
+	uint32_t bdg_vlans[4096 / 32];
+
+	/*
+	 * QoS configuration (NETMAP_BDG_QOS). Traffic from the port
+	 * is policed to bdg_rate bytes/s (0 means no limit) with
+	 * bursts of bdg_burst bytes, and may only fill bdg_share
+	 * percent of the destination rings.
+	 */
+	uint64_t bdg_rate;
+	uint32_t bdg_burst;
+	uint32_t bdg_share;
+
+	/*
+	 * Batching (NETMAP_BDG_BATCHING): a fixed batch size, or a
+	 * latency target in microseconds for the adaptive batching,
+	 * 0 to use the bridge_batch and bridge_batch_latency sysctls.
+	 */
+	uint32_t bdg_batch;
+	uint32_t bdg_latency;
 };
+#define NM_VLAN_ISSET(vpna, vid) \
+	((vpna)->bdg_vlans[(vid) >> 5] & (1U << ((vid) & 31)))
 
 
 struct netmap_hw_adapter {	/* physical device */
@@ -1379,24 +1442,62 @@ int netmap_get_hw_na(struct ifnet *ifp, struct netmap_adapter **na);
  * kernel modules.
  *
  * VALE only supports unicast or broadcast. The lookup
- * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports,
- * NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 for unknown.
+ * function can return 0 .. NM_BDG_MAXPORTS-1 for regular ports
+ * (actually less than the number of ports the switch was created
+ * with), NM_BDG_MAXPORTS for broadcast, NM_BDG_MAXPORTS+1 for unknown.
  * XXX in practice "unknown" might be handled same as broadcast.
+ * A broadcast can be restricted to the members of a multicast
+ * group of the switch by setting ft_group in the first slot.
+ *
+ * The optional lookup_batch function resolves a whole batch of n
+ * slots at once, so that it can hash all packets and prefetch the
+ * table before using it. For each packet starting at ft[i] it must
+ * set dst[i] (ring_nr is the source ring). If present, it is used
+ * instead of lookup.
+ *
+ * The optional init function is called by NETMAP_BDG_REGOPS with
+ * the request, and returns the private data of the bridge (NULL on
+ * failure). The private data is passed to lookup, lookup_batch and
+ * config, and released with fini when the callbacks are replaced
+ * or the bridge is destroyed.
+ * Note that lookup and config always take the private data as their
+ * last argument (NULL if there is no init function): modules written
+ * for the older three-argument lookup and one-argument config must
+ * add it, see examples/switch-modules/ for an updated module.
  */
 typedef u_int (*bdg_lookup_fn_t)(struct nm_bdg_fwd *ft, uint8_t *ring_nr,
-		struct netmap_vp_adapter *);
-typedef int (*bdg_config_fn_t)(struct nm_ifreq *);
+		struct netmap_vp_adapter *, void *private_data);
+typedef void (*bdg_lookup_batch_fn_t)(struct nm_bdg_fwd *ft, u_int n,
+		struct nm_bdg_dst *dst, u_int ring_nr,
+		struct netmap_vp_adapter *, void *private_data);
+typedef int (*bdg_config_fn_t)(struct nm_ifreq *, void *private_data);
 typedef void (*bdg_dtor_fn_t)(const struct netmap_vp_adapter *);
+typedef void *(*bdg_init_fn_t)(struct nmreq *);
+typedef void (*bdg_fini_fn_t)(void *private_data);
 struct netmap_bdg_ops {
 	bdg_lookup_fn_t lookup;
 	bdg_config_fn_t config;
 	bdg_dtor_fn_t	dtor;
+	bdg_lookup_batch_fn_t lookup_batch;
+	bdg_init_fn_t	init;
+	bdg_fini_fn_t	fini;
 };
 
 u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
-		struct netmap_vp_adapter *);
-
-#define	NM_BDG_MAXPORTS		254	/* up to 254 */
+		struct netmap_vp_adapter *, void *private_data);
+void netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		struct nm_bdg_dst *dst, u_int ring_nr,
+		struct netmap_vp_adapter *, void *private_data);
+
+/* exact match flow table, see netmap_vale_flow.c */
+extern struct netmap_bdg_ops netmap_bdg_flow_ops;
+uint8_t *nm_bdg_eth_hdr(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		u_int *len);
+void *nm_bdg_valloc(size_t l);	/* zeroed, vmalloc on linux */
+void nm_bdg_vfree(void *p);
+
+#define	NM_BDG_MAXPORTS		65533	/* ports must fit in 16 bits */
+#define	NM_BDG_DEFPORTS		254	/* default ports of a switch */
 #define	NM_BDG_BROADCAST	NM_BDG_MAXPORTS
 #define	NM_BDG_NOPORT		(NM_BDG_MAXPORTS+1)
 
@@ -1404,8 +1505,8 @@ u_int netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
 
 /* these are redefined in case of no VALE support */
 int netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create);
-struct nm_bridge *netmap_init_bridges2(u_int);
-void netmap_uninit_bridges2(struct nm_bridge *, u_int);
+struct nm_bdg_set *netmap_init_bridges2(void);
+void netmap_uninit_bridges2(struct nm_bdg_set *);
 int netmap_init_bridges(void);
 void netmap_uninit_bridges(void);
 int netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops);
@@ -1444,12 +1545,12 @@ void netmap_monitor_stop(struct netmap_adapter *na);
 #ifdef CONFIG_NET_NS
 struct net *netmap_bns_get(void);
 void netmap_bns_put(struct net *);
-void netmap_bns_getbridges(struct nm_bridge **, u_int *);
+void netmap_bns_getbridges(struct nm_bdg_set **);
 #else
 #define netmap_bns_get()
 #define netmap_bns_put(_1)
-#define netmap_bns_getbridges(b, n) \
-	do { *b = nm_bridges; *n = NM_BRIDGES; } while (0)
+#define netmap_bns_getbridges(b) \
+	do { *b = nm_bridges; } while (0)
 #endif
 
 /* Various prototypes */
@@ -1501,6 +1602,12 @@ int netmap_adapter_put(struct netmap_adapter *na);
  */
 #define NETMAP_BUF_BASE(_na)	((_na)->na_lut.lut[0].vaddr)
 #define NETMAP_BUF_SIZE(_na)	((_na)->na_lut.objsize)
+/* size of buffer _i, which may belong to the large class
+ * (bad indexes map to buffer 0, see NMB())
+ */
+#define NETMAP_BUF_SIZE_IDX(_na, _i)				\
+	((_i) >= (_na)->na_lut.lfirst && (_i) < (_na)->na_lut.objtotal ? \
+	 (_na)->na_lut.lobjsize : (_na)->na_lut.objsize)
 extern int netmap_mitigate;	// XXX not really used
 extern int netmap_no_pendintr;
 extern int netmap_verbose;	// XXX debugging
@@ -1780,6 +1887,8 @@ struct netmap_priv_d {
 	 */
 	NM_SELINFO_T *np_si[NR_TXRX];
 	struct thread	*np_td;		/* kqueue, just debugging */
+	/* region created with NETMAP_MEM_EXTMEM, kept until close */
+	struct netmap_mem_d *np_extmem;
 };
 
 struct netmap_priv_d *netmap_priv_new(void);
@@ -1893,13 +2002,21 @@ void nm_os_mitigation_cleanup(struct nm_generic_mit *mit);
  */
 struct nm_bdg_fwd {	/* forwarding entry for a bridge */
 	void *ft_buf;		/* netmap or indirect buffer */
+	struct netmap_slot *ft_slot; /* source slot, NULL if indirect */
 	uint8_t ft_frags;	/* how many fragments (only on 1st frag) */
-	uint8_t _ft_port;	/* dst port (unused) */
+	uint8_t ft_group;	/* multicast group + 1, 0 if none */
 	uint16_t ft_flags;	/* flags, e.g. indirect */
 	uint16_t ft_len;	/* src fragment len */
 	uint16_t ft_next;	/* next packet to same destination */
 };
 
+/* destination of a packet, as returned by a batch lookup */
+struct nm_bdg_dst {
+	uint16_t dst_port;	/* port, NM_BDG_BROADCAST or NM_BDG_NOPORT */
+	uint8_t dst_ring;	/* ring in the destination port */
+	uint8_t _dst_pad;
+};
+
 /* struct 'virtio_net_hdr' from linux. */
 struct nm_vnet_hdr {
 #define VIRTIO_NET_HDR_F_NEEDS_CSUM     1	/* Use csum_start, csum_offset */
@@ -2013,6 +2130,18 @@ void nm_os_kthread_wakeup_worker(struct nm_kthread *nmk);
 void nm_os_kthread_send_irq(struct nm_kthread *);
 void nm_os_kthread_set_affinity(struct nm_kthread *, int);
 u_int nm_os_ncpus(void);
+uint64_t nm_os_uptime_ns(void);	/* monotonic clock */
+void nm_os_kthread_usleep(u_int);	/* sleep in a kthread */
+u_int nm_os_curcpu(void);	/* only a hint, we may migrate */
+int nm_os_numa_node(struct netmap_adapter *);	/* of the NIC, or -1 */
+int nm_os_numa_node_online(int);
+
+/* user memory pinned for NETMAP_MEM_EXTMEM */
+struct nm_os_extmem;
+struct nm_os_extmem *nm_os_extmem_create(unsigned long, u_int, int *);
+void nm_os_extmem_delete(struct nm_os_extmem *);
+char *nm_os_extmem_kaddr(struct nm_os_extmem *);
+vm_paddr_t nm_os_extmem_paddr(struct nm_os_extmem *, vm_ooffset_t);
 
 #ifdef WITH_PTNETMAP_HOST
 /*
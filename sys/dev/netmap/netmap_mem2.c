@@ -72,11 +72,23 @@ MALLOC_DEFINE(M_NETMAP, "netmap", "Network memory map");
 
 #define NETMAP_POOL_MAX_NAMSZ	32
 
+/*
+ * Clusters are allocated on the NUMA node of the region where the OS
+ * glue provides contigmalloc_node(), a preference, not a constraint.
+ * Elsewhere regions are not placed and report node -1.
+ */
+#ifndef contigmalloc_node
+#define contigmalloc_node(sz, ty, fl, lo, hi, al, bd, node)	\
+	contigmalloc(sz, ty, fl, lo, hi, al, bd)
+#define NM_NO_NUMA
+#endif
+
 
 enum {
 	NETMAP_IF_POOL   = 0,
 	NETMAP_RING_POOL,
 	NETMAP_BUF_POOL,
+	NETMAP_LBUF_POOL,	/* large buffers, may be empty */
 	NETMAP_POOLS_NR
 };
 
@@ -84,6 +96,9 @@ enum {
 struct netmap_obj_params {
 	u_int size;
 	u_int num;
+	u_int hugepage;	/* cluster page size, 0 for base pages */
+	u_int max_num;	/* the pool may grow up to this, see netmap_mem_grow() */
+	u_int lazy;	/* allocate the clusters on demand */
 };
 
 struct netmap_obj_pool {
@@ -97,10 +112,26 @@ struct netmap_obj_pool {
 	u_int numclusters;	/* actual number of clusters */
 
 	u_int objfree;          /* number of free objects. */
-
-	struct lut_entry *lut;  /* virt,phys addresses, objtotal entries */
+	u_int objmax;		/* capacity of lut and bitmap, >= objtotal */
+	u_int unbacked;		/* clusters not allocated yet, see
+				 * netmap_mem_populate()
+				 */
+	u_int lazy_next;	/* first cluster that may be unbacked */
+	char *ext_base;		/* clusters carved from user memory, see
+				 * netmap_mem_ext_create()
+				 */
+	u_int objpeak;		/* max objects in use, see netmap_mem_stats() */
+	u_long allocfail;	/* requests the pool could not satisfy */
+
+	struct lut_entry *lut;  /* virt,phys addresses, objmax entries */
 	uint32_t *bitmap;       /* one bit per buffer, 1 means free */
 	uint32_t bitmap_slots;	/* number of uint32 entries in bitmap */
+	/* one bit per bitmap entry, 1 means it has free objects,
+	 * so that searches skip 1024 objects per summary word.
+	 * Updated with netmap_obj_sum().
+	 */
+	uint32_t *summary;
+	uint32_t summary_slots;	/* number of uint32 entries in summary */
 	/* ---------------------------------------------------*/
 
 	/* limits */
@@ -115,10 +146,18 @@ struct netmap_obj_pool {
 	u_int _clustsize;       /* cluster size */
 	u_int _clustentries;    /* objects per cluster */
 	u_int _numclusters;	/* number of clusters */
+	u_int _hugepage;	/* clusters are naturally aligned pages
+				 * of this size, 0 if not
+				 */
+	u_int _objmax;		/* objects the pool may grow to */
+	u_int _lazy;		/* clusters are allocated on demand */
 
 	/* requested values */
 	u_int r_objtotal;
 	u_int r_objsize;
+	u_int r_hugepage;
+	u_int r_objmax;
+	u_int r_lazy;
 };
 
 #define NMA_LOCK_T		NM_MTX_T
@@ -177,17 +216,45 @@ static const struct netmap_if nms_if_blueprint = {
     .ni_rx_rings = 0
 };
 
+/*
+ * Per-CPU cache of free buffers, see netmap_buf_get().
+ */
+#define NETMAP_BUF_CACHE_MAX	256	/* max buffers per magazine */
+struct netmap_buf_cache {
+	NM_LOCK_T	lock;
+	u_int		n;	/* valid entries in idx */
+	u_int		hits;	/* not yet in netmap_buf_cache_hits */
+	uint32_t	idx[2 * NETMAP_BUF_CACHE_MAX];
+};
+
 struct netmap_mem_d {
 	NMA_LOCK_T nm_mtx;  /* protect the allocator */
 	u_int nm_totalsize; /* shorthand */
 
+	/* the bitmap of the buffer pool has its own lock, so that
+	 * buffers can be allocated and freed without nm_mtx, and
+	 * per-CPU caches in front of it (ncaches == 0 if none).
+	 */
+	NM_LOCK_T bufs_lock;
+	struct netmap_buf_cache *bufcache;
+	u_int ncaches;
+	u_int bufcache_m;	/* magazine size */
+
 	u_int flags;
 #define NETMAP_MEM_FINALIZED	0x1	/* preallocation done */
 	int lasterr;		/* last error for curr config */
 	int active;		/* active users */
 	int refcount;
-	/* the three allocators */
+	int numa_node;		/* where the memory is, -1 if anywhere */
+	int r_numa_node;	/* requested for the next finalize */
+	int dma_users;		/* adapters with the buffers mapped for DMA */
+	u_int extra_bufs;	/* held by the ports, under NMG_LOCK */
+	/* the allocators */
 	struct netmap_obj_pool pools[NETMAP_POOLS_NR];
+	/* lut of both buffer classes, the large buffers following
+	 * the regular ones. NULL if there are no large buffers.
+	 */
+	struct lut_entry *buf_lut;
 
 	nm_memid_t nm_id;	/* allocator identifier */
 	int nm_grp;	/* iommu groupd id */
@@ -253,8 +320,14 @@ static int netmap_mem_map(struct netmap_obj_pool *, struct netmap_adapter *);
 static int netmap_mem_unmap(struct netmap_obj_pool *, struct netmap_adapter *);
 static int nm_mem_assign_group(struct netmap_mem_d *, struct device *);
 
-#define NMA_LOCK_INIT(n)	NM_MTX_INIT((n)->nm_mtx)
-#define NMA_LOCK_DESTROY(n)	NM_MTX_DESTROY((n)->nm_mtx)
+#define NMA_LOCK_INIT(n)	do {					\
+	NM_MTX_INIT((n)->nm_mtx);					\
+	mtx_init(&(n)->bufs_lock, "nm_bufs", NULL, MTX_DEF);		\
+} while (0)
+#define NMA_LOCK_DESTROY(n)	do {					\
+	NM_MTX_DESTROY((n)->nm_mtx);					\
+	mtx_destroy(&(n)->bufs_lock);					\
+} while (0)
 #define NMA_LOCK(n)		NM_MTX_LOCK((n)->nm_mtx)
 #define NMA_UNLOCK(n)		NM_MTX_UNLOCK((n)->nm_mtx)
 
@@ -292,6 +365,39 @@ void netmap_mem_put(struct netmap_mem_d *nmd)
 		netmap_mem_delete(nmd);
 }
 
+static void netmap_mem_reset_all(struct netmap_mem_d *nmd);
+static int netmap_mem_populate(struct netmap_mem_d *nmd, u_int n);
+static int netmap_mem_back(struct netmap_mem_d *nmd, u_int c);
+
+/*
+ * Choose the NUMA node of a region that is not in use: the one
+ * requested with NR_NUMA_NODE if any, otherwise the node of the NIC
+ * for hardware adapters. If the region is still allocated elsewhere
+ * it is released, and finalize allocates it again on the new node.
+ * Regions used by someone stay where they are.
+ * Call with NMA_LOCK held.
+ */
+static void
+netmap_mem_numa_select(struct netmap_mem_d *nmd, struct netmap_adapter *na)
+{
+	int node = nmd->r_numa_node;
+
+	nmd->r_numa_node = -1;
+#ifndef NM_NO_NUMA
+	if (nmd->active || (nmd->flags & (NETMAP_MEM_IO | NETMAP_MEM_EXT)))
+		return;
+	if (node < 0)
+		node = nm_os_numa_node(na);
+	if (node < 0 || node == nmd->numa_node)
+		return;
+	if (nmd->flags & NETMAP_MEM_FINALIZED)
+		netmap_mem_reset_all(nmd);
+	if (netmap_verbose)
+		D("%s: memory on node %d", na->name, node);
+	nmd->numa_node = node;
+#endif /* !NM_NO_NUMA */
+}
+
 int
 netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
@@ -299,23 +405,81 @@ netmap_mem_finalize(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		return ENOMEM;
 	} else {
 		NMA_LOCK(nmd);
+		netmap_mem_numa_select(nmd, na);
 		nmd->lasterr = nmd->ops->nmd_finalize(nmd);
+#ifdef linux
+		/* the device only sees the buffers mapped below */
+		if (!nmd->lasterr && na->pdev)
+			netmap_mem_populate(nmd, ~0U);
+#endif /* linux */
 		NMA_UNLOCK(nmd);
 	}
 
-	if (!nmd->lasterr && na->pdev)
+	if (!nmd->lasterr && na->pdev) {
 		netmap_mem_map(&nmd->pools[NETMAP_BUF_POOL], na);
+		NMA_LOCK(nmd);
+		nmd->dma_users++;
+		NMA_UNLOCK(nmd);
+	}
 
 	return nmd->lasterr;
 }
 
 static int netmap_mem_init_shared_info(struct netmap_mem_d *nmd);
+static void netmap_buf_cache_flush(struct netmap_mem_d *nmd);
+
+/* update the summary bit of bitmap entry i */
+static inline void
+netmap_obj_sum(struct netmap_obj_pool *p, uint32_t i)
+{
+	uint32_t mask = 1U << (i & 31);
+
+	if (p->bitmap[i])
+		p->summary[i >> 5] |= mask;
+	else
+		p->summary[i >> 5] &= ~mask;
+}
+
+/*
+ * Tell if object j has memory. The objects of the clusters of a
+ * lazy pool not allocated yet point to object 0.
+ */
+static inline int
+netmap_obj_backed(struct netmap_obj_pool *p, u_int j)
+{
+	return p->lut[j].vaddr != NULL &&
+	    (j < p->_clustentries || p->lut[j].vaddr != p->lut[0].vaddr);
+}
+
+/* update the peak usage after an allocation, with the pool locked */
+static inline void
+netmap_obj_peak(struct netmap_obj_pool *p)
+{
+	u_int used = p->objtotal - p->unbacked * p->_clustentries - p->objfree;
+
+	if (used > p->objpeak)
+		p->objpeak = used;
+}
+
+/* rebuild the summary after a change of the whole bitmap */
+static void
+netmap_obj_sum_init(struct netmap_obj_pool *p)
+{
+	uint32_t i;
+
+	memset(p->summary, 0, sizeof(uint32_t) * p->summary_slots);
+	for (i = 0; i < p->bitmap_slots; i++)
+		if (p->bitmap[i])
+			p->summary[i >> 5] |= 1U << (i & 31);
+}
 
 void
 netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 {
 	NMA_LOCK(nmd);
 	netmap_mem_unmap(&nmd->pools[NETMAP_BUF_POOL], na);
+	if (na->pdev && nmd->dma_users > 0)
+		nmd->dma_users--;
 	if (nmd->active == 1) {
 		u_int i;
 
@@ -324,12 +488,13 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 		 * pool resources leaked by unclean application exits are
 		 * reclaimed.
 		 */
+		netmap_buf_cache_flush(nmd);
 		for (i = 0; i < NETMAP_POOLS_NR; i++) {
 			struct netmap_obj_pool *p;
 			u_int j;
 
 			p = &nmd->pools[i];
-			p->objfree = p->objtotal;
+			p->objfree = p->objtotal - p->unbacked * p->_clustentries;
 			/*
 			 * Reproduce the net effect of the M_ZERO malloc()
 			 * and marking of free entries in the bitmap that
@@ -345,10 +510,12 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 			 * free.
 			 */
 			for (j = 0; j < p->objtotal; j++) {
-				if (p->lut[j].vaddr != NULL) {
+				if (netmap_obj_backed(p, j)) {
 					p->bitmap[ (j>>5) ] |=  ( 1 << (j & 31) );
 				}
 			}
+			if (p->summary)
+				netmap_obj_sum_init(p);
 		}
 
 		/*
@@ -363,6 +530,7 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 			 * netmap_mem_init_shared_info must not be called
 			 * by ptnetmap guest. */
 			nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+			netmap_obj_sum(&nmd->pools[NETMAP_BUF_POOL], 0);
 
 			/* expose info to the ptnetmap guest */
 			netmap_mem_init_shared_info(nmd);
@@ -378,9 +546,17 @@ netmap_mem_deref(struct netmap_mem_d *nmd, struct netmap_adapter *na)
 static int
 netmap_mem2_get_lut(struct netmap_mem_d *nmd, struct netmap_lut *lut)
 {
-	lut->lut = nmd->pools[NETMAP_BUF_POOL].lut;
-	lut->objtotal = nmd->pools[NETMAP_BUF_POOL].objtotal;
-	lut->objsize = nmd->pools[NETMAP_BUF_POOL]._objsize;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL],
+		*lp = &nmd->pools[NETMAP_LBUF_POOL];
+
+	/* indexes up to objmax are valid, the ones not yet backed by
+	 * memory point to buffer 0 (see netmap_mem_grow())
+	 */
+	lut->lut = nmd->buf_lut ? nmd->buf_lut : p->lut;
+	lut->objtotal = p->objmax + lp->objtotal;
+	lut->objsize = p->_objsize;
+	lut->lfirst = p->objmax;
+	lut->lobjsize = lp->objtotal ? lp->_objsize : p->_objsize;
 
 	return 0;
 }
@@ -398,6 +574,10 @@ static struct netmap_obj_params netmap_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = NETMAP_BUF_MAX_NUM,
 	},
+	[NETMAP_LBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 static struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
@@ -413,6 +593,10 @@ static struct netmap_obj_params netmap_min_priv_params[NETMAP_POOLS_NR] = {
 		.size = 2048,
 		.num  = 4098,
 	},
+	[NETMAP_LBUF_POOL] = {
+		.size = 9216,
+		.num  = 0,
+	},
 };
 
 
@@ -445,10 +629,19 @@ struct netmap_mem_d nm_mem = {	/* Our memory allocator. */
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_LBUF_POOL] = {
+			.name	= "netmap_lbuf",
+			.objminsize = 64,
+			.objmaxsize = 65535,	/* fits nr_buf_size */
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.nm_id = 1,
 	.nm_grp = -1,
+	.numa_node = -1,
+	.r_numa_node = -1,
 
 	.prev = &nm_mem,
 	.next = &nm_mem,
@@ -485,9 +678,18 @@ static const struct netmap_mem_d nm_blueprint = {
 			.nummin     = 4,
 			.nummax	    = 1000000, /* one million! */
 		},
+		[NETMAP_LBUF_POOL] = {
+			.name	= "%s_lbuf",
+			.objminsize = 64,
+			.objmaxsize = 65535,
+			.nummin     = 0,
+			.nummax	    = 1000000,
+		},
 	},
 
 	.flags = NETMAP_MEM_PRIVATE,
+	.numa_node = -1,
+	.r_numa_node = -1,
 
 	.ops = &netmap_mem_private_ops
 };
@@ -508,6 +710,12 @@ static const struct netmap_mem_d nm_blueprint = {
 	    CTLFLAG_RW, &netmap_params[id].num, 0, "Requested number of netmap " STRINGIFY(name) "s"); \
 	SYSCTL_INT(_dev_netmap, OID_AUTO, name##_curr_num, \
 	    CTLFLAG_RD, &nm_mem.pools[id].objtotal, 0, "Current number of netmap " STRINGIFY(name) "s"); \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, name##_curr_free, \
+	    CTLFLAG_RD, &nm_mem.pools[id].objfree, 0, "Free netmap " STRINGIFY(name) "s"); \
+	SYSCTL_INT(_dev_netmap, OID_AUTO, name##_peak_num, \
+	    CTLFLAG_RD, &nm_mem.pools[id].objpeak, 0, "Max netmap " STRINGIFY(name) "s in use"); \
+	SYSCTL_ULONG(_dev_netmap, OID_AUTO, name##_alloc_fail, \
+	    CTLFLAG_RD, &nm_mem.pools[id].allocfail, 0, "Failed allocations of netmap " STRINGIFY(name) "s"); \
 	SYSCTL_INT(_dev_netmap, OID_AUTO, priv_##name##_size, \
 	    CTLFLAG_RW, &netmap_min_priv_params[id].size, 0, \
 	    "Default size of private netmap " STRINGIFY(name) "s"); \
@@ -519,6 +727,34 @@ static const struct netmap_mem_d nm_blueprint = {
 DECLARE_SYSCTLS(NETMAP_IF_POOL, if);
 DECLARE_SYSCTLS(NETMAP_RING_POOL, ring);
 DECLARE_SYSCTLS(NETMAP_BUF_POOL, buf);
+DECLARE_SYSCTLS(NETMAP_LBUF_POOL, lbuf);
+
+SYSBEGIN(mem2_hugepage);
+SYSCTL_INT(_dev_netmap, OID_AUTO, buf_hugepage, CTLFLAG_RW,
+    &netmap_params[NETMAP_BUF_POOL].hugepage, 0,
+    "Page size for the clusters of netmap buffers (0: base pages)");
+SYSCTL_INT(_dev_netmap, OID_AUTO, priv_buf_hugepage, CTLFLAG_RW,
+    &netmap_min_priv_params[NETMAP_BUF_POOL].hugepage, 0,
+    "Page size for the clusters of private netmap buffers");
+SYSEND;
+
+SYSBEGIN(mem2_grow);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_max_num, CTLFLAG_RW,
+    &netmap_params[NETMAP_BUF_POOL].max_num, 0,
+    "Max number of netmap buffers after growth (0: no growth)");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, priv_buf_max_num, CTLFLAG_RW,
+    &netmap_min_priv_params[NETMAP_BUF_POOL].max_num, 0,
+    "Max number of private netmap buffers after growth");
+SYSEND;
+
+SYSBEGIN(mem2_lazy);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_lazy, CTLFLAG_RW,
+    &netmap_params[NETMAP_BUF_POOL].lazy, 0,
+    "Allocate the clusters of netmap buffers on demand");
+SYSCTL_UINT(_dev_netmap, OID_AUTO, priv_buf_lazy, CTLFLAG_RW,
+    &netmap_min_priv_params[NETMAP_BUF_POOL].lazy, 0,
+    "Allocate the clusters of private netmap buffers on demand");
+SYSEND;
 
 /* call with NMA_LOCK(&nm_mem) held */
 static int
@@ -578,6 +814,40 @@ nm_mem_release_id(struct netmap_mem_d *nmd)
 	NMA_UNLOCK(&nm_mem);
 }
 
+/*
+ * Return the allocator with the given id, with a reference
+ * that the caller must release with netmap_mem_put(),
+ * or NULL if there is no such allocator.
+ */
+struct netmap_mem_d *
+netmap_mem_find(nm_memid_t id)
+{
+	struct netmap_mem_d *nmd, *found = NULL;
+
+	NMA_LOCK(&nm_mem);
+	nmd = netmap_last_mem_d;
+	do {
+		if (nmd->nm_id == id) {
+			/* nm_mem is already locked */
+			if (nmd != &nm_mem)
+				NMA_LOCK(nmd);
+			/* skip allocators that are being destroyed */
+			if (nmd->refcount > 0) {
+				nmd->refcount++;
+				NM_DBG_REFC(nmd, __FUNCTION__, __LINE__);
+				found = nmd;
+			}
+			if (nmd != &nm_mem)
+				NMA_UNLOCK(nmd);
+			break;
+		}
+		nmd = nmd->next;
+	} while (nmd != netmap_last_mem_d);
+	NMA_UNLOCK(&nm_mem);
+
+	return found;
+}
+
 static int
 nm_mem_assign_group(struct netmap_mem_d *nmd, struct device *dev)
 {
@@ -616,6 +886,10 @@ netmap_mem2_ofstophys(struct netmap_mem_d* nmd, vm_ooffset_t offset)
 	for (i = 0; i < NETMAP_POOLS_NR; offset -= p[i].memtotal, i++) {
 		if (offset >= p[i].memtotal)
 			continue;
+		/* first touch of a cluster of a lazy pool */
+		if (i == NETMAP_BUF_POOL &&
+		    netmap_mem_back(nmd, offset / p[i]._clustsize))
+			break;
 		// now lookup the cluster's address
 #ifndef _WIN32
 		pa = vtophys(p[i].lut[offset / p[i]._objsize].vaddr) +
@@ -688,6 +962,8 @@ win32_build_user_vm_map(struct netmap_mem_d* nmd)
 	}
 
 	NMA_LOCK(nmd);
+	/* the whole region is mapped now */
+	netmap_mem_populate(nmd, ~0U);
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		struct netmap_obj_pool *p = &nmd->pools[i];
 		int clsz = p->_clustsize;
@@ -742,6 +1018,55 @@ netmap_mem2_get_pool_info(struct netmap_mem_d* nmd, u_int pool, u_int *clustsize
 	return 0; /* success */
 }
 
+/*
+ * Request the NUMA node of the next allocation of the region,
+ * see netmap_mem_numa_select().
+ */
+int
+netmap_mem_set_numa_node(struct netmap_mem_d *nmd, int node)
+{
+	if (!nm_os_numa_node_online(node))
+		return EINVAL;
+	NMA_LOCK(nmd);
+	nmd->r_numa_node = node;
+	NMA_UNLOCK(nmd);
+	return 0;
+}
+
+/* node of the region, -1 if not placed */
+int
+netmap_mem_numa_node(struct netmap_mem_d *nmd)
+{
+	return nmd->numa_node;
+}
+
+/*
+ * Returns the page size backing the clusters of the buffer pool,
+ * 0 if they use base pages, and in *bufofs and *buflen (if not NULL)
+ * the offset and size of the buffer pool in the memory region, so
+ * that the OS specific mmap code can align and map the clusters
+ * with large pages. The large buffers, if any, are not included.
+ */
+u_int
+netmap_mem_hugepage(struct netmap_mem_d *nmd, vm_ooffset_t *bufofs,
+	vm_ooffset_t *buflen)
+{
+	struct netmap_obj_pool *p = nmd->pools;
+	u_int hugepage = 0;
+
+	NMA_LOCK(nmd);
+	if (nmd->flags & NETMAP_MEM_FINALIZED) {
+		hugepage = p[NETMAP_BUF_POOL]._hugepage;
+		if (bufofs)
+			*bufofs = p[NETMAP_IF_POOL].memtotal +
+				p[NETMAP_RING_POOL].memtotal;
+		if (buflen)
+			*buflen = p[NETMAP_BUF_POOL].memtotal;
+	}
+	NMA_UNLOCK(nmd);
+	return hugepage;
+}
+
 static int
 netmap_mem2_get_info(struct netmap_mem_d* nmd, u_int* size, u_int *memflags,
 	nm_memid_t *id)
@@ -772,6 +1097,106 @@ out:
 	return error;
 }
 
+/*
+ * Describe the buffer classes of the region (NETMAP_MEM_CLASSES).
+ * Before the region is finalized the configured values are reported,
+ * as netmap_mem2_get_info() does for the size.
+ */
+int
+netmap_mem_buf_classes(struct netmap_mem_d *nmd,
+	struct netmap_buf_classes *bc)
+{
+	struct netmap_obj_pool *p = nmd->pools;
+	uint64_t ofs = 0;
+	uint32_t first = 0;
+	int i, fin;
+
+	bzero(bc, sizeof(*bc));
+	if (nmd->flags & NETMAP_MEM_IO) /* no pools */
+		return EOPNOTSUPP;
+	NMA_LOCK(nmd);
+	fin = nmd->flags & NETMAP_MEM_FINALIZED;
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_buf_class *c = &bc->nc_class[bc->nc_num];
+		u_int num = fin ? p[i].objtotal : p[i]._objtotal;
+
+		if (i >= NETMAP_BUF_POOL && num > 0) {
+			c->bc_offset = ofs;
+			c->bc_first = first;
+			c->bc_num = num;
+			c->bc_size = p[i]._objsize;
+			first += num;
+			bc->nc_num++;
+		}
+		ofs += fin ? p[i].memtotal :
+			(uint64_t)p[i]._numclusters * p[i]._clustsize;
+	}
+	NMA_UNLOCK(nmd);
+	return 0;
+}
+
+/* usage of one pool, with the pool locked */
+static void
+netmap_obj_pool_stats(struct netmap_obj_pool *p, struct netmap_pool_stats *ps)
+{
+	u_int j, run = 0;
+
+	ps->ps_total = p->objtotal - p->unbacked * p->_clustentries;
+	ps->ps_free = p->objfree;
+	ps->ps_peak = p->objpeak;
+	ps->ps_size = p->_objsize;
+	ps->ps_fail = p->allocfail;
+	for (j = 0; j < p->objtotal; j++) {
+		if ((j & 31) == 0 && p->bitmap[j >> 5] == 0) {
+			run = 0;
+			j += 31;	/* the whole entry is in use */
+			continue;
+		}
+		if (!(p->bitmap[j >> 5] & (1U << (j & 31)))) {
+			run = 0;
+			continue;
+		}
+		if (run++ == 0)
+			ps->ps_runs++;
+		if (run > ps->ps_maxrun)
+			ps->ps_maxrun = run;
+	}
+}
+
+/*
+ * Report the usage of the region (NETMAP_MEM_STATS). The free runs
+ * are found scanning the bitmaps, which is acceptable for a call
+ * meant for monitoring. Buffers in the per-CPU caches are free for
+ * the caller but in use for the bitmap, so they are added to ps_free.
+ */
+int
+netmap_mem_stats(struct netmap_mem_d *nmd, struct netmap_mem_stats *ms)
+{
+	struct netmap_pool_stats *bs = &ms->ms_pool[NETMAP_BUF_POOL];
+	u_int i;
+
+	bzero(ms, sizeof(*ms));
+	if (nmd->flags & NETMAP_MEM_IO) /* no pools */
+		return EOPNOTSUPP;
+	NMA_LOCK(nmd);
+	ms->ms_memsize = nmd->nm_totalsize;
+	ms->ms_memid = nmd->nm_id;
+	ms->ms_npools = NETMAP_POOLS_NR;
+	ms->ms_extra_bufs = nmd->extra_bufs;
+	for (i = 0; i < nmd->ncaches; i++) {
+		mtx_lock(&nmd->bufcache[i].lock);
+		bs->ps_cached += nmd->bufcache[i].n;
+		mtx_unlock(&nmd->bufcache[i].lock);
+	}
+	mtx_lock(&nmd->bufs_lock);
+	for (i = 0; i < NETMAP_POOLS_NR; i++)
+		netmap_obj_pool_stats(&nmd->pools[i], &ms->ms_pool[i]);
+	mtx_unlock(&nmd->bufs_lock);
+	bs->ps_free += bs->ps_cached;
+	NMA_UNLOCK(nmd);
+	return 0;
+}
+
 /*
  * we store objects by kernel address, need to find the offset
  * within the pool to export the value to userspace.
@@ -819,6 +1244,28 @@ netmap_mem2_if_offset(struct netmap_mem_d *nmd, const void *addr)
 	return v;
 }
 
+/*
+ * Return the first bitmap entry at or after i with free objects,
+ * p->bitmap_slots if there is none. Full entries are skipped 32
+ * at a time using the summary.
+ */
+static uint32_t
+netmap_obj_next_free(struct netmap_obj_pool *p, uint32_t i)
+{
+	uint32_t s, mask;
+
+	if (i >= p->bitmap_slots)
+		return p->bitmap_slots;
+	s = i >> 5;
+	mask = p->summary[s] & (~0U << (i & 31));
+	while (mask == 0) {
+		if (++s >= p->summary_slots)
+			return p->bitmap_slots;
+		mask = p->summary[s];
+	}
+	return s * 32 + ffs(mask) - 1;
+}
+
 /*
  * report the index, and use start position as a hint,
  * otherwise buffer allocation becomes terribly expensive.
@@ -827,7 +1274,7 @@ static void *
 netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_t *index)
 {
 	uint32_t i = 0;			/* index in the bitmap */
-	uint32_t mask, j = 0;		/* slot counter */
+	uint32_t j = 0;			/* slot counter */
 	void *vaddr = NULL;
 
 	if (len > p->_objsize) {
@@ -838,24 +1285,22 @@ netmap_obj_malloc(struct netmap_obj_pool *p, u_int len, uint32_t *start, uint32_
 
 	if (p->objfree == 0) {
 		D("no more %s objects", p->name);
+		p->allocfail++;
 		return NULL;
 	}
 	if (start)
 		i = *start;
 
+	i = netmap_obj_next_free(p, i);
+	if (i >= p->bitmap_slots) /* objects freed before the hint */
+		i = netmap_obj_next_free(p, 0);
 	/* termination is guaranteed by p->free, but better check bounds on i */
-	while (vaddr == NULL && i < p->bitmap_slots)  {
-		uint32_t cur = p->bitmap[i];
-		if (cur == 0) { /* bitmask is fully used */
-			i++;
-			continue;
-		}
-		/* locate a slot */
-		for (j = 0, mask = 1; (cur & mask) == 0; j++, mask <<= 1)
-			;
-
-		p->bitmap[i] &= ~mask; /* mark object as in use */
+	if (i < p->bitmap_slots) {
+		j = ffs(p->bitmap[i]) - 1;
+		p->bitmap[i] &= ~(1U << j); /* mark object as in use */
+		netmap_obj_sum(p, i);
 		p->objfree--;
+		netmap_obj_peak(p);
 
 		vaddr = p->lut[i * 32 + j].vaddr;
 		if (index)
@@ -883,17 +1328,288 @@ netmap_obj_free(struct netmap_obj_pool *p, uint32_t j)
 		return 1;
 	}
 	ptr = &p->bitmap[j / 32];
-	mask = (1 << (j % 32));
+	mask = (1U << (j % 32));
 	if (*ptr & mask) {
 		D("ouch, double free on buffer %d", j);
 		return 1;
 	} else {
 		*ptr |= mask;
+		p->summary[j >> 10] |= 1U << ((j >> 5) & 31);
 		p->objfree++;
 		return 0;
 	}
 }
 
+/*
+ * Allocate up to n objects, storing their indexes in idx[].
+ * All the free objects of a bitmap entry are taken at once,
+ * lowest index first. Returns the number of objects allocated.
+ */
+static u_int
+netmap_obj_malloc_bulk(struct netmap_obj_pool *p, uint32_t *idx, u_int n)
+{
+	uint32_t i = 0, cur;
+	u_int k = 0;
+
+	while (k < n && p->objfree > 0) {
+		i = netmap_obj_next_free(p, i);
+		if (i >= p->bitmap_slots)
+			break;
+		cur = p->bitmap[i];
+		for (; cur != 0 && k < n; cur &= cur - 1) {
+			idx[k++] = i * 32 + ffs(cur) - 1;
+			p->objfree--;
+		}
+		p->bitmap[i] = cur;
+		netmap_obj_sum(p, i);
+	}
+	netmap_obj_peak(p);
+	return k;
+}
+
+/*
+ * Per-CPU caches of free buffers (magazines).
+ * Buffers are allocated and freed through the cache of the current
+ * CPU, which holds up to two magazines of netmap_buf_cache_size
+ * indexes. An empty cache is refilled with one magazine from the
+ * pool, and a full one returns its oldest magazine, so the pool
+ * bitmap and bufs_lock are touched once per magazine instead of
+ * once per buffer, and CPUs rarely contend on them.
+ * Requests larger than a magazine go straight to the pool.
+ * Lock order is cache lock, then bufs_lock.
+ *
+ * Cache hits are counted per cache and added to the global counter
+ * when the cache goes to the pool, to keep the hit path local.
+ */
+static u_int netmap_buf_cache_size = 64;	/* 0 disables the caches */
+static u_long netmap_buf_cache_hits;
+static u_long netmap_buf_cache_misses;
+SYSBEGIN(mem2_bufcache);
+SYSCTL_DECL(_dev_netmap);
+SYSCTL_UINT(_dev_netmap, OID_AUTO, buf_cache_size, CTLFLAG_RW,
+	&netmap_buf_cache_size, 0, "Buffers per magazine of the per-CPU caches");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_cache_hits, CTLFLAG_RD,
+	&netmap_buf_cache_hits, 0, "Buffer cache hits");
+SYSCTL_ULONG(_dev_netmap, OID_AUTO, buf_cache_misses, CTLFLAG_RD,
+	&netmap_buf_cache_misses, 0, "Buffer cache refills and flushes");
+SYSEND;
+
+/* call with NMA_LOCK held, once the buffer pool is finalized */
+static void
+netmap_buf_cache_create(struct netmap_mem_d *nmd)
+{
+	u_int i, n = nm_os_ncpus(), m = netmap_buf_cache_size;
+
+	nmd->ncaches = 0;
+	if (m == 0)
+		return;
+	if (m > NETMAP_BUF_CACHE_MAX)
+		m = NETMAP_BUF_CACHE_MAX;
+	nmd->bufcache = malloc(sizeof(struct netmap_buf_cache) * n,
+		M_NETMAP, M_NOWAIT | M_ZERO);
+	if (nmd->bufcache == NULL) {
+		D("no memory for %u buffer caches, not using them", n);
+		return;
+	}
+	for (i = 0; i < n; i++)
+		mtx_init(&nmd->bufcache[i].lock, "nm_bufcache", NULL,
+			MTX_DEF);
+	nmd->bufcache_m = m;
+	nmd->ncaches = n;
+}
+
+/*
+ * Return the cached buffers of all CPUs to the pool, when the
+ * allocator falls out of use or the pool runs short. Call without
+ * any cache lock held.
+ */
+static void
+netmap_buf_cache_flush(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, j;
+
+	for (i = 0; i < nmd->ncaches; i++) {
+		struct netmap_buf_cache *c = &nmd->bufcache[i];
+
+		mtx_lock(&c->lock);
+		mtx_lock(&nmd->bufs_lock);
+		for (j = 0; j < c->n; j++)
+			netmap_obj_free(p, c->idx[j]);
+		c->n = 0;
+		netmap_buf_cache_hits += c->hits;
+		c->hits = 0;
+		mtx_unlock(&nmd->bufs_lock);
+		mtx_unlock(&c->lock);
+	}
+}
+
+/* call with NMA_LOCK held, before resetting the buffer pool */
+static void
+netmap_buf_cache_destroy(struct netmap_mem_d *nmd)
+{
+	u_int i;
+
+	if (nmd->ncaches == 0)
+		return;
+	netmap_buf_cache_flush(nmd);
+	for (i = 0; i < nmd->ncaches; i++)
+		mtx_destroy(&nmd->bufcache[i].lock);
+	free(nmd->bufcache, M_NETMAP);
+	nmd->bufcache = NULL;
+	nmd->ncaches = 0;
+}
+
+/* as netmap_buf_get(), through the cache of the current CPU */
+static u_int
+netmap_buf_get_cached(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_cache *c;
+	u_int k, m = nmd->bufcache_m;
+
+	if (nmd->ncaches == 0 || n > m) {
+		mtx_lock(&nmd->bufs_lock);
+		k = netmap_obj_malloc_bulk(p, idx, n);
+		mtx_unlock(&nmd->bufs_lock);
+		return k;
+	}
+	c = &nmd->bufcache[nm_os_curcpu() % nmd->ncaches];
+	mtx_lock(&c->lock);
+	if (c->n < n) {
+		mtx_lock(&nmd->bufs_lock);
+		c->n += netmap_obj_malloc_bulk(p, c->idx + c->n, m);
+		netmap_buf_cache_misses++;
+		netmap_buf_cache_hits += c->hits;
+		c->hits = 0;
+		mtx_unlock(&nmd->bufs_lock);
+	} else {
+		c->hits++;
+	}
+	k = n < c->n ? n : c->n;
+	c->n -= k;
+	memcpy(idx, c->idx + c->n, k * sizeof(*idx));
+	mtx_unlock(&c->lock);
+	return k;
+}
+
+/*
+ * Allocate up to n buffers, storing their indexes in idx[].
+ * Returns the number of buffers allocated.
+ * If the pool runs short, the buffers parked in the caches of the
+ * other CPUs are taken back before giving up, since private regions
+ * are sized exactly for their rings.
+ */
+static u_int
+netmap_buf_get(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int k;
+
+	k = netmap_buf_get_cached(nmd, idx, n);
+	if (k < n && nmd->ncaches > 0) {
+		netmap_buf_cache_flush(nmd);
+		mtx_lock(&nmd->bufs_lock);
+		k += netmap_obj_malloc_bulk(p, idx + k, n - k);
+		mtx_unlock(&nmd->bufs_lock);
+	}
+	return k;
+}
+
+/*
+ * Free n buffers by index, straight to the pool. netmap_obj_free()
+ * rejects the indexes already free, so this is the path for indexes
+ * that come from userspace (ring slots, the extra buffers list),
+ * where a buffer may appear twice.
+ */
+static void
+netmap_buf_put_checked(struct netmap_mem_d *nmd, const uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i;
+
+	mtx_lock(&nmd->bufs_lock);
+	for (i = 0; i < n; i++)
+		netmap_obj_free(p, idx[i]);
+	mtx_unlock(&nmd->bufs_lock);
+}
+
+/*
+ * Free n buffers by index. The indexes must be valid and owned by
+ * the kernel, the caches do not detect double frees.
+ */
+static void
+netmap_buf_put(struct netmap_mem_d *nmd, const uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_buf_cache *c;
+	u_int i, m = nmd->bufcache_m;
+
+	if (nmd->ncaches == 0 || n > m) {
+		netmap_buf_put_checked(nmd, idx, n);
+		return;
+	}
+	c = &nmd->bufcache[nm_os_curcpu() % nmd->ncaches];
+	mtx_lock(&c->lock);
+	if (c->n + n > 2 * m) { /* return the oldest magazine */
+		mtx_lock(&nmd->bufs_lock);
+		for (i = 0; i < m; i++)
+			netmap_obj_free(p, c->idx[i]);
+		netmap_buf_cache_misses++;
+		netmap_buf_cache_hits += c->hits;
+		c->hits = 0;
+		mtx_unlock(&nmd->bufs_lock);
+		c->n -= m;
+		memmove(c->idx, c->idx + m, c->n * sizeof(c->idx[0]));
+	} else {
+		c->hits++;
+	}
+	memcpy(c->idx + c->n, idx, n * sizeof(*idx));
+	c->n += n;
+	mtx_unlock(&c->lock);
+}
+
+/* count a buffer request the pool could not satisfy */
+static void
+netmap_buf_fail(struct netmap_mem_d *nmd, struct netmap_obj_pool *p)
+{
+	mtx_lock(&nmd->bufs_lock);
+	p->allocfail++;
+	mtx_unlock(&nmd->bufs_lock);
+}
+
+/*
+ * Large buffers are few and only used by whole rings, so they
+ * skip the caches. Their indexes follow the regular buffers.
+ */
+static u_int
+netmap_lbuf_get(struct netmap_mem_d *nmd, uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+	uint32_t lfirst = nmd->pools[NETMAP_BUF_POOL].objmax;
+	u_int i, k;
+
+	mtx_lock(&nmd->bufs_lock);
+	k = netmap_obj_malloc_bulk(lp, idx, n);
+	mtx_unlock(&nmd->bufs_lock);
+	for (i = 0; i < k; i++)
+		idx[i] += lfirst;
+	return k;
+}
+
+static void
+netmap_lbuf_put(struct netmap_mem_d *nmd, const uint32_t *idx, u_int n)
+{
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+	uint32_t lfirst = nmd->pools[NETMAP_BUF_POOL].objmax;
+	u_int i;
+
+	mtx_lock(&nmd->bufs_lock);
+	for (i = 0; i < n; i++)
+		netmap_obj_free(lp, idx[i] - lfirst);
+	mtx_unlock(&nmd->bufs_lock);
+}
+
 /*
  * free by address. This is slow but is only used for a few
  * objects (rings, nifp)
@@ -930,6 +1646,9 @@ netmap_obj_free_va(struct netmap_obj_pool *p, void *vaddr)
 #define netmap_buf_malloc(n, _pos, _index)			\
 	netmap_obj_malloc(&(n)->pools[NETMAP_BUF_POOL], netmap_mem_bufsize(n), _pos, _index)
 
+/* buffers requested to netmap_obj_malloc_bulk() at a time */
+#define NETMAP_BUF_BULK		64
+
 
 #if 0 // XXX unused
 /* Return the index associated to the given packet buffer */
@@ -945,24 +1664,37 @@ uint32_t
 netmap_extra_alloc(struct netmap_adapter *na, uint32_t *head, uint32_t n)
 {
 	struct netmap_mem_d *nmd = na->nm_mem;
-	uint32_t i, pos = 0; /* opaque, scan position in the bitmap */
-
-	NMA_LOCK(nmd);
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t idx[NETMAP_BUF_BULK];
+	uint32_t i = 0, j, got;
 
+	/* no NMA_LOCK, buffers are protected by bufs_lock */
 	*head = 0;	/* default, 'null' index ie empty list */
-	for (i = 0 ; i < n; i++) {
-		uint32_t cur = *head;	/* save current head */
-		uint32_t *p = netmap_buf_malloc(nmd, &pos, head);
-		if (p == NULL) {
+	while (i < n) {
+		got = netmap_buf_get(nmd, idx,
+			n - i < NETMAP_BUF_BULK ? n - i : NETMAP_BUF_BULK);
+		if (got == 0 && p->unbacked > 0) {
+			NMA_LOCK(nmd);
+			if (netmap_mem_populate(nmd, n - i) == 0)
+				got = netmap_buf_get(nmd, idx, n - i <
+					NETMAP_BUF_BULK ? n - i : NETMAP_BUF_BULK);
+			NMA_UNLOCK(nmd);
+		}
+		if (got == 0) {
 			D("no more buffers after %d of %d", i, n);
-			*head = cur; /* restore */
+			netmap_buf_fail(nmd, p);
 			break;
 		}
-		RD(5, "allocate buffer %d -> %d", *head, cur);
-		*p = cur; /* link to previous head */
-	}
+		for (j = 0; j < got; j++, i++) {
+			uint32_t *buf = p->lut[idx[j]].vaddr;
 
-	NMA_UNLOCK(nmd);
+			RD(5, "allocate buffer %d -> %d", idx[j], *head);
+			*buf = *head; /* link to previous head */
+			*head = idx[j];
+		}
+	}
+	na->na_extra_bufs += i;
+	nmd->extra_bufs += i;
 
 	return i;
 }
@@ -973,50 +1705,86 @@ netmap_extra_free(struct netmap_adapter *na, uint32_t head)
         struct lut_entry *lut = na->na_lut.lut;
 	struct netmap_mem_d *nmd = na->nm_mem;
 	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *lp = &nmd->pools[NETMAP_LBUF_POOL];
+	uint32_t lfirst = p->objmax;
+	uint32_t total = lfirst + lp->objtotal;
 	uint32_t i, cur, *buf;
 
 	D("freeing the extra list");
-	for (i = 0; head >=2 && head < p->objtotal; i++) {
+	/*
+	 * The list is written by the process: skip the caches, so that
+	 * netmap_obj_free() stops at a buffer already free, and never
+	 * walk more buffers than the pools hold.
+	 */
+	mtx_lock(&nmd->bufs_lock);
+	for (i = 0; head >=2 && head < total &&
+	    (head < p->objtotal || head >= lfirst) &&
+	    i < p->objtotal + lp->objtotal; i++) {
 		cur = head;
 		buf = lut[head].vaddr;
 		head = *buf;
 		*buf = 0;
-		if (netmap_obj_free(p, cur))
+		if (cur >= lfirst ? /* swapped in from a large ring */
+		    netmap_obj_free(lp, cur - lfirst) : netmap_obj_free(p, cur))
 			break;
 	}
+	mtx_unlock(&nmd->bufs_lock);
 	if (head != 0)
 		D("breaking with head %d", head);
 	D("freed %d buffers", i);
+	/* the process may have changed the list, do not underflow */
+	i = i < na->na_extra_bufs ? i : na->na_extra_bufs;
+	na->na_extra_bufs -= i;
+	nmd->extra_bufs -= i < nmd->extra_bufs ? i : nmd->extra_bufs;
 }
 
 
-/* Return nonzero on error */
+/*
+ * Fill n slots with buffers of the regular class or, if large is set,
+ * of the large class. Return nonzero on error.
+ */
 static int
-netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
+netmap_new_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
+	int large)
 {
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	struct netmap_obj_pool *p =
+		&nmd->pools[large ? NETMAP_LBUF_POOL : NETMAP_BUF_POOL];
 	u_int i = 0;	/* slot counter */
-	uint32_t pos = 0;	/* slot in p->bitmap */
-	uint32_t index = 0;	/* buffer index */
-
-	for (i = 0; i < n; i++) {
-		void *vaddr = netmap_buf_malloc(nmd, &pos, &index);
-		if (vaddr == NULL) {
-			D("no more buffers after %d of %d", i, n);
+	uint32_t idx[NETMAP_BUF_BULK];	/* buffer indexes */
+	u_int j, got, m;
+
+	while (i < n) {
+		m = n - i < NETMAP_BUF_BULK ? n - i : NETMAP_BUF_BULK;
+		got = large ? netmap_lbuf_get(nmd, idx, m) :
+			netmap_buf_get(nmd, idx, m);
+		/* only the regular pool is populated lazily */
+		if (got == 0 && !large && p->unbacked > 0 &&
+		    netmap_mem_populate(nmd, n - i) == 0)
+			got = netmap_buf_get(nmd, idx, m);
+		if (got == 0) {
+			D("no more %s after %d of %d", p->name, i, n);
+			netmap_buf_fail(nmd, p);
 			goto cleanup;
 		}
-		slot[i].buf_idx = index;
-		slot[i].len = p->_objsize;
-		slot[i].flags = 0;
+		for (j = 0; j < got; j++, i++) {
+			slot[i].buf_idx = idx[j];
+			slot[i].len = p->_objsize;
+			slot[i].flags = 0;
+		}
 	}
 
-	ND("allocated %d buffers, %d available, first at %d", n, p->objfree, pos);
+	ND("allocated %d buffers, %d available", n, p->objfree);
 	return (0);
 
 cleanup:
 	while (i > 0) {
-		i--;
-		netmap_obj_free(p, slot[i].buf_idx);
+		got = i < NETMAP_BUF_BULK ? i : NETMAP_BUF_BULK;
+		for (j = 0; j < got; j++)
+			idx[j] = slot[--i].buf_idx;
+		if (large)
+			netmap_lbuf_put(nmd, idx, got);
+		else
+			netmap_buf_put(nmd, idx, got);
 	}
 	bzero(slot, n * sizeof(slot[0]));
 	return (ENOMEM);
@@ -1036,28 +1804,41 @@ netmap_mem_set_ring(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n,
 }
 
 
-static void
-netmap_free_buf(struct netmap_mem_d *nmd, uint32_t i)
-{
-	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
-
-	if (i < 2 || i >= p->objtotal) {
-		D("Cannot free buf#%d: should be in [2, %d[", i, p->objtotal);
-		return;
-	}
-	netmap_obj_free(p, i);
-}
-
-
 static void
 netmap_free_bufs(struct netmap_mem_d *nmd, struct netmap_slot *slot, u_int n)
 {
-	u_int i;
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	uint32_t total = p->objmax + nmd->pools[NETMAP_LBUF_POOL].objtotal;
+	uint32_t idx[NETMAP_BUF_BULK], lidx[NETMAP_BUF_BULK];
+	u_int i, k = 0, lk = 0;
 
 	for (i = 0; i < n; i++) {
-		if (slot[i].buf_idx > 2)
-			netmap_free_buf(nmd, slot[i].buf_idx);
+		uint32_t j = slot[i].buf_idx;
+
+		if (j <= 2)
+			continue;
+		if (j >= total || (j >= p->objtotal && j < p->objmax)) {
+			D("Cannot free buf#%d: should be in [2, %d[", j, total);
+			continue;
+		}
+		if (j >= p->objmax) {
+			lidx[lk++] = j;
+			if (lk == NETMAP_BUF_BULK) {
+				netmap_lbuf_put(nmd, lidx, lk);
+				lk = 0;
+			}
+			continue;
+		}
+		idx[k++] = j;
+		if (k == NETMAP_BUF_BULK) {
+			netmap_buf_put_checked(nmd, idx, k);
+			k = 0;
+		}
 	}
+	/* the slots may have been swapped by the process */
+	netmap_buf_put_checked(nmd, idx, k);
+	if (lk)
+		netmap_lbuf_put(nmd, lidx, lk);
 }
 
 static void
@@ -1069,6 +1850,9 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	if (p->bitmap)
 		free(p->bitmap, M_NETMAP);
 	p->bitmap = NULL;
+	if (p->summary)
+		free(p->summary, M_NETMAP);
+	p->summary = NULL;
 	if (p->lut) {
 		u_int i;
 
@@ -1079,7 +1863,7 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 		 * in the lut.
 		 */
 		for (i = 0; i < p->objtotal; i += p->_clustentries) {
-			if (p->lut[i].vaddr)
+			if (netmap_obj_backed(p, i) && p->ext_base == NULL)
 				contigfree(p->lut[i].vaddr, p->_clustsize, M_NETMAP);
 		}
 		bzero(p->lut, sizeof(struct lut_entry) * p->objtotal);
@@ -1091,9 +1875,13 @@ netmap_reset_obj_allocator(struct netmap_obj_pool *p)
 	}
 	p->lut = NULL;
 	p->objtotal = 0;
+	p->objmax = 0;
+	p->unbacked = 0;
 	p->memtotal = 0;
 	p->numclusters = 0;
 	p->objfree = 0;
+	p->objpeak = 0;
+	p->allocfail = 0;
 }
 
 /*
@@ -1116,12 +1904,23 @@ netmap_destroy_obj_allocator(struct netmap_obj_pool *p)
  *
  * XXX note -- userspace needs the buffers to be contiguous,
  *	so we cannot afford gaps at the end of a cluster.
+ *
+ * If hugepage is not 0, each cluster is instead a single naturally
+ * aligned block of hugepage bytes (e.g. 2 MB or 1 GB), which the
+ * kernel direct map and, where supported, the userspace mapping
+ * cover with one TLB entry. This requires objsize to divide hugepage,
+ * otherwise we fall back to base pages.
  */
 
+/* largest contiguous block we can ask for */
+#ifndef NM_CONTIG_MAX
+#define NM_CONTIG_MAX	(1U << 30)	// 1 GB
+#endif
 
 /* call with NMA_LOCK held */
 static int
-netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int objsize)
+netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal,
+	u_int objsize, u_int hugepage, u_int objmax, u_int lazy)
 {
 	int i;
 	u_int clustsize;	/* the cluster size, multiple of page size */
@@ -1131,7 +1930,18 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	 * detect configuration changes later */
 	p->r_objtotal = objtotal;
 	p->r_objsize = objsize;
-
+	p->r_hugepage = hugepage;
+	p->r_objmax = objmax;
+	p->r_lazy = lazy;
+
+	if (objtotal == 0 && p->nummin == 0) {
+		/* an empty pool (large buffers not in use) */
+		p->_objtotal = p->_numclusters = p->_objmax = p->_lazy = 0;
+		p->_clustentries = p->_clustsize = 0;
+		p->_objsize = objsize;
+		p->_hugepage = 0;
+		return 0;
+	}
 #define MAX_CLUSTSIZE	(1<<22)		// 4 MB
 #define LINE_ROUND	NM_CACHE_ALIGN	// 64
 	if (objsize >= MAX_CLUSTSIZE) {
@@ -1155,6 +1965,18 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 			objtotal, p->nummin, p->nummax);
 		return EINVAL;
 	}
+	if (hugepage && ((hugepage & (hugepage - 1)) ||
+	    hugepage < PAGE_SIZE || hugepage > NM_CONTIG_MAX ||
+	    hugepage % objsize)) {
+		D("cannot use %u byte pages for %u byte objects in '%s'",
+			hugepage, objsize, p->name);
+		hugepage = 0;
+	}
+	p->_hugepage = hugepage;
+	if (hugepage) {
+		clustentries = hugepage / objsize;
+		goto done;
+	}
 	/*
 	 * Compute number of objects using a brute-force approach:
 	 * given a max cluster size,
@@ -1176,6 +1998,7 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 		D("unsupported allocation for %d bytes", objsize);
 		return EINVAL;
 	}
+done:
 	/* compute clustsize */
 	clustsize = clustentries * objsize;
 	if (netmap_verbose)
@@ -1194,16 +2017,28 @@ netmap_config_obj_allocator(struct netmap_obj_pool *p, u_int objtotal, u_int obj
 	p->_objsize = objsize;
 	p->_objtotal = p->_numclusters * clustentries;
 
+	/*
+	 * Room to grow, in whole clusters. Indexes times the object size
+	 * must fit 32 bits (see NETMAP_BUF()), so stop at 2 GB.
+	 */
+	if (objmax > p->nummax)
+		objmax = p->nummax;
+	if (objmax > ((u_int)~0 >> 1) / objsize)
+		objmax = ((u_int)~0 >> 1) / objsize;
+	objmax -= objmax % clustentries;
+	p->_objmax = objmax > p->_objtotal ? objmax : p->_objtotal;
+	p->_lazy = lazy && p->_numclusters > 1;
+
 	return 0;
 }
 
 static struct lut_entry *
-nm_alloc_lut(u_int nobj)
+nm_alloc_lut(u_int nobj, int node)
 {
 	size_t n = sizeof(struct lut_entry) * nobj;
 	struct lut_entry *lut;
 #ifdef linux
-	lut = vmalloc(n);
+	lut = vmalloc_node(n, node);
 #else
 	lut = malloc(n, M_NETMAP, M_NOWAIT | M_ZERO);
 #endif
@@ -1212,23 +2047,28 @@ nm_alloc_lut(u_int nobj)
 
 /* call with NMA_LOCK held */
 static int
-netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
+netmap_finalize_obj_allocator(struct netmap_obj_pool *p, int node)
 {
 	int i; /* must be signed */
 	size_t n;
 
+	if (p->_objtotal == 0) /* empty pool */
+		return 0;
+
 	/* optimistically assume we have enough memory */
 	p->numclusters = p->_numclusters;
 	p->objtotal = p->_objtotal;
+	p->unbacked = 0;
+	p->lazy_next = 1;
 
-	p->lut = nm_alloc_lut(p->objtotal);
+	p->lut = nm_alloc_lut(p->_objmax, node);
 	if (p->lut == NULL) {
 		D("Unable to create lookup table for '%s'", p->name);
 		goto clean;
 	}
 
-	/* Allocate the bitmap */
-	n = (p->objtotal + 31) / 32;
+	/* Allocate the bitmap, also for the objects we may grow to */
+	n = (p->_objmax + 31) / 32;
 	p->bitmap = malloc(sizeof(uint32_t) * n, M_NETMAP, M_NOWAIT | M_ZERO);
 	if (p->bitmap == NULL) {
 		D("Unable to create bitmap (%d entries) for allocator '%s'", (int)n,
@@ -1236,6 +2076,14 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		goto clean;
 	}
 	p->bitmap_slots = n;
+	p->summary_slots = (n + 31) / 32;
+	p->summary = malloc(sizeof(uint32_t) * p->summary_slots, M_NETMAP,
+		M_NOWAIT | M_ZERO);
+	if (p->summary == NULL) {
+		D("Unable to create summary bitmap for allocator '%s'",
+		    p->name);
+		goto clean;
+	}
 
 	/*
 	 * Allocate clusters, init pointers and bitmap
@@ -1246,6 +2094,13 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		int lim = i + p->_clustentries;
 		char *clust;
 
+		if (p->_lazy && i > 0) {
+			/* left to netmap_mem_populate() */
+			for (; i < lim; i++)
+				p->lut[i] = p->lut[0];
+			p->unbacked++;
+			continue;
+		}
 		/*
 		 * XXX Note, we only need contigmalloc() for buffers attached
 		 * to native interfaces. In all other cases (nifp, netmap rings
@@ -1253,8 +2108,12 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 		 * can live with standard malloc, because the hardware will not
 		 * access the pages directly.
 		 */
-		clust = contigmalloc(n, M_NETMAP, M_NOWAIT | M_ZERO,
-		    (size_t)0, -1UL, PAGE_SIZE, 0);
+		if (p->ext_base != NULL) /* not cleared, the user owns it */
+			clust = p->ext_base + (size_t)(i / p->_clustentries) * n;
+		else
+			clust = contigmalloc_node(n, M_NETMAP, M_NOWAIT | M_ZERO,
+			    (size_t)0, -1UL, p->_hugepage ? n : PAGE_SIZE, 0,
+			    node);
 		if (clust == NULL) {
 			/*
 			 * If we get here, there is a severe memory shortage,
@@ -1295,14 +2154,20 @@ netmap_finalize_obj_allocator(struct netmap_obj_pool *p)
 			p->lut[i].paddr = vtophys(clust);
 		}
 	}
-	p->objfree = p->objtotal;
+	p->objfree = p->objtotal - p->unbacked * p->_clustentries;
 	p->memtotal = p->numclusters * p->_clustsize;
 	if (p->objfree == 0)
 		goto clean;
+	netmap_obj_sum_init(p);
+	/* the capacity not backed by memory maps to object 0 */
+	p->objmax = p->_objmax > p->_objtotal ? p->_objmax : p->objtotal;
+	for (i = p->objtotal; i < (int)p->objmax; i++)
+		p->lut[i] = p->lut[0];
 	if (netmap_verbose)
-		D("Pre-allocated %d clusters (%d/%dKB) for '%s'",
-		    p->numclusters, p->_clustsize >> 10,
-		    p->memtotal >> 10, p->name);
+		D("Pre-allocated %d clusters (%d/%dKB%s) for '%s'",
+		    p->numclusters - p->unbacked, p->_clustsize >> 10,
+		    p->memtotal >> 10, p->_hugepage ? ", huge" : "",
+		    p->name);
 
 	return 0;
 
@@ -1311,6 +2176,191 @@ clean:
 	return ENOMEM;
 }
 
+/* publish the size of the region in all its nifps. Call with NMA_LOCK */
+static void
+netmap_mem_update_memsize(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_IF_POOL];
+	u_int j;
+
+	for (j = 0; j < p->objtotal; j++) {
+		struct netmap_if *nifp = p->lut[j].vaddr;
+
+		/* allocated objects have their bit clear */
+		if (nifp != NULL && !(p->bitmap[j >> 5] & (1U << (j & 31))))
+			*(uint32_t *)(uintptr_t)&nifp->ni_memsize =
+				nmd->nm_totalsize;
+	}
+}
+
+/*
+ * Allocate cluster c of the buffer pool, fill its lut entries and
+ * release its buffers. The cluster may extend the pool.
+ * Call with NMA_LOCK held.
+ */
+static int
+netmap_mem_clust_add(struct netmap_mem_d *nmd, u_int c)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i = c * p->_clustentries, lim = i + p->_clustentries, j;
+	char *clust;
+
+	clust = contigmalloc_node(p->_clustsize, M_NETMAP,
+	    M_NOWAIT | M_ZERO, (size_t)0, -1UL,
+	    p->_hugepage ? p->_clustsize : PAGE_SIZE, 0, nmd->numa_node);
+	if (clust == NULL) {
+		D("Unable to create cluster at %u for '%s'", i, p->name);
+		return ENOMEM;
+	}
+	for (j = i; j < lim; j++, clust += p->_objsize) {
+		p->lut[j].vaddr = clust;
+		p->lut[j].paddr = vtophys(clust);
+	}
+	if (nmd->buf_lut)
+		memcpy(nmd->buf_lut + i, p->lut + i,
+			p->_clustentries * sizeof(*p->lut));
+	/* the lut is ready, release the buffers */
+	mtx_lock(&nmd->bufs_lock);
+	for (j = i; j < lim; j++)
+		p->bitmap[j >> 5] |= 1U << (j & 31);
+	for (j = i >> 5; j <= (lim - 1) >> 5; j++)
+		netmap_obj_sum(p, j);
+	p->objfree += p->_clustentries;
+	if (p->objtotal < lim)
+		p->objtotal = lim;
+	mtx_unlock(&nmd->bufs_lock);
+	return 0;
+}
+
+/*
+ * Allocate the missing cluster c of a lazy buffer pool. Returns 0
+ * if the cluster has memory. Call with NMA_LOCK held.
+ */
+static int
+netmap_mem_back(struct netmap_mem_d *nmd, u_int c)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	if (p->unbacked == 0 || c >= p->numclusters ||
+	    netmap_obj_backed(p, c * p->_clustentries))
+		return 0;
+#ifdef linux
+	/* the buffers would not be mapped for the devices */
+	if (nmd->dma_users > 0)
+		return EBUSY;
+#endif /* linux */
+	if (netmap_mem_clust_add(nmd, c))
+		return ENOMEM;
+	p->unbacked--;
+	return 0;
+}
+
+/*
+ * Allocate the missing clusters of a lazy buffer pool, in index
+ * order, until at least n more buffers are free. The clusters are
+ * otherwise allocated on the first fault in the userspace mapping.
+ * Returns ENOMEM if no buffer could be added.
+ * Call with NMA_LOCK held.
+ */
+static int
+netmap_mem_populate(struct netmap_mem_d *nmd, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int c, got = 0;
+
+	for (c = p->lazy_next; c < p->numclusters && p->unbacked > 0 &&
+	    got < n; c++) {
+		if (netmap_obj_backed(p, c * p->_clustentries))
+			continue;
+		if (netmap_mem_back(nmd, c))
+			break;
+		got += p->_clustentries;
+	}
+	p->lazy_next = c;
+	if (netmap_verbose && got)
+		D("'%s' populated %u buffers, %u clusters left", p->name,
+			got, p->unbacked);
+	return got ? 0 : ENOMEM;
+}
+
+/*
+ * Append clusters to the buffer pool so that at least n buffers are
+ * free, up to the capacity reserved at config time. The lut and the
+ * bitmap already cover the capacity, with the unused lut entries
+ * pointing to buffer 0, so the adapters see the new buffers without
+ * updating their na_lut. The new clusters go at the end of the
+ * region, so existing mappings are not affected.
+ * Returns 0 if some buffers are free, even if fewer than n.
+ */
+int
+netmap_mem_grow(struct netmap_mem_d *nmd, u_int n)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+	u_int i, want;
+	int error = 0;
+
+	NMA_LOCK(nmd);
+	if (!(nmd->flags & NETMAP_MEM_FINALIZED) ||
+	    (nmd->flags & NETMAP_MEM_IO)) {
+		error = EINVAL;
+		goto out;
+	}
+	if (p->objfree < n)
+		netmap_mem_populate(nmd, n - p->objfree);
+	if (p->objfree >= n)
+		goto out;
+	/* the pool must be the last one in the region, and must not
+	 * have been truncated in the middle of a cluster
+	 */
+	if (p->objmax <= p->objtotal || p->objtotal % p->_clustentries ||
+	    nmd->pools[NETMAP_LBUF_POOL].memtotal > 0) {
+		error = p->objfree ? 0 : ENOMEM;
+		goto out;
+	}
+#ifdef linux
+	/* the new buffers would not be mapped for the devices */
+	if (nmd->dma_users > 0) {
+		error = p->objfree ? 0 : EBUSY;
+		goto out;
+	}
+#endif /* linux */
+	want = p->objtotal + n - p->objfree;
+	if (want > p->objmax)
+		want = p->objmax;
+	for (i = p->objtotal; i < want; i += p->_clustentries) {
+		if (netmap_mem_clust_add(nmd, i / p->_clustentries))
+			break;
+		p->numclusters++;
+		p->memtotal += p->_clustsize;
+		nmd->nm_totalsize += p->_clustsize;
+	}
+	if (p->objfree == 0)
+		error = ENOMEM;
+	netmap_mem_update_memsize(nmd);
+	if (netmap_verbose)
+		D("'%s' has %u buffers, region %u KB", p->name, p->objtotal,
+			nmd->nm_totalsize >> 10);
+out:
+	NMA_UNLOCK(nmd);
+	return error;
+}
+
+/*
+ * Large buffers take the indexes after the regular ones, so the
+ * regular pool cannot grow if there are any.
+ */
+static void
+netmap_mem_config_grow(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL];
+
+	if (nmd->pools[NETMAP_LBUF_POOL]._objtotal > 0 &&
+	    p->_objmax > p->_objtotal) {
+		D("%s cannot grow with large buffers", p->name);
+		p->_objmax = p->_objtotal;
+	}
+}
+
 /* call with lock held */
 static int
 netmap_memory_config_changed(struct netmap_mem_d *nmd)
@@ -1319,7 +2369,10 @@ netmap_memory_config_changed(struct netmap_mem_d *nmd)
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		if (nmd->pools[i].r_objsize != netmap_params[i].size ||
-		    nmd->pools[i].r_objtotal != netmap_params[i].num)
+		    nmd->pools[i].r_objtotal != netmap_params[i].num ||
+		    nmd->pools[i].r_hugepage != netmap_params[i].hugepage ||
+		    nmd->pools[i].r_objmax != netmap_params[i].max_num ||
+		    nmd->pools[i].r_lazy != netmap_params[i].lazy)
 		    return 1;
 	}
 	return 0;
@@ -1332,6 +2385,15 @@ netmap_mem_reset_all(struct netmap_mem_d *nmd)
 
 	if (netmap_verbose)
 		D("resetting %p", nmd);
+	netmap_buf_cache_destroy(nmd);
+	if (nmd->buf_lut) {
+#ifdef linux
+		vfree(nmd->buf_lut);
+#else
+		free(nmd->buf_lut, M_NETMAP);
+#endif
+		nmd->buf_lut = NULL;
+	}
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		netmap_reset_obj_allocator(&nmd->pools[i]);
 	}
@@ -1410,6 +2472,30 @@ netmap_mem_init_shared_info(struct netmap_mem_d *nmd)
 	return 0;
 }
 
+/*
+ * With large buffers, build a lut covering both classes so that
+ * the datapath can translate any buffer index with a single lookup.
+ */
+static int
+netmap_mem_buf_lut_create(struct netmap_mem_d *nmd)
+{
+	struct netmap_obj_pool *p = &nmd->pools[NETMAP_BUF_POOL],
+		*lp = &nmd->pools[NETMAP_LBUF_POOL];
+
+	if (lp->objtotal == 0)
+		return 0;
+	nmd->buf_lut = nm_alloc_lut(p->objmax + lp->objtotal,
+			nmd->numa_node);
+	if (nmd->buf_lut == NULL) {
+		D("Unable to create the buffer lookup table");
+		return ENOMEM;
+	}
+	memcpy(nmd->buf_lut, p->lut, p->objmax * sizeof(*p->lut));
+	memcpy(nmd->buf_lut + p->objmax, lp->lut,
+		lp->objtotal * sizeof(*lp->lut));
+	return 0;
+}
+
 static int
 netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 {
@@ -1419,7 +2505,8 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	nmd->lasterr = 0;
 	nmd->nm_totalsize = 0;
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
-		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i]);
+		nmd->lasterr = netmap_finalize_obj_allocator(&nmd->pools[i],
+				nmd->numa_node);
 		if (nmd->lasterr)
 			goto error;
 		nmd->nm_totalsize += nmd->pools[i].memtotal;
@@ -1427,6 +2514,11 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	/* buffers 0 and 1 are reserved */
 	nmd->pools[NETMAP_BUF_POOL].objfree -= 2;
 	nmd->pools[NETMAP_BUF_POOL].bitmap[0] = ~3;
+	netmap_obj_sum(&nmd->pools[NETMAP_BUF_POOL], 0);
+	nmd->lasterr = netmap_mem_buf_lut_create(nmd);
+	if (nmd->lasterr)
+		goto error;
+	netmap_buf_cache_create(nmd);
 	nmd->flags |= NETMAP_MEM_FINALIZED;
 
 	/* expose info to the ptnetmap guest */
@@ -1435,10 +2527,11 @@ netmap_mem_finalize_all(struct netmap_mem_d *nmd)
 	        goto error;
 
 	if (netmap_verbose)
-		D("interfaces %d KB, rings %d KB, buffers %d MB",
+		D("interfaces %d KB, rings %d KB, buffers %d MB, large %d MB",
 		    nmd->pools[NETMAP_IF_POOL].memtotal >> 10,
 		    nmd->pools[NETMAP_RING_POOL].memtotal >> 10,
-		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20);
+		    nmd->pools[NETMAP_BUF_POOL].memtotal >> 20,
+		    nmd->pools[NETMAP_LBUF_POOL].memtotal >> 20);
 
 	if (netmap_verbose)
 		D("Free buffers: %d", nmd->pools[NETMAP_BUF_POOL].objfree);
@@ -1501,7 +2594,8 @@ netmap_mem_private_deref(struct netmap_mem_d *nmd)
  */
 struct netmap_mem_d *
 netmap_mem_private_new(const char *name, u_int txr, u_int txd,
-	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes, int *perr)
+	u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes, u_int lbufs,
+	int *perr)
 {
 	struct netmap_mem_d *d = NULL;
 	struct netmap_obj_params p[NETMAP_POOLS_NR];
@@ -1556,25 +2650,32 @@ netmap_mem_private_new(const char *name, u_int txr, u_int txd,
 		/* the +2 is for the tx and rx fake buffers (indices 0 and 1) */
 	if (p[NETMAP_BUF_POOL].num < v)
 		p[NETMAP_BUF_POOL].num = v;
+	/* large buffers for the rx rings that want them */
+	if (p[NETMAP_LBUF_POOL].num < lbufs)
+		p[NETMAP_LBUF_POOL].num = lbufs;
 
 	if (netmap_verbose)
-		D("req if %d*%d ring %d*%d buf %d*%d",
+		D("req if %d*%d ring %d*%d buf %d*%d lbuf %d*%d",
 			p[NETMAP_IF_POOL].num,
 			p[NETMAP_IF_POOL].size,
 			p[NETMAP_RING_POOL].num,
 			p[NETMAP_RING_POOL].size,
 			p[NETMAP_BUF_POOL].num,
-			p[NETMAP_BUF_POOL].size);
+			p[NETMAP_BUF_POOL].size,
+			p[NETMAP_LBUF_POOL].num,
+			p[NETMAP_LBUF_POOL].size);
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		snprintf(d->pools[i].name, NETMAP_POOL_MAX_NAMSZ,
 				nm_blueprint.pools[i].name,
 				name);
 		err = netmap_config_obj_allocator(&d->pools[i],
-				p[i].num, p[i].size);
+				p[i].num, p[i].size, p[i].hugepage,
+				p[i].max_num, p[i].lazy);
 		if (err)
 			goto error;
 	}
+	netmap_mem_config_grow(d);
 
 	d->flags &= ~NETMAP_MEM_FINALIZED;
 
@@ -1606,18 +2707,19 @@ netmap_mem_global_config(struct netmap_mem_d *nmd)
 
 	if (nmd->flags & NETMAP_MEM_FINALIZED) {
 		/* reset previous allocation */
-		for (i = 0; i < NETMAP_POOLS_NR; i++) {
-			netmap_reset_obj_allocator(&nmd->pools[i]);
-		}
-		nmd->flags &= ~NETMAP_MEM_FINALIZED;
+		netmap_mem_reset_all(nmd);
 	}
 
 	for (i = 0; i < NETMAP_POOLS_NR; i++) {
 		nmd->lasterr = netmap_config_obj_allocator(&nmd->pools[i],
-				netmap_params[i].num, netmap_params[i].size);
+				netmap_params[i].num, netmap_params[i].size,
+				netmap_params[i].hugepage,
+				netmap_params[i].max_num,
+				netmap_params[i].lazy);
 		if (nmd->lasterr)
 			goto out;
 	}
+	netmap_mem_config_grow(nmd);
 
 out:
 
@@ -1702,6 +2804,34 @@ netmap_free_rings(struct netmap_adapter *na)
 	}
 }
 
+/*
+ * Fill a ring with large buffers and set buf_ofs and nr_buf_size so
+ * that NETMAP_BUF() works unchanged: buffer lfirst + j is at offset
+ * j * lsize in the large pool, which follows the regular buffers.
+ * Returns nonzero if the ring must use the regular buffers.
+ */
+static int
+netmap_mem_lbuf_ring(struct netmap_mem_d *nmd, struct netmap_ring *ring)
+{
+	struct netmap_obj_pool *p = nmd->pools;
+	u_int lfirst = p[NETMAP_BUF_POOL].objmax;
+	u_int lsize = p[NETMAP_LBUF_POOL]._objsize;
+
+	/* NETMAP_BUF() computes index * nr_buf_size in 32 bits */
+	if (p[NETMAP_LBUF_POOL].objtotal == 0 ||
+	    (uint64_t)(lfirst + p[NETMAP_LBUF_POOL].objtotal) * lsize >
+	    0xffffffffULL)
+		return EINVAL;
+	if (netmap_new_bufs(nmd, ring->slot, ring->num_slots, 1))
+		return ENOMEM;
+	*(int64_t *)(uintptr_t)&ring->buf_ofs =
+		(int64_t)p[NETMAP_IF_POOL].memtotal +
+		p[NETMAP_RING_POOL].memtotal + p[NETMAP_BUF_POOL].memtotal -
+		netmap_ring_offset(nmd, ring) - (int64_t)lfirst * lsize;
+	*(uint16_t *)(uintptr_t)&ring->nr_buf_size = lsize;
+	return 0;
+}
+
 /* call with NMA_LOCK held *
  *
  * Allocate netmap rings and buffers for this card
@@ -1753,9 +2883,16 @@ netmap_mem2_rings_create(struct netmap_adapter *na)
 			ND("%s h %d c %d t %d", kring->name,
 				ring->head, ring->cur, ring->tail);
 			ND("initializing slots for %s_ring", nm_txrx2str(txrx));
-			if (i != nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
+			if ((kring->nr_kflags & NKR_LBUF) &&
+			    netmap_mem_lbuf_ring(na->nm_mem, ring)) {
+				D("no large buffers for %s", kring->name);
+				kring->nr_kflags &= ~NKR_LBUF;
+			}
+			if (kring->nr_kflags & NKR_LBUF) {
+				/* filled by netmap_mem_lbuf_ring() */
+			} else if (i != nma_get_nrings(na, t) || (na->na_flags & NAF_HOST_RINGS)) {
 				/* this is a real ring */
-				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc)) {
+				if (netmap_new_bufs(na->nm_mem, ring->slot, ndesc, 0)) {
 					D("Cannot allocate buffers for %s_ring", nm_txrx2str(t));
 					goto cleanup;
 				}
@@ -1828,10 +2965,13 @@ netmap_mem2_if_new(struct netmap_adapter *na)
 		NMA_UNLOCK(na->nm_mem);
 		return NULL;
 	}
+	/* no stale ni_bufs_head or ni_flags from a previous user */
+	bzero(nifp, len);
 
 	/* initialize base fields -- override const */
 	*(u_int *)(uintptr_t)&nifp->ni_tx_rings = na->num_tx_rings;
 	*(u_int *)(uintptr_t)&nifp->ni_rx_rings = na->num_rx_rings;
+	*(uint32_t *)(uintptr_t)&nifp->ni_memsize = na->nm_mem->nm_totalsize;
 	strncpy(nifp->ni_name, na->name, (size_t)IFNAMSIZ);
 
 	/*
@@ -1909,6 +3049,224 @@ struct netmap_mem_ops netmap_mem_private_ops = {
 	.nmd_rings_delete = netmap_mem2_rings_delete
 };
 
+#ifndef _WIN32
+/*
+ * allocator for memory provided by the user (NETMAP_MEM_EXTMEM).
+ * The pools are carved in order from the pinned pages, so an object
+ * is at the same offset in the region and in the user mapping.
+ */
+struct netmap_mem_ext {
+	struct netmap_mem_d up;
+
+	struct nm_os_extmem *os;	/* the pinned pages */
+};
+
+static vm_paddr_t
+netmap_mem_ext_ofstophys(struct netmap_mem_d *nmd, vm_ooffset_t offset)
+{
+	struct netmap_mem_ext *e = (struct netmap_mem_ext *)nmd;
+	vm_paddr_t pa = 0;
+
+	NMA_LOCK(nmd);
+	if (offset < nmd->nm_totalsize)
+		pa = nm_os_extmem_paddr(e->os, offset);
+	else
+		D("invalid ofs 0x%llx out of 0x%x",
+			(unsigned long long)offset, nmd->nm_totalsize);
+	NMA_UNLOCK(nmd);
+	return pa;
+}
+
+static int
+netmap_mem_ext_finalize(struct netmap_mem_d *nmd)
+{
+	struct netmap_mem_ext *e = (struct netmap_mem_ext *)nmd;
+	int i, j, was_finalized = nmd->flags & NETMAP_MEM_FINALIZED;
+	vm_ooffset_t ofs = 0;
+	int err;
+
+	err = netmap_mem_private_finalize(nmd);
+	if (err || was_finalized)
+		return err;
+	/* the area may hold interfaces and rings of a previous life,
+	 * only the buffers are meant to survive
+	 */
+	bzero(nmd->pools[NETMAP_IF_POOL].ext_base,
+		nmd->pools[NETMAP_IF_POOL].memtotal);
+	bzero(nmd->pools[NETMAP_RING_POOL].ext_base,
+		nmd->pools[NETMAP_RING_POOL].memtotal);
+	/* the kernel mapping of the pages is not physically contiguous */
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *p = &nmd->pools[i];
+
+		for (j = 0; j < (int)p->objtotal; j++)
+			p->lut[j].paddr = nm_os_extmem_paddr(e->os,
+				ofs + (vm_ooffset_t)j * p->_objsize);
+		ofs += p->memtotal;
+	}
+	return 0;
+}
+
+static void
+netmap_mem_ext_free(struct netmap_mem_ext *e)
+{
+	if (e->os)
+		nm_os_extmem_delete(e->os);
+	NMA_LOCK_DESTROY(&e->up);
+	free(e, M_DEVBUF);
+}
+
+static void
+netmap_mem_ext_delete(struct netmap_mem_d *nmd)
+{
+	if (netmap_verbose)
+		D("deleting %p", nmd);
+	if (nmd->active > 0)
+		D("bug: deleting mem allocator with active=%d!", nmd->active);
+	nm_mem_release_id(nmd);
+	netmap_mem_ext_free((struct netmap_mem_ext *)nmd);
+}
+
+struct netmap_mem_ops netmap_mem_ext_ops = {
+	.nmd_get_lut = netmap_mem2_get_lut,
+	.nmd_get_info = netmap_mem2_get_info,
+	.nmd_ofstophys = netmap_mem_ext_ofstophys,
+	.nmd_config = netmap_mem_private_config,
+	.nmd_finalize = netmap_mem_ext_finalize,
+	.nmd_deref = netmap_mem_private_deref,
+	.nmd_if_offset = netmap_mem2_if_offset,
+	.nmd_delete = netmap_mem_ext_delete,
+	.nmd_if_new = netmap_mem2_if_new,
+	.nmd_if_delete = netmap_mem2_if_delete,
+	.nmd_rings_create = netmap_mem2_rings_create,
+	.nmd_rings_delete = netmap_mem2_rings_delete
+};
+
+/*
+ * Create an allocator in the user memory described by er, and
+ * return the values in use in er. The allocator has one reference,
+ * for the caller. The memory is neither cleared nor freed.
+ */
+struct netmap_mem_d *
+netmap_mem_ext_create(struct netmap_extmem_req *er, int *perr)
+{
+	struct netmap_mem_ext *e;
+	struct netmap_mem_d *d;
+	struct netmap_obj_params p[NETMAP_POOLS_NR];
+	struct netmap_obj_pool *bp;
+	vm_ooffset_t used = 0;
+	char *base;
+	int i, err;
+
+	if ((er->nr_memaddr & (PAGE_SIZE - 1)) ||
+	    (er->nr_memsize & (PAGE_SIZE - 1)) || er->nr_memsize == 0) {
+		D("area %llx size %u is not page aligned",
+			(unsigned long long)er->nr_memaddr, er->nr_memsize);
+		*perr = EINVAL;
+		return NULL;
+	}
+	e = malloc(sizeof(*e), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (e == NULL) {
+		*perr = ENOMEM;
+		return NULL;
+	}
+	d = &e->up;
+	*d = nm_blueprint;
+	d->ops = &netmap_mem_ext_ops;
+	d->flags |= NETMAP_MEM_EXT;
+	NMA_LOCK_INIT(d);
+
+	e->os = nm_os_extmem_create(er->nr_memaddr, er->nr_memsize, &err);
+	if (e->os == NULL)
+		goto error;
+	base = nm_os_extmem_kaddr(e->os);
+
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		p[i] = netmap_params[i];
+		p[i].hugepage = p[i].max_num = p[i].lazy = 0;
+	}
+	if (er->nr_if_num)
+		p[NETMAP_IF_POOL].num = er->nr_if_num;
+	if (er->nr_if_size)
+		p[NETMAP_IF_POOL].size = er->nr_if_size;
+	if (er->nr_ring_num)
+		p[NETMAP_RING_POOL].num = er->nr_ring_num;
+	if (er->nr_ring_size)
+		p[NETMAP_RING_POOL].size = er->nr_ring_size;
+	if (er->nr_buf_size)
+		p[NETMAP_BUF_POOL].size = er->nr_buf_size;
+	p[NETMAP_LBUF_POOL].num = 0;
+
+	for (i = 0; i < NETMAP_POOLS_NR; i++) {
+		struct netmap_obj_pool *pool = &d->pools[i];
+
+		snprintf(pool->name, NETMAP_POOL_MAX_NAMSZ,
+				nm_blueprint.pools[i].name, "ext");
+		if (i == NETMAP_BUF_POOL) {
+			/* the buffers take the rest of the area, in
+			 * whole clusters
+			 */
+			p[i].num = (er->nr_memsize - used) / p[i].size;
+			if (p[i].num > pool->nummax)
+				p[i].num = pool->nummax;
+			err = netmap_config_obj_allocator(pool, p[i].num,
+					p[i].size, 0, 0, 0);
+			if (err)
+				goto error;
+			p[i].num = (er->nr_memsize - used) / pool->_clustsize *
+				pool->_clustentries;
+			if (p[i].num > pool->nummax)
+				p[i].num = pool->nummax - pool->nummax %
+					pool->_clustentries;
+		}
+		err = netmap_config_obj_allocator(pool, p[i].num, p[i].size,
+				0, 0, 0);
+		if (err)
+			goto error;
+		pool->ext_base = base + used;
+		used += (vm_ooffset_t)pool->_numclusters * pool->_clustsize;
+		if (used > er->nr_memsize) {
+			D("%u bytes are not enough for '%s'", er->nr_memsize,
+				pool->name);
+			err = EINVAL;
+			goto error;
+		}
+	}
+
+	bp = &d->pools[NETMAP_BUF_POOL];
+	er->nr_if_num = d->pools[NETMAP_IF_POOL]._objtotal;
+	er->nr_if_size = d->pools[NETMAP_IF_POOL]._objsize;
+	er->nr_ring_num = d->pools[NETMAP_RING_POOL]._objtotal;
+	er->nr_ring_size = d->pools[NETMAP_RING_POOL]._objsize;
+	er->nr_buf_num = bp->_objtotal;
+	er->nr_buf_size = bp->_objsize;
+
+	d->flags &= ~NETMAP_MEM_FINALIZED;
+	d->refcount = 1;
+	err = nm_mem_assign_id(d);
+	if (err)
+		goto error;
+	er->nr_memid = d->nm_id;
+	if (netmap_verbose)
+		D("region %d: %u KB at %llx, %u buffers", d->nm_id,
+			er->nr_memsize >> 10,
+			(unsigned long long)er->nr_memaddr, bp->_objtotal);
+	return d;
+
+error:
+	netmap_mem_ext_free(e);
+	*perr = err;
+	return NULL;
+}
+#else /* _WIN32 */
+struct netmap_mem_d *
+netmap_mem_ext_create(struct netmap_extmem_req *er, int *perr)
+{
+	*perr = EOPNOTSUPP;
+	return NULL;
+}
+#endif /* _WIN32 */
+
 #ifdef WITH_PTNETMAP_GUEST
 struct mem_pt_if {
 	struct mem_pt_if *next;
@@ -2039,7 +3397,7 @@ netmap_mem_pt_guest_read_shared_info(struct netmap_mem_d *nmd)
 	/* allocate the lut */
 	if (ptnmd->buf_lut.lut == NULL) {
 		D("allocating lut");
-		ptnmd->buf_lut.lut = nm_alloc_lut(nbuffers);
+		ptnmd->buf_lut.lut = nm_alloc_lut(nbuffers, -1);
 		if (ptnmd->buf_lut.lut == NULL) {
 			D("lut allocation failed");
 			return ENOMEM;
@@ -2059,6 +3417,8 @@ netmap_mem_pt_guest_read_shared_info(struct netmap_mem_d *nmd)
 
 	ptnmd->buf_lut.objtotal = nbuffers;
 	ptnmd->buf_lut.objsize = bufsize;
+	ptnmd->buf_lut.lfirst = nbuffers;	/* no large buffers */
+	ptnmd->buf_lut.lobjsize = bufsize;
 
         nmd->nm_totalsize = nms_info->totalsize;
 
@@ -2354,6 +3714,7 @@ netmap_mem_pt_guest_create(nm_memid_t host_id)
 
 	ptnmd->up.flags &= ~NETMAP_MEM_FINALIZED;
 	ptnmd->up.flags |= NETMAP_MEM_IO;
+	ptnmd->up.numa_node = ptnmd->up.r_numa_node = -1;
 
 	NMA_LOCK_INIT(&ptnmd->up);
 
@@ -61,9 +61,11 @@
  * per cluster).
  *
  * Objects are aligned to the cache line (64 bytes) rounding up object
- * sizes when needed. A bitmap contains the state of each object.
- * Allocation scans the bitmap; this is done only on attach, so we are not
- * too worried about performance
+ * sizes when needed. A bitmap contains the state of each object,
+ * and a summary bitmap marks the bitmap words with free objects.
+ * Allocation looks for the first free object with ffs() on the two
+ * levels, and buffers for rings are allocated in bulk, so that
+ * registering large rings stays cheap with large, fragmented pools.
  *
  * For each allocator we can define (thorugh sysctl) the size and
  * number of each object. Memory is allocated at the first use of a
@@ -131,12 +133,21 @@ int	   netmap_mem_rings_create(struct netmap_adapter *);
 void	   netmap_mem_rings_delete(struct netmap_adapter *);
 void 	   netmap_mem_deref(struct netmap_mem_d *, struct netmap_adapter *);
 int	netmap_mem2_get_pool_info(struct netmap_mem_d *, u_int, u_int *, u_int *);
+u_int	   netmap_mem_hugepage(struct netmap_mem_d *, vm_ooffset_t *bufofs,
+		vm_ooffset_t *buflen);
+int	   netmap_mem_set_numa_node(struct netmap_mem_d *, int node);
+int	   netmap_mem_numa_node(struct netmap_mem_d *);
+int	   netmap_mem_buf_classes(struct netmap_mem_d *, struct netmap_buf_classes *);
+int	   netmap_mem_stats(struct netmap_mem_d *, struct netmap_mem_stats *);
+int	   netmap_mem_grow(struct netmap_mem_d *, u_int n);
+struct netmap_mem_d *netmap_mem_ext_create(struct netmap_extmem_req *, int *);
 int	   netmap_mem_get_info(struct netmap_mem_d *, u_int *size, u_int *memflags, uint16_t *id);
 ssize_t    netmap_mem_if_offset(struct netmap_mem_d *, const void *vaddr);
 struct netmap_mem_d* netmap_mem_private_new(const char *name,
 	u_int txr, u_int txd, u_int rxr, u_int rxd, u_int extra_bufs, u_int npipes,
-	int* error);
+	u_int lbufs, int* error);
 void	   netmap_mem_delete(struct netmap_mem_d *);
+struct netmap_mem_d* netmap_mem_find(uint16_t id);
 
 //#define NM_DEBUG_MEM_PUTGET 1
 
@@ -172,6 +183,7 @@ int netmap_mem_pt_guest_ifp_del(struct netmap_mem_d *, struct ifnet *);
 
 #define NETMAP_MEM_PRIVATE	0x2	/* allocator uses private address space */
 #define NETMAP_MEM_IO		0x4	/* the underlying memory is mmapped I/O */
+#define NETMAP_MEM_EXT		0x8	/* the memory belongs to a process */
 
 uint32_t netmap_extra_alloc(struct netmap_adapter *, uint32_t *, uint32_t n);
 
@@ -32,13 +32,13 @@
 NMG_LOCK() serializes all modifications to switches and ports.
 A switch cannot be deleted until all ports are gone.
 
-For each switch, an SX lock (RWlock on linux) protects
-deletion of ports. When configuring or deleting a new port, the
-lock is acquired in exclusive mode (after holding NMG_LOCK).
-When forwarding, the lock is acquired in shared mode (without NMG_LOCK).
-The lock is held throughout the entire forwarding cycle,
-during which the thread may incur in a page fault.
-Hence it is important that sleepable shared locks are used.
+Forwarding does not lock the switch. When configuring or deleting
+a port (with NMG_LOCK held), the new state is published to the
+forwarding threads, which are then waited for (see nm_bdg_sync()).
+Forwarding may incur in a page fault, so the writers sleep while
+waiting. For each switch, an SX lock (RWlock on linux) only
+serializes the config callback of the lookup module with its
+replacement.
 
 On the rx ring, the per-port lock is grabbed initially to reserve
 a number of slot in the ring, then the lock is released,
@@ -123,9 +123,10 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 /*
  * system parameters (most of them in netmap_kern.h)
  * NM_NAME	prefix for switch port names, default "vale"
- * NM_BDG_MAXPORTS	number of ports
- * NM_BRIDGES	max number of switches in the system.
- *	XXX should become a sysctl or tunable
+ * NM_BDG_MAXPORTS	max number of ports of a switch (bridge_max_ports
+ *	is the default for new switches)
+ * NM_BDG_MAXBRIDGES	max number of switches in the system (or
+ *	in a namespace). Switches are allocated on demand.
  *
  * Switch ports are named valeX:Y where X is the switch name and Y
  * is the port. If Y matches a physical interface name, the port is
@@ -141,13 +142,30 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
 #define NM_BDG_MAXSLOTS		4096	/* XXX same as above */
 #define NM_BRIDGE_RINGSIZE	1024	/* in the device */
 #define NM_BDG_HASH		1024	/* forwarding table entries */
+#define NM_BDG_HASH_MAX		(1 << 20)	/* max forwarding table entries */
+#define NM_BDG_HASH_WAYS	4	/* entries per bucket, one cache line */
+#define NM_BDG_HASH_AGE		300	/* ageing time, seconds */
 #define NM_BDG_BATCH		1024	/* entries in the forwarding buffer */
 #define NM_MULTISEG		64	/* max size of a chain of bufs */
 /* actual size of the tables */
 #define NM_BDG_BATCH_MAX	(NM_BDG_BATCH + NM_MULTISEG)
 /* NM_FT_NULL terminates a list of slots in the ft */
 #define NM_FT_NULL		NM_BDG_BATCH_MAX
-#define	NM_BRIDGES		8	/* number of bridges */
+#define	NM_BDG_MAXBRIDGES	65535	/* bridge ids fit in nr_arg1 */
+#define	NM_BDG_NAMEHASH		64	/* initial buckets of the name index */
+/* the destinations of a batch are found through a small hash table,
+ * with at least twice as many slots as packets in a batch.
+ */
+#define NM_BDG_DSTHASH_BITS	12
+#define NM_BDG_DSTHASH		(1 << NM_BDG_DSTHASH_BITS)
+#define NM_BDG_DSTQ_NULL	0xffff	/* empty slot in the hash */
+/* words of the bitmap of the ports that have a queue in a batch */
+#define NM_BDG_DSTMAP_WORDS	((NM_BDG_MAXPORTS + 31) / 32)
+#define NM_BDG_LOOKUP_STRIDE	32	/* packets hashed ahead in a batch lookup */
+#define NM_BDG_MAXGROUPS	64	/* multicast groups per switch */
+#define NM_BDG_BATCH_GROUPS	8	/* groups tracked in a batch */
+#define NM_BDG_MINBURST		65536	/* bytes, per tx ring */
+#define NM_BDG_MINBATCH		16	/* smallest adaptive batch */
 
 
 /*
@@ -156,12 +174,49 @@ __FBSDID("$FreeBSD: head/sys/dev/netmap/netmap.c 257176 2013-10-26 17:58:36Z gle
  * last packet in the block may overflow the size.
  */
 static int bridge_batch = NM_BDG_BATCH; /* bridge batch size */
+/*
+ * bridge_batch_latency, if not 0, is the default latency target
+ * (in microseconds) of the adaptive batching, see nm_bdg_batch().
+ */
+static int bridge_batch_latency = 0;
+/*
+ * bridge_ht_size and bridge_ht_age are the forwarding table size
+ * and ageing time of switches created implicitly by attaching
+ * the first port. NETMAP_BDG_NEWBDG can override them.
+ */
+static int bridge_ht_size = NM_BDG_HASH;
+static int bridge_ht_age = NM_BDG_HASH_AGE;
+static int bridge_max_ports = NM_BDG_DEFPORTS;
+static int bridge_flow_hash = 1; /* spread flows over the rx rings */
+static int bridge_zcopy = 0; /* swap buffers between ports in the same memory */
+/*
+ * bridge_poll_busy_us and bridge_poll_sleep_us control the hybrid
+ * polling of NICs attached to a switch, see netmap_bwrap_polling().
+ * 0 in bridge_poll_busy_us means busy-polling all the time.
+ */
+static int bridge_poll_busy_us = 0;
+static int bridge_poll_sleep_us = 1000;
+/*
+ * bridge_poll_steal lets idle polling kthreads take rings over
+ * from overloaded ones, see nm_bdg_polling_balance().
+ */
+static int bridge_poll_steal = 1;
 SYSBEGIN(vars_vale);
 SYSCTL_DECL(_dev_netmap);
 SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch, CTLFLAG_RW, &bridge_batch, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_batch_latency, CTLFLAG_RW, &bridge_batch_latency, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_ht_size, CTLFLAG_RW, &bridge_ht_size, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_ht_age, CTLFLAG_RW, &bridge_ht_age, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_max_ports, CTLFLAG_RW, &bridge_max_ports, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_flow_hash, CTLFLAG_RW, &bridge_flow_hash, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_zcopy, CTLFLAG_RW, &bridge_zcopy, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_poll_busy_us, CTLFLAG_RW, &bridge_poll_busy_us, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_poll_sleep_us, CTLFLAG_RW, &bridge_poll_sleep_us, 0 , "");
+SYSCTL_INT(_dev_netmap, OID_AUTO, bridge_poll_steal, CTLFLAG_RW, &bridge_poll_steal, 0 , "");
 SYSEND;
 
 static int netmap_vp_create(struct nmreq *, struct ifnet *, struct netmap_vp_adapter **);
+static __inline uint32_t nm_bridge_rthash(const uint8_t *addr, u_int vid);
 static int netmap_vp_reg(struct netmap_adapter *na, int onoff);
 static int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
 
@@ -169,45 +224,127 @@ static int netmap_bwrap_reg(struct netmap_adapter *, int onoff);
  * For each output interface, nm_bdg_q is used to construct a list.
  * bq_len is the number of output buffers (we can have coalescing
  * during the copy).
+ * Queues are only created for the destinations that appear in a
+ * batch: bq_dst is port * NM_BDG_MAXRINGS + ring, and bq_hslot
+ * the position of the queue in the hash of destinations.
  */
 struct nm_bdg_q {
 	uint16_t bq_head;
 	uint16_t bq_tail;
 	uint32_t bq_len;	/* number of buffers */
+	uint32_t bq_dst;
+	uint32_t bq_hslot;
 };
 
-/* XXX revise this */
+/*
+ * An entry of the forwarding table. The top 2 bytes of mac
+ * hold NM_HT_VALID for used entries and the VLAN of the address
+ * (NM_HT_VID(), 0 if the bridge is not VLAN aware).
+ * stamp is the time_second of the last refresh, and is used
+ * for ageing.
+ * NM_BDG_HASH_WAYS entries form a bucket, so a lookup touches
+ * a single cache line.
+ */
 struct nm_hash_ent {
-	uint64_t	mac;	/* the top 2 bytes are the epoch */
-	uint64_t	ports;
+	uint64_t	mac;
+	uint32_t	ports;
+	uint32_t	stamp;
+};
+#define NM_HT_VALID	(1ULL << 48)
+#define NM_HT_VID(vid)	((uint64_t)(vid) << 49)
+
+/*
+ * A multicast group of a switch: the key is built like in the
+ * forwarding table (mac | NM_HT_VID() | NM_HT_VALID), 0 for
+ * free entries and NM_MG_DEAD for deleted ones.
+ * mg_ports is the bitmap of the member ports.
+ */
+struct nm_bdg_mgroup {
+	uint64_t	mg_mac;
+	uint32_t	*mg_ports;
+};
+#define NM_MG_DEAD	1
+
+/* the lookup callbacks of a bridge, as seen by the data path */
+struct nm_bdg_lookup {
+	bdg_lookup_fn_t	lookup;
+	bdg_lookup_batch_fn_t lookup_batch;
+	void		*private_data;
+};
+
+/* the list of active ports, as seen by the data path */
+struct nm_bdg_portlist {
+	u_int		pl_n;
+	uint16_t	pl_idx[0];
+};
+
+static struct netmap_bdg_ops nm_bdg_learning_ops = {
+	.lookup = netmap_bdg_learning,
+	.lookup_batch = netmap_bdg_learning_batch,
+};
+
+/* parameters of a new switch */
+struct nm_bdg_args {
+	u_int		ht_entries;	/* forwarding table entries */
+	u_int		ht_age;		/* ageing time, 0 means never */
+	u_int		max_ports;
 };
 
 /*
  * nm_bridge is a descriptor for a VALE switch.
  * Interfaces for a bridge are all in bdg_ports[].
- * The array has fixed size, an empty entry does not terminate
- * the search, but lookups only occur on attach/detach so we
- * don't mind if they are slow.
+ * The array has bdg_max_ports entries, set when the switch is
+ * created. An empty entry does not terminate the search, but
+ * lookups only occur on attach/detach so we don't mind if they
+ * are slow.
  *
  * The bridge is non blocking on the transmit ports: excess
  * packets are dropped if there is no room on the output port.
  *
- * bdg_lock protects accesses to the bdg_ports array.
- * This is a rw lock (or equivalent).
+ * The data path runs without locks, changes to the ports are
+ * made under NMG_LOCK and synchronized with nm_bdg_sync().
+ * bdg_lock (a rw lock or equivalent) only serializes the
+ * config callback with the replacement of bdg_ops.
  */
 struct nm_bridge {
 	/* XXX what is the proper alignment/layout ? */
-	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ports */
+	BDG_RWLOCK_T	bdg_lock;	/* protects bdg_ops */
 	int		bdg_namelen;
-	uint32_t	bdg_active_ports; /* 0 means free */
+	uint32_t	bdg_active_ports;
+	uint32_t	bdg_flags;
+#define NM_BDG_PERSIST		2	/* created by NETMAP_BDG_NEWBDG */
 	char		bdg_basename[IFNAMSIZ];
 
+	/* linkage in the set of switches, see struct nm_bdg_set */
+	struct nm_bdg_set *bdg_set;
+	struct nm_bridge *bdg_hnext;	/* next in the name hash chain */
+	struct nm_bridge *bdg_prev, *bdg_next; /* list sorted by bdg_id */
+	uint32_t	bdg_hash;	/* hash of bdg_basename */
+	uint16_t	bdg_id;		/* index reported by NETMAP_BDG_LIST */
+	/* set by the first NETMAP_BDG_VLAN on a port, never cleared.
+	 * When 0 the switch ignores VLAN tags and the port settings.
+	 */
+	u_int		bdg_vlan;
+
 	/* Indexes of active ports (up to active_ports)
 	 * and all other remaining ports.
+	 * Both arrays have bdg_max_ports entries, see nm_bdg_ports_init().
+	 * bdg_port_index and bdg_active_ports are only used
+	 * under NMG_LOCK, the data path uses bdg_rports.
 	 */
-	uint8_t		bdg_port_index[NM_BDG_MAXPORTS];
+	uint16_t	*bdg_port_index;
+
+	struct netmap_vp_adapter **bdg_ports;
+	u_int		bdg_max_ports;
 
-	struct netmap_vp_adapter *bdg_ports[NM_BDG_MAXPORTS];
+	/* The data path does not lock the bridge. Writers publish
+	 * the list of active ports in bdg_rports, alternating
+	 * between the two lists in bdg_plist, and then wait in
+	 * nm_bdg_sync() until no reader can see the old state.
+	 */
+	struct nm_bdg_portlist *bdg_rports;
+	struct nm_bdg_portlist *bdg_plist[2];
+	u_int		bdg_epoch;
 
 
 	/*
@@ -218,14 +355,35 @@ struct nm_bridge {
 	 * function may overwrite this value to forward this packet to a
 	 * different ring index.
 	 * This function must be set by netmap_bdg_ctl().
+	 * bdg_private is the private data returned by bdg_ops.init.
+	 * The data path uses the copy in bdg_rlookup, published like
+	 * bdg_rports (see nm_bdg_publish_ops()).
 	 */
 	struct netmap_bdg_ops bdg_ops;
-
-	/* the forwarding table, MAC+ports.
-	 * XXX should be changed to an argument to be passed to
-	 * the lookup function, and allocated on attach
+	void		*bdg_private;
+	struct nm_bdg_lookup *bdg_rlookup;
+	struct nm_bdg_lookup bdg_lookup[2];
+
+	/* the forwarding table, MAC+ports, allocated when the
+	 * bridge is created (see nm_bdg_ht_init()).
+	 * ht_mask + 1 buckets of NM_BDG_HASH_WAYS entries each.
+	 * The counters are only updated on learning and on misses,
+	 * to avoid writing a shared cache line for every packet.
 	 */
-	struct nm_hash_ent ht[NM_BDG_HASH];
+	struct nm_hash_ent *ht;
+	u_int		ht_mask;
+	u_int		ht_age;		/* seconds, 0 means never */
+	uint64_t	ht_learned;
+	uint64_t	ht_evictions;
+	uint64_t	ht_misses;
+
+	/* multicast groups, an open addressing table of
+	 * NM_BDG_MAXGROUPS entries allocated on the first join
+	 * together with the bitmaps (see nm_bdg_mg_join()).
+	 * Multicast to addresses without a group is flooded.
+	 */
+	struct nm_bdg_mgroup *bdg_mgroups;
+	u_int		bdg_ngroups;
 
 #ifdef CONFIG_NET_NS
 	struct net *ns;
@@ -242,13 +400,24 @@ netmap_bdg_name(struct netmap_vp_adapter *vp)
 }
 
 
-#ifndef CONFIG_NET_NS
 /*
- * XXX in principle nm_bridges could be created dynamically
- * Right now we have a static array and deletions are protected
- * by an exclusive lock.
+ * The switches of the system (or of a network namespace).
+ * Each switch is allocated when it is created and freed with
+ * nm_bdg_free(). Switches are indexed by name in a hash table
+ * with bs_hmask + 1 chains, which doubles when the number of
+ * switches exceeds the number of chains, and are also linked in a
+ * list sorted by bdg_id to support NETMAP_BDG_LIST.
+ * Everything is protected by NMG_LOCK.
  */
-static struct nm_bridge *nm_bridges;
+struct nm_bdg_set {
+	struct nm_bridge **bs_hash;
+	u_int		bs_hmask;
+	u_int		bs_count;
+	struct nm_bridge *bs_head, *bs_tail;
+};
+
+#ifndef CONFIG_NET_NS
+static struct nm_bdg_set *nm_bridges;
 #endif /* !CONFIG_NET_NS */
 
 
@@ -282,23 +451,522 @@ pkt_copy(void *_src, void *_dst, int l)
 }
 
 
+/*
+ * Per-bridge tables may be large, so on linux they come from
+ * vmalloc (as the lut in netmap_mem2.c). The memory is zeroed.
+ */
+void *
+nm_bdg_valloc(size_t l)
+{
+	void *p;
+
+#ifdef linux
+	p = vmalloc(l);
+	if (p)
+		bzero(p, l);
+#else
+	p = malloc(l, M_DEVBUF, M_NOWAIT | M_ZERO);
+#endif
+	return p;
+}
+
+void
+nm_bdg_vfree(void *p)
+{
+#ifdef linux
+	vfree(p);
+#else
+	free(p, M_DEVBUF);
+#endif
+}
+
+/*
+ * Allocate the forwarding table of a new bridge. The number of
+ * entries is rounded up to a power of 2 and bounded to
+ * [NM_BDG_HASH_WAYS, NM_BDG_HASH_MAX].
+ */
+static int
+nm_bdg_ht_init(struct nm_bridge *b, u_int entries, u_int age)
+{
+	u_int n = NM_BDG_HASH_WAYS;
+	size_t l;
+
+	if (entries > NM_BDG_HASH_MAX)
+		entries = NM_BDG_HASH_MAX;
+	while (n < entries)
+		n <<= 1;
+	l = sizeof(struct nm_hash_ent) * n;
+	b->ht = nm_bdg_valloc(l);
+	if (b->ht == NULL)
+		return ENOMEM;
+	b->ht_mask = n / NM_BDG_HASH_WAYS - 1;
+	b->ht_age = age;
+	b->ht_learned = b->ht_evictions = b->ht_misses = 0;
+	return 0;
+}
+
+/* true if e holds an address that has not expired yet */
+static inline int
+nm_bdg_ht_live(const struct nm_bridge *b, const struct nm_hash_ent *e,
+		uint32_t now)
+{
+	return (e->mac & NM_HT_VALID) &&
+		(b->ht_age == 0 || now - e->stamp < b->ht_age);
+}
+
+static void
+nm_bdg_ht_free(struct nm_bridge *b)
+{
+	if (b->ht == NULL)
+		return;
+	nm_bdg_vfree(b->ht);
+	b->ht = NULL;
+}
+
+/* key of the multicast group of addr in VLAN vid */
+static inline uint64_t
+nm_bdg_mg_key(const uint8_t *a, u_int vid)
+{
+	return ((uint64_t)a[0] | (uint64_t)a[1] << 8 |
+		(uint64_t)a[2] << 16 | (uint64_t)a[3] << 24 |
+		(uint64_t)a[4] << 32 | (uint64_t)a[5] << 40) |
+		NM_HT_VID(vid) | NM_HT_VALID;
+}
+
+/* true if port is a member of group g */
+static inline int
+nm_bdg_mg_isset(const struct nm_bridge *b, u_int g, u_int port)
+{
+	return b->bdg_mgroups[g].mg_ports[port >> 5] & (1U << (port & 31));
+}
+
+/*
+ * Return the index + 1 of the group of addr in VLAN vid, or 0.
+ * Deleted entries do not stop the search, free ones do.
+ * The data path only calls this if bdg_ngroups != 0.
+ */
+static u_int
+nm_bdg_mg_find(const struct nm_bridge *b, const uint8_t *addr, u_int vid)
+{
+	uint64_t key = nm_bdg_mg_key(addr, vid);
+	u_int i, k, h = nm_bridge_rthash(addr, vid);
+
+	for (i = 0; i < NM_BDG_MAXGROUPS; i++) {
+		k = (h + i) & (NM_BDG_MAXGROUPS - 1);
+		if (b->bdg_mgroups[k].mg_mac == key)
+			return k + 1;
+		if (b->bdg_mgroups[k].mg_mac == 0)
+			break;
+	}
+	return 0;
+}
+
+/*
+ * Add port to the group of addr in VLAN vid, creating the group
+ * if needed. The data path may run concurrently: the members of
+ * a new group are set before its key.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static int
+nm_bdg_mg_join(struct nm_bridge *b, const uint8_t *addr, u_int vid,
+		u_int port)
+{
+	struct nm_bdg_mgroup *mg;
+	u_int i, k, words = (b->bdg_max_ports + 31) / 32;
+
+	if (b->bdg_mgroups == NULL) {
+		mg = nm_bdg_valloc(NM_BDG_MAXGROUPS *
+			(sizeof(*mg) + words * sizeof(uint32_t)));
+		if (mg == NULL)
+			return ENOMEM;
+		for (i = 0; i < NM_BDG_MAXGROUPS; i++)
+			mg[i].mg_ports = (uint32_t *)(mg + NM_BDG_MAXGROUPS) +
+				i * words;
+		b->bdg_mgroups = mg;
+	}
+	k = nm_bdg_mg_find(b, addr, vid);
+	if (k != 0) {
+		b->bdg_mgroups[k - 1].mg_ports[port >> 5] |= 1U << (port & 31);
+		return 0;
+	}
+	k = nm_bridge_rthash(addr, vid);
+	for (i = 0; i < NM_BDG_MAXGROUPS; i++, k++) {
+		mg = &b->bdg_mgroups[k & (NM_BDG_MAXGROUPS - 1)];
+		if (mg->mg_mac <= NM_MG_DEAD)
+			break;
+	}
+	if (i == NM_BDG_MAXGROUPS)
+		return ENOSPC;
+	mg->mg_ports[port >> 5] |= 1U << (port & 31);
+	mb(); /* members first */
+	mg->mg_mac = nm_bdg_mg_key(addr, vid);
+	mb();
+	b->bdg_ngroups++;
+	return 0;
+}
+
+/*
+ * Remove port from group g. A group without members is deleted,
+ * so its address is flooded again. A flush may still be copying to
+ * the members of the deleted group, so the caller must nm_bdg_sync()
+ * before releasing NMG_LOCK, and nm_bdg_mg_join() reusing the entry.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_mg_clear(struct nm_bridge *b, u_int g, u_int port)
+{
+	struct nm_bdg_mgroup *mg = &b->bdg_mgroups[g];
+	u_int i, words = (b->bdg_max_ports + 31) / 32;
+
+	mg->mg_ports[port >> 5] &= ~(1U << (port & 31));
+	for (i = 0; i < words; i++) {
+		if (mg->mg_ports[i])
+			return;
+	}
+	mg->mg_mac = NM_MG_DEAD;
+	if (--b->bdg_ngroups == 0) {
+		/* no probe sequences left to preserve */
+		for (i = 0; i < NM_BDG_MAXGROUPS; i++)
+			b->bdg_mgroups[i].mg_mac = 0;
+	}
+}
+
+/* remove a port that leaves the switch from all groups */
+static void
+nm_bdg_mg_leave_port(struct nm_bridge *b, u_int port)
+{
+	u_int g;
+
+	if (b->bdg_mgroups == NULL)
+		return;
+	for (g = 0; g < NM_BDG_MAXGROUPS; g++) {
+		if (b->bdg_mgroups[g].mg_mac > NM_MG_DEAD &&
+		    nm_bdg_mg_isset(b, g, port))
+			nm_bdg_mg_clear(b, g, port);
+	}
+}
+
+/*
+ * Allocate the port arrays of a new bridge with room for n ports,
+ * bounded to [2, NM_BDG_MAXPORTS]. The arrays come from a single
+ * allocation: pointers first, then the two port lists for the
+ * data path, then the index.
+ */
+static int
+nm_bdg_ports_init(struct nm_bridge *b, u_int n)
+{
+	size_t l, pl;
+	u_int i;
+
+	if (n < 2)	/* a NIC and its host stack */
+		n = 2;
+	else if (n > NM_BDG_MAXPORTS)
+		n = NM_BDG_MAXPORTS;
+	/* keep the lists aligned */
+	pl = roundup(sizeof(struct nm_bdg_portlist) + n * sizeof(uint16_t),
+			sizeof(void *));
+	l = n * sizeof(*b->bdg_ports) + 2 * pl;
+	l += n * sizeof(*b->bdg_port_index);
+	b->bdg_ports = nm_bdg_valloc(l);
+	if (b->bdg_ports == NULL)
+		return ENOMEM;
+	b->bdg_plist[0] = (struct nm_bdg_portlist *)(b->bdg_ports + n);
+	b->bdg_plist[1] = (struct nm_bdg_portlist *)
+		((char *)b->bdg_plist[0] + pl);
+	b->bdg_rports = b->bdg_plist[0];	/* empty */
+	b->bdg_port_index = (uint16_t *)((char *)b->bdg_plist[1] + pl);
+	for (i = 0; i < n; i++)
+		b->bdg_port_index[i] = i;
+	b->bdg_max_ports = n;
+	b->bdg_epoch = 1;
+	return 0;
+}
+
+static void
+nm_bdg_ports_free(struct nm_bridge *b)
+{
+	if (b->bdg_ports == NULL)
+		return;
+	nm_bdg_vfree(b->bdg_ports);
+	b->bdg_ports = NULL;
+	b->bdg_port_index = NULL;
+	b->bdg_rports = b->bdg_plist[0] = b->bdg_plist[1] = NULL;
+	b->bdg_max_ports = 0;
+}
+
+/*
+ * Synchronization between the data path and the writers.
+ *
+ * nm_bdg_preflush() does not lock the bridge. While it forwards
+ * from a tx ring, the kring holds in nkr_bdg_epoch the value of
+ * bdg_epoch it found on entry, and 0 otherwise. Readers only write
+ * to their own kring.
+ *
+ * Writers run under NMG_LOCK. They first update the bridge (port
+ * pointers, bdg_rports, ...) and then call nm_bdg_sync(), which
+ * advances bdg_epoch and waits until the tx rings of all ports are
+ * either idle or in the new epoch. After that no reader can use the
+ * old state, so a detached port can go away and the old port list
+ * can be reused.
+ */
+static inline void
+nm_bdg_rd_enter(struct nm_bridge *b, struct netmap_kring *kring)
+{
+	kring->nkr_bdg_epoch = NM_ACCESS_ONCE(b->bdg_epoch);
+	mb(); /* announce the epoch before looking at the bridge */
+}
+
+static inline void
+nm_bdg_rd_exit(struct netmap_kring *kring)
+{
+	mb(); /* finish using the bridge before leaving */
+	kring->nkr_bdg_epoch = 0;
+}
+
+/* wait for the tx rings of vpna to leave epochs older than epoch */
+static void
+nm_bdg_sync_port(struct netmap_vp_adapter *vpna, u_int epoch)
+{
+	struct netmap_adapter *na = &vpna->up;
+	int i, n;
+
+	if (na->tx_rings == NULL)
+		return;
+	n = netmap_real_rings(na, NR_TX);
+	for (i = 0; i < n; i++) {
+		struct netmap_kring *kring = &na->tx_rings[i];
+		u_int e;
+
+		while ((e = kring->nkr_bdg_epoch) != 0 &&
+		    (int)(e - epoch) < 0)
+			tsleep(kring, 0, "NM_BDG_SYNC", 4);
+	}
+}
+
+/*
+ * Wait until the data path only sees the current state of the
+ * bridge. Ports that have just been detached (hw and sw, if
+ * not NULL) are waited for as well.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_sync(struct nm_bridge *b, struct netmap_vp_adapter *hw,
+		struct netmap_vp_adapter *sw)
+{
+	u_int j, epoch;
+
+	NMG_LOCK_ASSERT();
+	mb(); /* make the changes visible before the new epoch */
+	epoch = b->bdg_epoch + 1;
+	if (epoch == 0) /* 0 means idle */
+		epoch = 1;
+	NM_ACCESS_ONCE(b->bdg_epoch) = epoch;
+	mb();
+	for (j = 0; j < b->bdg_active_ports; j++) {
+		struct netmap_vp_adapter *vpna =
+			b->bdg_ports[b->bdg_port_index[j]];
+
+		if (vpna != NULL)
+			nm_bdg_sync_port(vpna, epoch);
+	}
+	if (hw != NULL)
+		nm_bdg_sync_port(hw, epoch);
+	if (sw != NULL)
+		nm_bdg_sync_port(sw, epoch);
+}
+
+/*
+ * Publish the active ports (bdg_port_index up to bdg_active_ports)
+ * to the data path and wait for the readers of the previous list.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_publish(struct nm_bridge *b, struct netmap_vp_adapter *hw,
+		struct netmap_vp_adapter *sw)
+{
+	struct nm_bdg_portlist *pl;
+
+	pl = b->bdg_rports == b->bdg_plist[0] ?
+		b->bdg_plist[1] : b->bdg_plist[0];
+	memcpy(pl->pl_idx, b->bdg_port_index,
+		b->bdg_active_ports * sizeof(pl->pl_idx[0]));
+	pl->pl_n = b->bdg_active_ports;
+	mb(); /* the list must be complete before it is visible */
+	NM_ACCESS_ONCE(b->bdg_rports) = pl;
+	nm_bdg_sync(b, hw, sw);
+}
+
+/*
+ * Publish the lookup callbacks in bdg_ops, together with their
+ * private data, to the data path. The caller must nm_bdg_sync()
+ * before releasing the previous private data.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_publish_ops(struct nm_bridge *b)
+{
+	struct nm_bdg_lookup *lk;
+
+	lk = b->bdg_rlookup == &b->bdg_lookup[0] ?
+		&b->bdg_lookup[1] : &b->bdg_lookup[0];
+	lk->lookup = b->bdg_ops.lookup;
+	lk->lookup_batch = b->bdg_ops.lookup_batch;
+	lk->private_data = b->bdg_private;
+	mb();
+	NM_ACCESS_ONCE(b->bdg_rlookup) = lk;
+}
+
+/* FNV-1a hash of a bridge name */
+static uint32_t
+nm_bdg_namehash(const char *name, int namelen)
+{
+	uint32_t h = 2166136261U;
+	int i;
+
+	for (i = 0; i < namelen; i++) {
+		h ^= (uint8_t)name[i];
+		h *= 16777619U;
+	}
+	return h;
+}
+
+/*
+ * Double the number of chains of the name index.
+ * On failure we just keep the longer chains.
+ */
+static void
+nm_bdg_set_grow(struct nm_bdg_set *bs)
+{
+	u_int n = (bs->bs_hmask + 1) * 2, i;
+	struct nm_bridge **h, *b;
+
+	h = malloc(n * sizeof(*h), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (h == NULL)
+		return;
+	for (b = bs->bs_head; b; b = b->bdg_next) {
+		i = b->bdg_hash & (n - 1);
+		b->bdg_hnext = h[i];
+		h[i] = b;
+	}
+	free(bs->bs_hash, M_DEVBUF);
+	bs->bs_hash = h;
+	bs->bs_hmask = n - 1;
+}
+
+/*
+ * Add a new bridge to the set and give it an id. Ids normally
+ * grow, so the bridge goes at the end of the list. When they wrap
+ * we look for the first unused one.
+ */
+static void
+nm_bdg_set_insert(struct nm_bdg_set *bs, struct nm_bridge *b)
+{
+	struct nm_bridge *x = NULL, **hp;
+	u_int id = 0;
+
+	if (bs->bs_count >= bs->bs_hmask + 1)
+		nm_bdg_set_grow(bs);
+	hp = &bs->bs_hash[b->bdg_hash & bs->bs_hmask];
+	b->bdg_hnext = *hp;
+	*hp = b;
+
+	if (bs->bs_tail && bs->bs_tail->bdg_id < NM_BDG_MAXBRIDGES - 1) {
+		id = bs->bs_tail->bdg_id + 1;
+	} else {
+		for (x = bs->bs_head; x && x->bdg_id == id; x = x->bdg_next)
+			id++;
+	}
+	/* insert before x, or at the end if NULL */
+	b->bdg_id = id;
+	b->bdg_next = x;
+	b->bdg_prev = x ? x->bdg_prev : bs->bs_tail;
+	if (b->bdg_prev)
+		b->bdg_prev->bdg_next = b;
+	else
+		bs->bs_head = b;
+	if (x)
+		x->bdg_prev = b;
+	else
+		bs->bs_tail = b;
+	b->bdg_set = bs;
+	bs->bs_count++;
+}
+
+static void
+nm_bdg_set_remove(struct nm_bridge *b)
+{
+	struct nm_bdg_set *bs = b->bdg_set;
+	struct nm_bridge **hp;
+
+	for (hp = &bs->bs_hash[b->bdg_hash & bs->bs_hmask]; *hp != b;
+			hp = &(*hp)->bdg_hnext)
+		;
+	*hp = b->bdg_hnext;
+	if (b->bdg_prev)
+		b->bdg_prev->bdg_next = b->bdg_next;
+	else
+		bs->bs_head = b->bdg_next;
+	if (b->bdg_next)
+		b->bdg_next->bdg_prev = b->bdg_prev;
+	else
+		bs->bs_tail = b->bdg_prev;
+	b->bdg_set = NULL;
+	bs->bs_count--;
+}
+
+/*
+ * Destroy a bridge, that must have no ports.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_free(struct nm_bridge *b)
+{
+	ND("destroying bridge %s", b->bdg_basename);
+	nm_bdg_set_remove(b);
+	if (b->bdg_ops.fini != NULL)
+		b->bdg_ops.fini(b->bdg_private);
+	nm_bdg_ht_free(b);
+	if (b->bdg_mgroups != NULL)
+		nm_bdg_vfree(b->bdg_mgroups);
+	nm_bdg_ports_free(b);
+	NM_BNS_PUT(b);
+	BDG_RWDESTROY(b);
+	free(b, M_DEVBUF);
+}
+
+/*
+ * Release a bridge that has no ports left, unless it was
+ * created explicitly with NETMAP_BDG_NEWBDG.
+ * MUST BE CALLED WITH NMG_LOCK()
+ */
+static void
+nm_bdg_put(struct nm_bridge *b)
+{
+	if (b->bdg_active_ports == 0 && !(b->bdg_flags & NM_BDG_PERSIST))
+		nm_bdg_free(b);
+}
+
 /*
  * locate a bridge among the existing ones.
  * MUST BE CALLED WITH NMG_LOCK()
  *
  * a ':' in the name terminates the bridge name. Otherwise, just NM_NAME.
  * We assume that this is called with a name of at least NM_NAME chars.
+ * When a bridge is created, args (or the sysctl defaults if NULL)
+ * give its parameters.
  */
 static struct nm_bridge *
-nm_find_bridge(const char *name, int create)
+nm_find_bridge(const char *name, int create, const struct nm_bdg_args *args)
 {
 	int i, l, namelen;
-	struct nm_bridge *b = NULL, *bridges;
-	u_int num_bridges;
+	struct nm_bridge *b;
+	struct nm_bdg_set *bs;
+	struct nm_bdg_args defaults;
+	uint32_t h;
 
 	NMG_LOCK_ASSERT();
 
-	netmap_bns_getbridges(&bridges, &num_bridges);
+	netmap_bns_getbridges(&bs);
 
 	namelen = strlen(NM_NAME);	/* base length */
 	l = name ? strlen(name) : 0;		/* actual length */
@@ -316,36 +984,57 @@ nm_find_bridge(const char *name, int create)
 		namelen = IFNAMSIZ;
 	ND("--- prefix is '%.*s' ---", namelen, name);
 
-	/* lookup the name, remember empty slot if there is one */
-	for (i = 0; i < num_bridges; i++) {
-		struct nm_bridge *x = bridges + i;
-
-		if (x->bdg_active_ports == 0) {
-			if (create && b == NULL)
-				b = x;	/* record empty slot */
-		} else if (x->bdg_namelen != namelen) {
-			continue;
-		} else if (strncmp(name, x->bdg_basename, namelen) == 0) {
-			ND("found '%.*s' at %d", namelen, name, i);
-			b = x;
-			break;
+	/* lookup the name */
+	h = nm_bdg_namehash(name, namelen);
+	for (b = bs->bs_hash[h & bs->bs_hmask]; b; b = b->bdg_hnext) {
+		if (b->bdg_hash == h && b->bdg_namelen == namelen &&
+		    strncmp(name, b->bdg_basename, namelen) == 0) {
+			ND("found '%.*s' with id %d", namelen, name, b->bdg_id);
+			return b;
 		}
 	}
-	if (i == num_bridges && b) { /* name not found, can create entry */
-		/* initialize the bridge */
-		strncpy(b->bdg_basename, name, namelen);
-		ND("create new bridge %s with ports %d", b->bdg_basename,
-			b->bdg_active_ports);
-		b->bdg_namelen = namelen;
-		b->bdg_active_ports = 0;
-		for (i = 0; i < NM_BDG_MAXPORTS; i++)
-			b->bdg_port_index[i] = i;
-		/* set the default function */
-		b->bdg_ops.lookup = netmap_bdg_learning;
-		/* reset the MAC address table */
-		bzero(b->ht, sizeof(struct nm_hash_ent) * NM_BDG_HASH);
-		NM_BNS_GET(b);
+	if (!create)
+		return NULL;
+
+	/* name not found, create a new bridge */
+	if (bs->bs_count >= NM_BDG_MAXBRIDGES) {
+		D("too many bridges, cannot create %.*s", namelen, name);
+		return NULL;
+	}
+	b = malloc(sizeof(*b), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (b == NULL)
+		return NULL;
+	if (args == NULL) {
+		defaults.ht_entries = bridge_ht_size;
+		defaults.ht_age = bridge_ht_age;
+		defaults.max_ports = bridge_max_ports;
+		args = &defaults;
+	}
+	/* allocate the ports and the MAC address table */
+	if (nm_bdg_ports_init(b, args->max_ports)) {
+		D("no memory for the ports of %.*s", namelen, name);
+		free(b, M_DEVBUF);
+		return NULL;
+	}
+	if (nm_bdg_ht_init(b, args->ht_entries, args->ht_age)) {
+		D("no memory for the forwarding table of %.*s",
+			namelen, name);
+		nm_bdg_ports_free(b);
+		free(b, M_DEVBUF);
+		return NULL;
 	}
+	/* initialize the bridge */
+	BDG_RWINIT(b);
+	strncpy(b->bdg_basename, name, namelen);
+	ND("create new bridge %s with ports %d", b->bdg_basename,
+		b->bdg_active_ports);
+	b->bdg_namelen = namelen;
+	b->bdg_hash = h;
+	/* set the default function */
+	b->bdg_ops = nm_bdg_learning_ops;
+	nm_bdg_publish_ops(b);
+	nm_bdg_set_insert(bs, b);
+	NM_BNS_GET(b);
 	return b;
 }
 
@@ -381,17 +1070,20 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 	struct netmap_kring *kring;
 
 	NMG_LOCK_ASSERT();
-	/* all port:rings + broadcast */
-	num_dstq = NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1;
+	/* one queue per packet at most, + broadcast */
+	num_dstq = NM_BDG_BATCH_MAX + 1;
 	l = sizeof(struct nm_bdg_fwd) * NM_BDG_BATCH_MAX;
 	l += sizeof(struct nm_bdg_q) * num_dstq;
-	l += sizeof(uint16_t) * NM_BDG_BATCH_MAX;
+	l += sizeof(uint16_t) * NM_BDG_DSTHASH;
+	l += sizeof(struct nm_bdg_dst) * NM_BDG_BATCH_MAX;
+	l += sizeof(uint32_t) * NM_BDG_DSTMAP_WORDS;
 
 	nrings = netmap_real_rings(na, NR_TX);
 	kring = na->tx_rings;
 	for (i = 0; i < nrings; i++) {
 		struct nm_bdg_fwd *ft;
 		struct nm_bdg_q *dstq;
+		uint16_t *dsth;
 		int j;
 
 		ft = malloc(l, M_DEVBUF, M_NOWAIT | M_ZERO);
@@ -404,6 +1096,9 @@ nm_alloc_bdgfwd(struct netmap_adapter *na)
 			dstq[j].bq_head = dstq[j].bq_tail = NM_FT_NULL;
 			dstq[j].bq_len = 0;
 		}
+		dsth = (uint16_t *)(dstq + num_dstq);
+		for (j = 0; j < NM_BDG_DSTHASH; j++)
+			dsth[j] = NM_BDG_DSTQ_NULL;
 		kring[i].nkr_ft = ft;
 	}
 	return 0;
@@ -418,62 +1113,62 @@ netmap_bdg_detach_common(struct nm_bridge *b, int hw, int sw)
 {
 	int s_hw = hw, s_sw = sw;
 	int i, lim =b->bdg_active_ports;
-	uint8_t tmp[NM_BDG_MAXPORTS];
+	int p_hw = -1, p_sw = -1;
+	uint16_t *idx = b->bdg_port_index; /* shorthand */
+	struct netmap_vp_adapter *hwp, *swp = NULL;
 
 	/*
 	New algorithm:
-	make a copy of bdg_port_index;
 	lookup NA(ifp)->bdg_port and SWNA(ifp)->bdg_port
-	in the array of bdg_port_index, replacing them with
-	entries from the bottom of the array;
-	decrement bdg_active_ports;
-	acquire BDG_WLOCK() and copy back the array.
+	in the array of bdg_port_index (NMG_LOCK guarantees
+	that there are no other writers);
+	replace them with entries from the bottom of the array,
+	decrement bdg_active_ports and publish the new list
+	to the data path.
 	 */
 
 	if (netmap_verbose)
 		D("detach %d and %d (lim %d)", hw, sw, lim);
-	/* make a copy of the list of active ports, update it,
-	 * and then copy back within BDG_WLOCK().
-	 */
-	memcpy(tmp, b->bdg_port_index, sizeof(tmp));
-	for (i = 0; (hw >= 0 || sw >= 0) && i < lim; ) {
-		if (hw >= 0 && tmp[i] == hw) {
-			ND("detach hw %d at %d", hw, i);
-			lim--; /* point to last active port */
-			tmp[i] = tmp[lim]; /* swap with i */
-			tmp[lim] = hw;	/* now this is inactive */
-			hw = -1;
-		} else if (sw >= 0 && tmp[i] == sw) {
-			ND("detach sw %d at %d", sw, i);
-			lim--;
-			tmp[i] = tmp[lim];
-			tmp[lim] = sw;
-			sw = -1;
-		} else {
-			i++;
-		}
+	for (i = 0; (p_hw < 0 || (sw >= 0 && p_sw < 0)) && i < lim; i++) {
+		if (idx[i] == hw)
+			p_hw = i;
+		else if (sw >= 0 && idx[i] == sw)
+			p_sw = i;
 	}
-	if (hw >= 0 || sw >= 0) {
+	if (p_hw < 0 || (sw >= 0 && p_sw < 0)) {
 		D("XXX delete failed hw %d sw %d, should panic...", hw, sw);
 	}
 
-	BDG_WLOCK(b);
+	if (p_hw >= 0) {
+		ND("detach hw %d at %d", hw, p_hw);
+		lim--; /* point to last active port */
+		if (p_sw == lim)
+			p_sw = p_hw; /* sw is moving to hw's place */
+		idx[p_hw] = idx[lim]; /* swap with p_hw */
+		idx[lim] = hw;	/* now this is inactive */
+	}
+	if (p_sw >= 0) {
+		ND("detach sw %d at %d", sw, p_sw);
+		lim--;
+		idx[p_sw] = idx[lim];
+		idx[lim] = sw;
+	}
 	if (b->bdg_ops.dtor)
 		b->bdg_ops.dtor(b->bdg_ports[s_hw]);
-	b->bdg_ports[s_hw] = NULL;
+	hwp = b->bdg_ports[s_hw];
+	NM_ACCESS_ONCE(b->bdg_ports[s_hw]) = NULL;
+	nm_bdg_mg_leave_port(b, s_hw);
 	if (s_sw >= 0) {
-		b->bdg_ports[s_sw] = NULL;
+		swp = b->bdg_ports[s_sw];
+		NM_ACCESS_ONCE(b->bdg_ports[s_sw]) = NULL;
+		nm_bdg_mg_leave_port(b, s_sw);
 	}
-	memcpy(b->bdg_port_index, tmp, sizeof(tmp));
 	b->bdg_active_ports = lim;
-	BDG_WUNLOCK(b);
+	/* the ports can go away when this returns */
+	nm_bdg_publish(b, hwp, swp);
 
 	ND("now %d active ports", lim);
-	if (lim == 0) {
-		ND("marking bridge %s as free", b->bdg_basename);
-		bzero(&b->bdg_ops, sizeof(b->bdg_ops));
-		NM_BNS_PUT(b);
-	}
+	nm_bdg_put(b);
 }
 
 /* nm_bdg_ctl callback for VALE ports */
@@ -589,6 +1284,22 @@ nm_vi_create(struct nmreq *nmr)
 	return 0;
 }
 
+/* default configuration of a port: untagged member of VLAN 1,
+ * no rate limit, may fill the whole destination rings.
+ */
+static void
+nm_bdg_port_reset(struct netmap_vp_adapter *vpna)
+{
+	bzero(vpna->bdg_vlans, sizeof(vpna->bdg_vlans));
+	vpna->bdg_vlans[0] = 1U << 1;
+	vpna->bdg_pvid = 1;
+	vpna->bdg_rate = 0;
+	vpna->bdg_burst = 0;
+	vpna->bdg_share = 100;
+	vpna->bdg_batch = 0;
+	vpna->bdg_latency = 0;
+}
+
 /* Try to get a reference to a netmap adapter attached to a VALE switch.
  * If the adapter is found (or is created), this function returns 0, a
  * non NULL pointer is returned into *na, and the caller holds a
@@ -618,7 +1329,7 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		return 0;  /* no error, but no VALE prefix */
 	}
 
-	b = nm_find_bridge(nr_name, create);
+	b = nm_find_bridge(nr_name, create, NULL);
 	if (b == NULL) {
 		D("no bridges available for '%s'", nr_name);
 		return (create ? ENOMEM : ENXIO);
@@ -649,17 +1360,6 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	/* not found, should we create it? */
 	if (!create)
 		return ENXIO;
-	/* yes we should, see if we have space to attach entries */
-	needed = 2; /* in some cases we only need 1 */
-	if (b->bdg_active_ports + needed >= NM_BDG_MAXPORTS) {
-		D("bridge full %d, cannot create new port", b->bdg_active_ports);
-		return ENOMEM;
-	}
-	/* record the next two ports available, but do not allocate yet */
-	cand = b->bdg_port_index[b->bdg_active_ports];
-	cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
-	ND("+++ bridge %s port %s used %d avail %d %d",
-		b->bdg_basename, ifname, b->bdg_active_ports, cand, cand2);
 
 	/*
 	 * try see if there is a matching NIC with this name
@@ -667,12 +1367,31 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 	 */
 	ifname = nr_name + b->bdg_namelen + 1;
 	ifp = ifunit_ref(ifname);
+
+	/* yes we should, see if we have space to attach entries:
+	 * a NIC attached with its host stack takes two ports
+	 */
+	needed = ifp != NULL && nmr->nr_arg1 == NETMAP_BDG_HOST ? 2 : 1;
+	if (b->bdg_active_ports + needed > b->bdg_max_ports) {
+		D("bridge full %d, cannot create new port", b->bdg_active_ports);
+		if (ifp)
+			if_rele(ifp);
+		return ENOMEM;
+	}
+	/* record the next ports available, but do not allocate yet */
+	cand = b->bdg_port_index[b->bdg_active_ports];
+	if (needed > 1)
+		cand2 = b->bdg_port_index[b->bdg_active_ports + 1];
+	ND("+++ bridge %s port %s used %d avail %d %d",
+		b->bdg_basename, ifname, b->bdg_active_ports, cand, cand2);
+
 	if (!ifp) {
 		/* Create an ephemeral virtual port
 		 * This block contains all the ephemeral-specific logics
 		 */
 		if (nmr->nr_cmd) {
 			/* nr_cmd must be 0 for a virtual port */
+			nm_bdg_put(b);
 			return EINVAL;
 		}
 
@@ -681,6 +1400,7 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 		if (error) {
 			D("error %d", error);
 			free(ifp, M_DEVBUF);
+			nm_bdg_put(b);
 			return error;
 		}
 		/* shortcut - we can skip get_hw_na(),
@@ -703,29 +1423,31 @@ netmap_get_bdg_na(struct nmreq *nmr, struct netmap_adapter **na, int create)
 			hostna = NULL;
 	}
 
-	BDG_WLOCK(b);
 	vpna->bdg_port = cand;
+	nm_bdg_port_reset(vpna);
 	ND("NIC  %p to bridge port %d", vpna, cand);
 	/* bind the port to the bridge (virtual ports are not active) */
-	b->bdg_ports[cand] = vpna;
 	vpna->na_bdg = b;
+	NM_ACCESS_ONCE(b->bdg_ports[cand]) = vpna;
 	b->bdg_active_ports++;
 	if (hostna != NULL) {
 		/* also bind the host stack to the bridge */
-		b->bdg_ports[cand2] = hostna;
 		hostna->bdg_port = cand2;
 		hostna->na_bdg = b;
+		nm_bdg_port_reset(hostna);
+		NM_ACCESS_ONCE(b->bdg_ports[cand2]) = hostna;
 		b->bdg_active_ports++;
 		ND("host %p to bridge port %d", hostna, cand2);
 	}
 	ND("if %s refs %d", ifname, vpna->up.na_refcount);
-	BDG_WUNLOCK(b);
+	nm_bdg_publish(b, NULL, NULL);
 	*na = &vpna->up;
 	netmap_adapter_get(*na);
 	return 0;
 
 out:
 	if_rele(ifp);
+	nm_bdg_put(b);
 
 	return error;
 }
@@ -773,7 +1495,329 @@ unlock_exit:
 	return error;
 }
 
-static inline int
+/* Process NETMAP_BDG_NEWBDG */
+static int
+nm_bdg_ctl_newbdg(struct nmreq *nmr)
+{
+	struct nm_bdg_args args;
+	struct nm_bridge *b;
+	int error = 0;
+
+	if (strncmp(nmr->nr_name, NM_NAME, strlen(NM_NAME)))
+		return EINVAL;
+	args.ht_entries = nmr->nr_arg3 ? nmr->nr_arg3 : bridge_ht_size;
+	if (nmr->nr_arg2 == NETMAP_BDG_NOAGE)
+		args.ht_age = 0;
+	else
+		args.ht_age = nmr->nr_arg2 ? nmr->nr_arg2 : bridge_ht_age;
+	args.max_ports = nmr->nr_arg1 ? nmr->nr_arg1 : bridge_max_ports;
+
+	NMG_LOCK();
+	if (nm_find_bridge(nmr->nr_name, 0 /* don't create */, NULL)) {
+		error = EEXIST;
+	} else {
+		b = nm_find_bridge(nmr->nr_name, 1 /* create */, &args);
+		if (b == NULL)
+			error = ENOMEM;
+		else
+			b->bdg_flags |= NM_BDG_PERSIST;
+	}
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_BDG_DELBDG */
+static int
+nm_bdg_ctl_delbdg(struct nmreq *nmr)
+{
+	struct nm_bridge *b;
+	int error = 0;
+
+	if (strncmp(nmr->nr_name, NM_NAME, strlen(NM_NAME)))
+		return EINVAL;
+
+	NMG_LOCK();
+	b = nm_find_bridge(nmr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		error = ENXIO;
+	} else if (!(b->bdg_flags & NM_BDG_PERSIST)) {
+		error = EINVAL;	/* goes away with its last port */
+	} else if (b->bdg_active_ports) {
+		error = EBUSY;
+	} else {
+		nm_bdg_free(b);
+	}
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_BDG_FTSTATS */
+static int
+nm_bdg_ctl_ftstats(struct nmreq *nmr)
+{
+	struct nm_bdg_ftstats st;
+	struct nm_bridge *b;
+	void *uptr = nmreq_pointer_get(nmr);
+	uint32_t now = time_second;
+	u_int i;
+
+	if (strncmp(nmr->nr_name, NM_NAME, strlen(NM_NAME)))
+		return EINVAL;
+	bzero(&st, sizeof(st));
+
+	NMG_LOCK();
+	b = nm_find_bridge(nmr->nr_name, 0 /* don't create */, NULL);
+	if (b == NULL) {
+		NMG_UNLOCK();
+		return ENXIO;
+	}
+	st.ft_entries = (b->ht_mask + 1) * NM_BDG_HASH_WAYS;
+	st.ft_ways = NM_BDG_HASH_WAYS;
+	st.ft_age = b->ht_age;
+	for (i = 0; i < st.ft_entries; i++) {
+		if (nm_bdg_ht_live(b, &b->ht[i], now))
+			st.ft_used++;
+	}
+	st.ft_learned = b->ht_learned;
+	st.ft_evictions = b->ht_evictions;
+	st.ft_misses = b->ht_misses;
+	NMG_UNLOCK();
+
+	return copyout(&st, uptr, sizeof(st)) ? EFAULT : 0;
+}
+
+/* add the counters of n krings to rs (ring i to entry i % NM_BDG_STATS_RINGS) */
+static u_int
+nm_bdg_sum_krings(struct nm_bdg_ringstats *rs, struct netmap_kring *kr, u_int n)
+{
+	u_int i;
+
+	if (kr == NULL)
+		return 0;
+	for (i = 0; i < n; i++) {
+		struct nm_bdg_ringstats *src = &kr[i].nkr_bdg_stats;
+		struct nm_bdg_ringstats *dst = &rs[i % NM_BDG_STATS_RINGS];
+
+		dst->rs_packets += src->rs_packets;
+		dst->rs_bytes += src->rs_bytes;
+		dst->rs_dropped += src->rs_dropped;
+		dst->rs_broadcast += src->rs_broadcast;
+		dst->rs_noport += src->rs_noport;
+		dst->rs_policed += src->rs_policed;
+		dst->rs_flushes += src->rs_flushes;
+		if (dst->rs_batch < src->rs_batch)
+			dst->rs_batch = src->rs_batch;
+		if (dst->rs_pkt_ns < src->rs_pkt_ns)
+			dst->rs_pkt_ns = src->rs_pkt_ns;
+	}
+	return n < NM_BDG_STATS_RINGS ? n : NM_BDG_STATS_RINGS;
+}
+
+/* Process NETMAP_BDG_PORTSTATS. The counters are read without
+ * stopping the data path, so they are only a snapshot.
+ */
+static int
+nm_bdg_ctl_portstats(struct nmreq *nmr)
+{
+	struct nm_bdg_portstats *st;
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	void *uptr = nmreq_pointer_get(nmr);
+	int error;
+
+	st = malloc(sizeof(*st), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (st == NULL)
+		return ENOMEM;
+
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		free(st, M_DEVBUF);
+		return error;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	st->ps_port = vpna->bdg_port;
+	st->ps_tx_rings = nm_bdg_sum_krings(st->ps_tx, na->tx_rings,
+		netmap_real_rings(na, NR_TX));
+	st->ps_rx_rings = nm_bdg_sum_krings(st->ps_rx, na->rx_rings,
+		netmap_real_rings(na, NR_RX));
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+
+	error = copyout(st, uptr, sizeof(*st)) ? EFAULT : 0;
+	free(st, M_DEVBUF);
+	return error;
+}
+
+/* Process NETMAP_BDG_VLAN */
+static int
+nm_bdg_ctl_vlan(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	u_int vid = nmr->nr_arg1;
+	int error;
+
+	if (vid == 0 || vid >= 4095)
+		return EINVAL;
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		return error;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	switch (nmr->nr_arg2) {
+	case NETMAP_BDG_VLAN_PVID:
+		vpna->bdg_pvid = vid;
+		/* fallthrough */
+	case NETMAP_BDG_VLAN_TAGGED:
+		vpna->bdg_vlans[vid >> 5] |= 1U << (vid & 31);
+		break;
+	case NETMAP_BDG_VLAN_DEL:
+		vpna->bdg_vlans[vid >> 5] &= ~(1U << (vid & 31));
+		if (vpna->bdg_pvid == vid)
+			vpna->bdg_pvid = 0;
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	if (error == 0) {
+		/* the data path reads the settings without locks,
+		 * wait until every sender sees them.
+		 */
+		vpna->na_bdg->bdg_vlan = 1;
+		nm_bdg_sync(vpna->na_bdg, NULL, NULL);
+	}
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_BDG_MCAST */
+static int
+nm_bdg_ctl_mcast(struct nmreq *nmr)
+{
+	struct nm_bdg_mcast_req req;
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	struct nm_bridge *b;
+	u_int k;
+	int error;
+
+	if (copyin(nmreq_pointer_get(nmr), &req, sizeof(req)))
+		return EFAULT;
+	/* multicast addresses only, broadcast is always flooded */
+	if (!(req.mr_mac[0] & 1) || req.mr_vid >= 4095 ||
+	    (req.mr_mac[0] & req.mr_mac[1] & req.mr_mac[2] & req.mr_mac[3] &
+	     req.mr_mac[4] & req.mr_mac[5]) == 0xff)
+		return EINVAL;
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		return error;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	b = vpna->na_bdg;
+	switch (req.mr_cmd) {
+	case NM_MCAST_JOIN:
+		error = nm_bdg_mg_join(b, req.mr_mac, req.mr_vid,
+				vpna->bdg_port);
+		break;
+	case NM_MCAST_LEAVE:
+		k = b->bdg_ngroups ?
+			nm_bdg_mg_find(b, req.mr_mac, req.mr_vid) : 0;
+		if (k == 0 || !nm_bdg_mg_isset(b, k - 1, vpna->bdg_port))
+			error = ENOENT;
+		else {
+			nm_bdg_mg_clear(b, k - 1, vpna->bdg_port);
+			nm_bdg_sync(b, NULL, NULL);
+		}
+		break;
+	default:
+		error = EINVAL;
+		break;
+	}
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	return error;
+}
+
+/* Process NETMAP_BDG_QOS */
+static int
+nm_bdg_ctl_qos(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	uint64_t rate = (uint64_t)nmr->nr_arg3 * 1000 / 8; /* bytes/s */
+	uint64_t burst = (uint64_t)nmr->nr_arg2 * 1024;
+	u_int share = nmr->nr_arg1 ? nmr->nr_arg1 : 100;
+	int error;
+
+	if (share > 100)
+		return EINVAL;
+	if (burst == 0)
+		burst = rate / 100;	/* 10ms */
+	if (burst < NM_BDG_MINBURST)
+		burst = NM_BDG_MINBURST;
+	else if (burst > 0xffffffff)
+		burst = 0xffffffff;
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		return error;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	vpna->bdg_burst = burst;
+	vpna->bdg_share = share;
+	/* the data path reads the rate first, so set it last */
+	mb();
+	vpna->bdg_rate = rate;
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	return 0;
+}
+
+/* Process NETMAP_BDG_BATCHING */
+static int
+nm_bdg_ctl_batching(struct nmreq *nmr)
+{
+	struct netmap_adapter *na;
+	struct netmap_vp_adapter *vpna;
+	int error;
+
+	if (nmr->nr_arg1 > NM_BDG_BATCH || nmr->nr_arg3 > 1000000)
+		return EINVAL;
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		return error;
+	}
+	vpna = (struct netmap_vp_adapter *)na;
+	/* read once per txsync, no need to synchronize */
+	vpna->bdg_batch = nmr->nr_arg1;
+	vpna->bdg_latency = nmr->nr_arg3;
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+	return 0;
+}
+
+static inline int
 nm_is_bwrap(struct netmap_adapter *na)
 {
 	return na->nm_register == netmap_bwrap_reg;
@@ -823,7 +1867,36 @@ nm_bdg_kthread {
 	u_int qfirst;
 	u_int qlast;
 	struct nm_bdg_polling_state *bps;
+
+	/* hybrid polling, see netmap_bwrap_polling() */
+	u_int mode;		/* NM_POLL_BUSY ... */
+	u_int sleep_us;		/* current backoff */
+	uint64_t last;		/* ns, end of the previous poll */
+	uint64_t last_work;	/* ns, last poll with packets */
+
+	/* load balancing, see nm_bdg_polling_balance() */
+	uint64_t win_start;	/* ns, start of the current window */
+	u_int load;		/* packets in the last window */
+	u_int nrings;		/* rings owned in the last window */
+	struct nm_bdg_pollstat stats;
+};
+
+/*
+ * A NIC ring polled by the kthreads. Only the owner polls it, and
+ * only the owner gives it away, between two polls, to the kthread
+ * that asked for it in 'thief', so each kring keeps one consumer.
+ */
+struct nm_bdg_pollring {
+	u_int owner;		/* index of the polling kthread */
+	u_int thief;		/* kthread index + 1, 0 if none */
+	u_int held;		/* windows since the last handoff */
+	u_int load;		/* packets in the last window */
+	u_int win_pkts;		/* packets in the current window */
+	uint64_t pkts;		/* forwarded at the previous poll */
 };
+#define NM_POLL_WINDOW_NS	1000000	/* balancing period */
+#define NM_POLL_HOLD		10	/* windows before moving a ring again */
+#define NM_POLL_STEAL_MIN	64	/* packets/window worth a move */
 
 struct nm_bdg_polling_state {
 	bool configured;
@@ -834,28 +1907,209 @@ struct nm_bdg_polling_state {
 	u_int qlast;
 	u_int cpu_from;
 	u_int ncpus;
+	u_int busy_us;		/* 0: always busy-poll */
+	NM_MTX_T intr_lock;	/* protects nidle and the NIC interrupts */
+	u_int nidle;		/* kthreads in NM_POLL_IDLE */
+	uint64_t intr_on;	/* times the interrupts were enabled */
 	struct nm_bdg_kthread *kthreads;
+	struct nm_bdg_pollring *rings;	/* qlast - qfirst entries */
 };
 
+/*
+ * Called by each kthread at the end of its window: publish the
+ * load of its rings and, if another kthread has a load more than
+ * twice ours and more than one ring, ask it for the busiest of its
+ * rings that still leaves it the busier of the two (so rings do not
+ * bounce back and forth). Rings only move when there are more rings
+ * than kthreads, i.e. with REG_ALL_NIC and more than one core.
+ * Loads and owners of the other kthreads are read without locks; a
+ * stale value only delays or skips a move, as the owner checks the
+ * request again before the handoff (see netmap_bwrap_polling()).
+ */
+static void
+nm_bdg_polling_balance(struct nm_bdg_polling_state *bps,
+	struct nm_bdg_kthread *nbk, uint64_t now)
+{
+	struct nm_bdg_kthread *victim = NULL;
+	struct nm_bdg_pollring *r, *best = NULL;
+	u_int i, me = nbk - bps->kthreads, v, load = 0, nrings = 0;
+
+	for (i = 0; i < bps->qlast - bps->qfirst; i++) {
+		r = bps->rings + i;
+		if (r->owner != me)
+			continue;
+		r->load = r->win_pkts;
+		r->win_pkts = 0;
+		if (r->held < NM_POLL_HOLD)
+			r->held++;
+		load += r->load;
+		nrings++;
+	}
+	nbk->stats.pk_load = (uint64_t)load * 1000000000 /
+		(now - nbk->win_start + 1);
+	nbk->stats.pk_rings = nrings;
+	nbk->load = load;
+	nbk->nrings = nrings;
+	nbk->win_start = now;
+
+	if (!bridge_poll_steal || bps->ncpus < 2)
+		return;
+	for (i = 0; i < bps->ncpus; i++) {
+		struct nm_bdg_kthread *t = bps->kthreads + i;
+
+		if (t != nbk && t->nrings > 1 &&
+		    (victim == NULL || t->load > victim->load))
+			victim = t;
+	}
+	if (victim == NULL ||
+	    victim->load < 2 * load + NM_POLL_STEAL_MIN)
+		return;
+	v = victim - bps->kthreads;
+	for (i = 0; i < bps->qlast - bps->qfirst; i++) {
+		r = bps->rings + i;
+		if (r->owner != v || r->thief || r->held < NM_POLL_HOLD)
+			continue;
+		if (load + r->load >= victim->load - r->load)
+			continue;
+		if (best == NULL || r->load > best->load)
+			best = r;
+	}
+	if (best)
+		best->thief = me + 1;
+}
+
+/*
+ * Account an idle kthread in bps, and enable the interrupts of
+ * the NIC when all the kthreads are idle, or disable them when
+ * the first one goes back to busy-polling.
+ */
+static void
+nm_bdg_polling_idle(struct nm_bdg_polling_state *bps, int idle)
+{
+	struct netmap_adapter *hwna = bps->bna->hwna;
+
+	NM_MTX_LOCK(bps->intr_lock);
+	if (idle) {
+		if (++bps->nidle == bps->ncpus && hwna->nm_intr) {
+			hwna->nm_intr(hwna, 1);
+			bps->intr_on++;
+		}
+	} else {
+		if (bps->nidle-- == bps->ncpus && hwna->nm_intr)
+			hwna->nm_intr(hwna, 0);
+	}
+	NM_MTX_UNLOCK(bps->intr_lock);
+}
+
+/*
+ * Body of the polling kthreads, called in a loop.
+ * Each call polls the rx rings the kthread owns once (rings can
+ * move between kthreads, see nm_bdg_polling_balance()), hands over
+ * those requested by other kthreads, and a poll is
+ * busy if the switch got packets from them since the previous one,
+ * either from us or from the interrupt handler.
+ * With bps->busy_us == 0 the kthread busy-polls all the time.
+ * Otherwise, after busy_us without packets the kthread sleeps
+ * between polls (NM_POLL_BACKOFF), doubling the sleep from 1us up
+ * to bridge_poll_sleep_us. It then stays at that period with the
+ * NIC interrupts enabled (NM_POLL_IDLE), which forward packets in
+ * the meantime, until a poll is busy again.
+ * Polls racing with the interrupt handler are harmless, one of
+ * them finds the ring busy and returns.
+ * The clock is read once per poll, twice when sleeping.
+ */
 static void
 netmap_bwrap_polling(void *data)
 {
 	struct nm_bdg_kthread *nbk = data;
+	struct nm_bdg_polling_state *bps;
 	struct netmap_bwrap_adapter *bna;
-	u_int qfirst, qlast, i;
+	struct nm_bdg_pollstat *st;
+	u_int i, max, me, work = 0;
 	struct netmap_kring *kring0, *kring;
+	uint64_t now;
 
 	if (!nbk)
 		return;
-	qfirst = nbk->qfirst;
-	qlast = nbk->qlast;
-	bna = nbk->bps->bna;
+	bps = nbk->bps;
+	bna = bps->bna;
 	kring0 = NMR(bna->hwna, NR_RX);
+	st = &nbk->stats;
+	me = nbk - bps->kthreads;
+
+	for (i = 0; i < bps->qlast - bps->qfirst; i++) {
+		struct nm_bdg_pollring *r = bps->rings + i;
+		u_int q = bps->qfirst + i;
+		uint64_t n;
 
-	for (i = qfirst; i < qlast; i++) {
-		kring = kring0 + i;
+		if (r->owner != me)
+			continue;
+		kring = kring0 + q;
 		kring->nm_notify(kring, 0);
+		n = bna->up.up.tx_rings[q].nkr_bdg_stats.rs_packets;
+		work += n - r->pkts;
+		r->win_pkts += n - r->pkts;
+		r->pkts = n;
+		if (unlikely(r->thief)) { /* hand the ring over */
+			u_int t = r->thief - 1;
+
+			r->thief = 0;
+			/* the thief may have seen a previous owner, so
+			 * only we know if the ring was held long enough
+			 */
+			if (t != me && r->held >= NM_POLL_HOLD) {
+				r->held = 0;
+				bps->kthreads[t].stats.pk_stolen++;
+				mb(); /* our last poll before the new owner's first */
+				r->owner = t;
+			}
+		}
+	}
+
+	now = nm_os_uptime_ns();
+	st->pk_polls++;
+	if (now - nbk->win_start >= NM_POLL_WINDOW_NS)
+		nm_bdg_polling_balance(bps, nbk, now);
+	if (work) {
+		nbk->last_work = now;
+		st->pk_busy_polls++;
+		st->pk_busy_ns += now - nbk->last;
+		nbk->last = now;
+		if (nbk->mode == NM_POLL_IDLE)
+			nm_bdg_polling_idle(bps, 0);
+		nbk->mode = NM_POLL_BUSY;
+		return;
 	}
+	st->pk_spin_ns += now - nbk->last;
+	nbk->last = now;
+	if (bps->busy_us == 0)
+		return;
+
+	max = bridge_poll_sleep_us;
+	if (max == 0)
+		max = 1;
+	switch (nbk->mode) {
+	case NM_POLL_BUSY:
+		if (now - nbk->last_work < bps->busy_us * 1000ULL)
+			return;
+		nbk->mode = NM_POLL_BACKOFF;
+		nbk->sleep_us = 1;
+		break;
+	case NM_POLL_BACKOFF:
+		nbk->sleep_us *= 2;
+		if (nbk->sleep_us >= max) {
+			nbk->mode = NM_POLL_IDLE;
+			st->pk_idle++;
+			nm_bdg_polling_idle(bps, 1);
+		}
+		break;
+	}
+	if (nbk->mode == NM_POLL_IDLE || nbk->sleep_us > max)
+		nbk->sleep_us = max;
+	nm_os_kthread_usleep(nbk->sleep_us);
+	now = nm_os_uptime_ns();
+	st->pk_sleep_ns += now - nbk->last;
+	nbk->last = now;
 }
 
 static int
@@ -868,17 +2122,36 @@ nm_bdg_create_kthreads(struct nm_bdg_polling_state *bps)
 				M_DEVBUF, M_NOWAIT | M_ZERO);
 	if (bps->kthreads == NULL)
 		return ENOMEM;
+	bps->rings = malloc(sizeof(struct nm_bdg_pollring) *
+		(bps->qlast - bps->qfirst), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (bps->rings == NULL) {
+		free(bps->kthreads, M_DEVBUF);
+		return ENOMEM;
+	}
 
 	bzero(&kcfg, sizeof(kcfg));
 	kcfg.worker_fn = netmap_bwrap_polling;
 	for (i = 0; i < bps->ncpus; i++) {
 		struct nm_bdg_kthread *t = bps->kthreads + i;
-		int all = (bps->ncpus == 1 && bps->reg == NR_REG_ALL_NIC);
+		u_int n = bps->qlast - bps->qfirst;
 		int affinity = bps->cpu_from + i;
 
 		t->bps = bps;
-		t->qfirst = all ? bps->qfirst /* must be 0 */: affinity; 
-		t->qlast = all ? bps->qlast : t->qfirst + 1;
+		t->stats.pk_cpu = affinity;
+		t->last = t->last_work = t->win_start = nm_os_uptime_ns();
+		/* an even share of consecutive rings, one each with
+		 * ONE_NIC; nm_bdg_polling_balance() moves them later
+		 */
+		t->qfirst = bps->qfirst + i * n / bps->ncpus;
+		t->qlast = bps->qfirst + (i + 1) * n / bps->ncpus;
+		t->nrings = t->qlast - t->qfirst;
+		/* initial owner of the rings */
+		for (j = t->qfirst; j < t->qlast; j++) {
+			struct nm_bdg_pollring *r = bps->rings + j - bps->qfirst;
+
+			r->owner = i;
+			r->pkts = bps->bna->up.up.tx_rings[j].nkr_bdg_stats.rs_packets;
+		}
 		D("kthread %d a:%u qf:%u ql:%u", i, affinity, t->qfirst,
 			t->qlast);
 
@@ -897,6 +2170,7 @@ cleanup:
 		struct nm_bdg_kthread *t = bps->kthreads + i;
 		nm_os_kthread_delete(t->nmk);
 	}
+	free(bps->rings, M_DEVBUF);
 	free(bps->kthreads, M_DEVBUF);
 	return EFAULT;
 }
@@ -946,6 +2220,8 @@ nm_bdg_polling_stop_delete_kthreads(struct nm_bdg_polling_state *bps)
 		nm_os_kthread_delete(t->nmk);
 	}
 	bps->stopped = true;
+	free(bps->rings, M_DEVBUF);
+	free(bps->kthreads, M_DEVBUF);
 }
 
 static int
@@ -972,8 +2248,10 @@ get_polling_cfg(struct nmreq *nmr, struct netmap_adapter *na,
 	 *          are specified, consecutive rings are also polled.
 	 *          For example, if ringid=2 and 2 cores are given,
 	 *          ring 2 and 3 are polled by core 2 and 3, respectively.
-	 * ALL_NIC: poll all the rings using a core specified by ringid.
-	 *          the number of cores must be 1.
+	 * ALL_NIC: poll all the rings using the cores from the one
+	 *          specified by ringid, at most one per ring. Each core
+	 *          starts with a range of rings, and rings then move
+	 *          to the least loaded cores (bridge_poll_steal).
 	 */
 	if (reg == NR_REG_ONE_NIC) {
 		if (i + req_cpus > nma_get_nrings(na, NR_RX)) {
@@ -985,8 +2263,10 @@ get_polling_cfg(struct nmreq *nmr, struct netmap_adapter *na,
 		qlast = qfirst + req_cpus;
 		core_from = qfirst;
 	} else if (reg == NR_REG_ALL_NIC) {
-		if (req_cpus != 1) {
-			D("ncpus must be 1 not %d for REG_ALL_NIC", req_cpus);
+		if (req_cpus > nma_get_nrings(na, NR_RX) ||
+		    i + req_cpus > avail_cpus) {
+			D("ncpus %d too large for %d rings from core %u",
+				req_cpus, nma_get_nrings(na, NR_RX), i);
 			return EINVAL;
 		}
 		qfirst = 0;
@@ -1002,9 +2282,11 @@ get_polling_cfg(struct nmreq *nmr, struct netmap_adapter *na,
 	bps->qlast = qlast;
 	bps->cpu_from = core_from;
 	bps->ncpus = req_cpus;
-	D("%s qfirst %u qlast %u cpu_from %u ncpus %u",
+	/* nr_arg3 overrides bridge_poll_busy_us */
+	bps->busy_us = nmr->nr_arg3 ? nmr->nr_arg3 : bridge_poll_busy_us;
+	D("%s qfirst %u qlast %u cpu_from %u ncpus %u busy_us %u",
 		reg == NR_REG_ALL_NIC ? "REG_ALL_NIC" : "REG_ONE_NIC",
-		qfirst, qlast, core_from, req_cpus);
+		qfirst, qlast, core_from, req_cpus, bps->busy_us);
 	return 0;
 }
 
@@ -1032,6 +2314,7 @@ nm_bdg_ctl_polling_start(struct nmreq *nmr, struct netmap_adapter *na)
 		return EINVAL;
 	}
 
+	bps->bna = bna;
 	if (nm_bdg_create_kthreads(bps)) {
 		free(bps, M_DEVBUF);
 		return EFAULT;
@@ -1039,7 +2322,7 @@ nm_bdg_ctl_polling_start(struct nmreq *nmr, struct netmap_adapter *na)
 
 	bps->configured = true;
 	bna->na_polling_state = bps;
-	bps->bna = bna;
+	NM_MTX_INIT(bps->intr_lock);
 
 	/* disable interrupt if possible */
 	if (bna->hwna->nm_intr)
@@ -1048,7 +2331,9 @@ nm_bdg_ctl_polling_start(struct nmreq *nmr, struct netmap_adapter *na)
 	error = nm_bdg_polling_start_kthreads(bps);
 	if (error) {
 		D("ERROR nm_bdg_polling_start_kthread()");
+		free(bps->rings, M_DEVBUF);
 		free(bps->kthreads, M_DEVBUF);
+		NM_MTX_DESTROY(bps->intr_lock);
 		free(bps, M_DEVBUF);
 		bna->na_polling_state = NULL;
 		if (bna->hwna->nm_intr)
@@ -1070,6 +2355,7 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 	bps = bna->na_polling_state;
 	nm_bdg_polling_stop_delete_kthreads(bna->na_polling_state);
 	bps->configured = false;
+	NM_MTX_DESTROY(bps->intr_lock);
 	free(bps, M_DEVBUF);
 	bna->na_polling_state = NULL;
 	/* reenable interrupt */
@@ -1078,6 +2364,53 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 	return 0;
 }
 
+/* Process NETMAP_BDG_POLLSTATS, a snapshot as for PORTSTATS */
+static int
+nm_bdg_ctl_pollstats(struct nmreq *nmr)
+{
+	struct nm_bdg_pollstats *st;
+	struct nm_bdg_polling_state *bps;
+	struct netmap_adapter *na;
+	void *uptr = nmreq_pointer_get(nmr);
+	int error, i;
+
+	st = malloc(sizeof(*st), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (st == NULL)
+		return ENOMEM;
+
+	NMG_LOCK();
+	error = netmap_get_bdg_na(nmr, &na, 0 /* don't create */);
+	if (error == 0 && na == NULL) /* VALE prefix missing */
+		error = EINVAL;
+	if (error) {
+		NMG_UNLOCK();
+		free(st, M_DEVBUF);
+		return error;
+	}
+	if (!nm_is_bwrap(na) ||
+	    (bps = ((struct netmap_bwrap_adapter *)na)->na_polling_state)
+	    == NULL) {
+		error = ENXIO;
+		goto out;
+	}
+	st->pl_busy_us = bps->busy_us;
+	st->pl_intr_on = bps->intr_on;
+	st->pl_nthreads = bps->ncpus < NM_BDG_POLL_MAXTHREADS ?
+		bps->ncpus : NM_BDG_POLL_MAXTHREADS;
+	for (i = 0; i < st->pl_nthreads; i++) {
+		st->pl_kt[i] = bps->kthreads[i].stats;
+		st->pl_kt[i].pk_mode = bps->kthreads[i].mode;
+	}
+out:
+	netmap_adapter_put(na);
+	NMG_UNLOCK();
+
+	if (error == 0)
+		error = copyout(st, uptr, sizeof(*st)) ? EFAULT : 0;
+	free(st, M_DEVBUF);
+	return error;
+}
+
 /* Called by either user's context (netmap_ioctl())
  * or external kernel modules (e.g., Openvswitch).
  * Operation is indicated in nmr->nr_cmd.
@@ -1089,15 +2422,15 @@ nm_bdg_ctl_polling_stop(struct nmreq *nmr, struct netmap_adapter *na)
 int
 netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 {
-	struct nm_bridge *b, *bridges;
+	struct nm_bridge *b;
+	struct nm_bdg_set *bs;
 	struct netmap_adapter *na;
 	struct netmap_vp_adapter *vpna;
 	char *name = nmr->nr_name;
 	int cmd = nmr->nr_cmd, namelen = strlen(name);
 	int error = 0, i, j;
-	u_int num_bridges;
 
-	netmap_bns_getbridges(&bridges, &num_bridges);
+	netmap_bns_getbridges(&bs);
 
 	switch (cmd) {
 	case NETMAP_BDG_NEWIF:
@@ -1116,6 +2449,42 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		error = nm_bdg_ctl_detach(nmr);
 		break;
 
+	case NETMAP_BDG_NEWBDG:
+		error = nm_bdg_ctl_newbdg(nmr);
+		break;
+
+	case NETMAP_BDG_DELBDG:
+		error = nm_bdg_ctl_delbdg(nmr);
+		break;
+
+	case NETMAP_BDG_FTSTATS:
+		error = nm_bdg_ctl_ftstats(nmr);
+		break;
+
+	case NETMAP_BDG_PORTSTATS:
+		error = nm_bdg_ctl_portstats(nmr);
+		break;
+
+	case NETMAP_BDG_VLAN:
+		error = nm_bdg_ctl_vlan(nmr);
+		break;
+
+	case NETMAP_BDG_MCAST:
+		error = nm_bdg_ctl_mcast(nmr);
+		break;
+
+	case NETMAP_BDG_QOS:
+		error = nm_bdg_ctl_qos(nmr);
+		break;
+
+	case NETMAP_BDG_BATCHING:
+		error = nm_bdg_ctl_batching(nmr);
+		break;
+
+	case NETMAP_BDG_POLLSTATS:
+		error = nm_bdg_ctl_pollstats(nmr);
+		break;
+
 	case NETMAP_BDG_LIST:
 		/* this is used to enumerate bridges and ports */
 		if (namelen) { /* look up indexes of bridge and port */
@@ -1124,7 +2493,7 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 				break;
 			}
 			NMG_LOCK();
-			b = nm_find_bridge(name, 0 /* don't create */);
+			b = nm_find_bridge(name, 0 /* don't create */, NULL);
 			if (!b) {
 				error = ENOENT;
 				NMG_UNLOCK();
@@ -1132,7 +2501,7 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			}
 
 			error = 0;
-			nmr->nr_arg1 = b - bridges; /* bridge index */
+			nmr->nr_arg1 = b->bdg_id; /* bridge index */
 			nmr->nr_arg2 = NM_BDG_NOPORT;
 			for (j = 0; j < b->bdg_active_ports; j++) {
 				i = b->bdg_port_index[j];
@@ -1162,13 +2531,14 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 			j = nmr->nr_arg2;
 
 			NMG_LOCK();
-			for (error = ENOENT; i < NM_BRIDGES; i++) {
-				b = bridges + i;
-				if (j >= b->bdg_active_ports) {
+			for (error = ENOENT, b = bs->bs_head; b; b = b->bdg_next) {
+				if (b->bdg_id < i)
+					continue;
+				if (b->bdg_id > i)
 					j = 0; /* following bridges scan from 0 */
+				if (j >= b->bdg_active_ports)
 					continue;
-				}
-				nmr->nr_arg1 = i;
+				nmr->nr_arg1 = b->bdg_id;
 				nmr->nr_arg2 = j;
 				j = b->bdg_port_index[j];
 				vpna = b->bdg_ports[j];
@@ -1180,21 +2550,51 @@ netmap_bdg_ctl(struct nmreq *nmr, struct netmap_bdg_ops *bdg_ops)
 		}
 		break;
 
-	case NETMAP_BDG_REGOPS: /* XXX this should not be available from userspace */
+	case NETMAP_BDG_REGOPS:
 		/* register callbacks to the given bridge.
 		 * nmr->nr_name may be just bridge's name (including ':'
 		 * if it is not just NM_NAME).
+		 * From userspace (bdg_ops == NULL) nr_arg1 selects one
+		 * of the lookup modules built into netmap.
 		 */
 		if (!bdg_ops) {
-			error = EINVAL;
-			break;
+			switch (nmr->nr_arg1) {
+			case NETMAP_BDG_OPS_LEARNING:
+				bdg_ops = &nm_bdg_learning_ops;
+				break;
+			case NETMAP_BDG_OPS_FLOW:
+				bdg_ops = &netmap_bdg_flow_ops;
+				break;
+			default:
+				error = EINVAL;
+				break;
+			}
+			if (error)
+				break;
 		}
 		NMG_LOCK();
-		b = nm_find_bridge(name, 0 /* don't create */);
+		b = nm_find_bridge(name, 0 /* don't create */, NULL);
 		if (!b) {
 			error = EINVAL;
 		} else {
+			struct netmap_bdg_ops old = b->bdg_ops;
+			void *old_private = b->bdg_private, *private = NULL;
+
+			if (bdg_ops->init != NULL &&
+			    (private = bdg_ops->init(nmr)) == NULL) {
+				error = ENOMEM;
+				NMG_UNLOCK();
+				break;
+			}
+			/* exclude config(), then wait for the data path */
+			BDG_WLOCK(b);
 			b->bdg_ops = *bdg_ops;
+			b->bdg_private = private;
+			BDG_WUNLOCK(b);
+			nm_bdg_publish_ops(b);
+			nm_bdg_sync(b, NULL, NULL);
+			if (old.fini != NULL)
+				old.fini(old_private);
 		}
 		NMG_UNLOCK();
 		break;
@@ -1260,7 +2660,7 @@ netmap_bdg_config(struct nmreq *nmr)
 	int error = EINVAL;
 
 	NMG_LOCK();
-	b = nm_find_bridge(nmr->nr_name, 0);
+	b = nm_find_bridge(nmr->nr_name, 0, NULL);
 	if (!b) {
 		NMG_UNLOCK();
 		return error;
@@ -1269,7 +2669,8 @@ netmap_bdg_config(struct nmreq *nmr)
 	/* Don't call config() with NMG_LOCK() held */
 	BDG_RLOCK(b);
 	if (b->bdg_ops.config != NULL)
-		error = b->bdg_ops.config((struct nm_ifreq *)nmr);
+		error = b->bdg_ops.config((struct nm_ifreq *)nmr,
+				b->bdg_private);
 	BDG_RUNLOCK(b);
 	return error;
 }
@@ -1324,8 +2725,75 @@ netmap_vp_krings_delete(struct netmap_adapter *na)
 
 static int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n,
-	struct netmap_vp_adapter *na, u_int ring_nr);
+	struct netmap_vp_adapter *na, struct netmap_kring *src_kring);
+
+
+/*
+ * Adaptive batching.
+ * nm_bdg_preflush() passes the slots of a txsync to nm_bdg_flush()
+ * in batches. Large batches amortize the lookup and the leases on
+ * the destinations, but a slot waits for its whole batch to be
+ * forwarded. Unless the port has a fixed batch (bdg_batch), a
+ * latency target (bdg_latency, or bridge_batch_latency) makes the
+ * batch the number of slots the ring can forward within the target,
+ * using a moving average of the cost of a slot measured on the
+ * previous batches. The batch is also bounded to twice the average
+ * slots per txsync, so a burst after a quiet period is forwarded in
+ * smaller pieces. Without a target, bridge_batch is used as before.
+ * The clock is read twice per batch, never per packet.
+ */
+static inline u_int
+nm_bdg_batch(struct netmap_vp_adapter *na, struct netmap_kring *kring,
+		u_int avail, u_int lat)
+{
+	u_int n, max = bridge_batch;
+	int d;
+
+	if (na->bdg_batch)
+		return na->bdg_batch;
+	if (lat == 0)
+		return max;
+	d = (int)(avail * 16) - (int)kring->nkr_bdg_arrival;
+	kring->nkr_bdg_arrival += d / 4;
+	if (kring->nkr_bdg_pktns == 0) /* no estimate yet */
+		return max;
+	n = (uint64_t)lat * 1000 * 16 / kring->nkr_bdg_pktns;
+	if (n > kring->nkr_bdg_arrival / 8)
+		n = kring->nkr_bdg_arrival / 8;
+	if (n < NM_BDG_MINBATCH)
+		n = NM_BDG_MINBATCH;
+	return n < max ? n : max;
+}
 
+/* forward a batch and, if adaptive, update the cost of a slot */
+static inline u_int
+nm_bdg_flush_timed(struct nm_bdg_fwd *ft, u_int n,
+		struct netmap_vp_adapter *na, struct netmap_kring *kring,
+		u_int lat)
+{
+	uint64_t t, sample;
+	int d;
+
+	kring->nkr_bdg_stats.rs_flushes++;
+	if (lat == 0 || na->bdg_batch)
+		return nm_bdg_flush(ft, n, na, kring);
+	t = nm_os_uptime_ns();
+	nm_bdg_flush(ft, n, na, kring);
+	t = nm_os_uptime_ns() - t;
+	sample = t * 16 / n;
+	if (sample > 0x7fffffff)
+		sample = 0x7fffffff;
+	if (kring->nkr_bdg_pktns == 0) {
+		kring->nkr_bdg_pktns = sample ? sample : 1;
+	} else {
+		d = (int)sample - (int)kring->nkr_bdg_pktns;
+		kring->nkr_bdg_pktns += d / 8;
+		if (kring->nkr_bdg_pktns == 0)
+			kring->nkr_bdg_pktns = 1;
+	}
+	kring->nkr_bdg_stats.rs_pkt_ns = kring->nkr_bdg_pktns / 16;
+	return 0;
+}
 
 /*
  * main dispatch routine for the bridge.
@@ -1341,22 +2809,26 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		(struct netmap_vp_adapter*)kring->na;
 	struct netmap_ring *ring = kring->ring;
 	struct nm_bdg_fwd *ft;
-	u_int ring_nr = kring->ring_id;
 	u_int j = kring->nr_hwcur, lim = kring->nkr_num_slots - 1;
 	u_int ft_i = 0;	/* start from 0 */
 	u_int frags = 1; /* how many frags ? */
+	u_int pkts = 0;
+	uint64_t bytes = 0;
 	struct nm_bridge *b = na->na_bdg;
+	u_int lat, batch;
 
-	/* To protect against modifications to the bridge we acquire a
-	 * shared lock, waiting if we can sleep (if the source port is
-	 * attached to a user process) or with a trylock otherwise (NICs).
+	lat = na->bdg_latency ? na->bdg_latency : bridge_batch_latency;
+	batch = nm_bdg_batch(na, kring, ((j > end ? lim+1 : 0) + end) - j,
+			lat);
+	kring->nkr_bdg_stats.rs_batch = batch;
+
+	/* No lock on the bridge: writers wait for us to leave the
+	 * epoch we enter here (see nm_bdg_sync()), so sources that
+	 * cannot sleep (NICs) never have to skip a batch.
 	 */
-	ND("wait rlock for %d packets", ((j > end ? lim+1 : 0) + end) - j);
-	if (na->up.na_flags & NAF_BDG_MAYSLEEP)
-		BDG_RLOCK(b);
-	else if (!BDG_RTRYLOCK(b))
-		return 0;
-	ND(5, "rlock acquired for %d packets", ((j > end ? lim+1 : 0) + end) - j);
+	nm_bdg_rd_enter(b, kring);
+	ND(5, "epoch %u for %d packets", kring->nkr_bdg_epoch,
+		((j > end ? lim+1 : 0) + end) - j);
 	ft = kring->nkr_ft;
 
 	for (; likely(j != end); j = nm_next(j, lim)) {
@@ -1365,13 +2837,17 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 
 		ft[ft_i].ft_len = slot->len;
 		ft[ft_i].ft_flags = slot->flags;
+		ft[ft_i].ft_group = 0;
 
 		ND("flags is 0x%x", slot->flags);
-		/* we do not use the buf changed flag, but we still need to reset it */
+		/* we do not use the buf changed flag, but we still need to reset it
+		 * (nm_bdg_flush() sets it again if it swaps the buffer)
+		 */
 		slot->flags &= ~NS_BUF_CHANGED;
 
 		/* this slot goes into a list so initialize the link field */
 		ft[ft_i].ft_next = NM_FT_NULL;
+		ft[ft_i].ft_slot = (slot->flags & NS_INDIRECT) ? NULL : slot;
 		buf = ft[ft_i].ft_buf = (slot->flags & NS_INDIRECT) ?
 			(void *)(uintptr_t)slot->ptr : NMB(&na->up, slot);
 		if (unlikely(buf == NULL)) {
@@ -1379,10 +2855,12 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 				(slot->flags & NS_INDIRECT) ? "INDIRECT" : "DIRECT",
 				kring->name, j, ft[ft_i].ft_len);
 			buf = ft[ft_i].ft_buf = NETMAP_BUF_BASE(&na->up);
+			ft[ft_i].ft_slot = NULL;
 			ft[ft_i].ft_len = 0;
 			ft[ft_i].ft_flags = 0;
 		}
 		__builtin_prefetch(buf);
+		bytes += ft[ft_i].ft_len;
 		++ft_i;
 		if (slot->flags & NS_MOREFRAG) {
 			frags++;
@@ -1392,8 +2870,9 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 			RD(5, "%d frags at %d", frags, ft_i - frags);
 		ft[ft_i - frags].ft_frags = frags;
 		frags = 1;
-		if (unlikely((int)ft_i >= bridge_batch))
-			ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
+		pkts++;
+		if (unlikely(ft_i >= batch))
+			ft_i = nm_bdg_flush_timed(ft, ft_i, na, kring, lat);
 	}
 	if (frags > 1) {
 		/* Here ft_i > 0, ft[ft_i-1].flags has NS_MOREFRAG, and we
@@ -1402,10 +2881,13 @@ nm_bdg_preflush(struct netmap_kring *kring, u_int end)
 		ft[ft_i - 1].ft_flags &= ~NS_MOREFRAG;
 		ft[ft_i - frags].ft_frags = frags;
 		D("Truncate incomplete fragment at %d (%d frags)", ft_i, frags);
+		pkts++;
 	}
 	if (ft_i)
-		ft_i = nm_bdg_flush(ft, ft_i, na, ring_nr);
-	BDG_RUNLOCK(b);
+		ft_i = nm_bdg_flush_timed(ft, ft_i, na, kring, lat);
+	nm_bdg_rd_exit(kring);
+	kring->nkr_bdg_stats.rs_packets += pkts;
+	kring->nkr_bdg_stats.rs_bytes += bytes;
 	return j;
 }
 
@@ -1433,9 +2915,9 @@ do {                                                                    \
 
 
 static __inline uint32_t
-nm_bridge_rthash(const uint8_t *addr)
+nm_bridge_rthash(const uint8_t *addr, u_int vid)
 {
-        uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0; // hask key
+        uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = vid; // hask key
 
         b += addr[5] << 8;
         b += addr[4];
@@ -1445,8 +2927,96 @@ nm_bridge_rthash(const uint8_t *addr)
         a += addr[0];
 
         mix(a, b, c);
-#define BRIDGE_RTHASH_MASK	(NM_BDG_HASH-1)
-        return (c & BRIDGE_RTHASH_MASK);
+        return c;
+}
+
+/* unaligned reads of header fields, in network byte order */
+static inline uint32_t
+nm_bdg_get32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint16_t
+nm_bdg_get16(const uint8_t *p)
+{
+	uint16_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/*
+ * Symmetric flow hash on the 5-tuple of an IPv4/IPv6 packet,
+ * in the spirit of apps/lb/pkt_hash.c: addresses and ports are
+ * folded with xor before mixing, so both directions of a
+ * connection get the same value. buf points to the ethernet header
+ * and len is the number of bytes available there. Non-IP traffic,
+ * fragments and truncated headers hash on the addresses only
+ * (or return 0), which still keeps them in order.
+ */
+static uint32_t
+nm_bdg_flow_hash(const uint8_t *buf, u_int len)
+{
+	uint32_t a = 0x9e3779b9, b = 0x9e3779b9, c = 0;
+	const uint8_t *l4 = NULL;
+	u_int off = 14, proto;
+	uint16_t type;
+
+	if (len < off)
+		return 0;
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= off + 4) { /* skip one 802.1Q tag */
+		type = (buf[16] << 8) | buf[17];
+		off += 4;
+	}
+	buf += off;
+	len -= off;
+
+	switch (type) {
+	case 0x0800: { /* IPv4 */
+		u_int hl;
+
+		if (len < 20)
+			return 0;
+		hl = (buf[0] & 0xf) << 2;
+		proto = buf[9];
+		a += nm_bdg_get32(buf + 12) ^ nm_bdg_get32(buf + 16);
+		/* only the first fragment carries the ports */
+		if (hl >= 20 && (buf[6] & 0x3f) == 0 && buf[7] == 0 &&
+		    len >= hl + 4)
+			l4 = buf + hl;
+		break;
+	}
+
+	case 0x86dd: { /* IPv6, no extension headers */
+		int i;
+
+		if (len < 40)
+			return 0;
+		proto = buf[6];
+		for (i = 8; i < 24; i += 4)
+			a += nm_bdg_get32(buf + i) ^ nm_bdg_get32(buf + i + 16);
+		if (len >= 44)
+			l4 = buf + 40;
+		break;
+	}
+
+	default:
+		return 0;
+	}
+
+	if (l4 && (proto == 6 /* TCP */ || proto == 17 /* UDP */ ||
+	    proto == 132 /* SCTP */)) {
+		b += nm_bdg_get16(l4) ^ nm_bdg_get16(l4 + 2);
+	}
+	c += proto;
+
+	mix(a, b, c);
+	return c;
 }
 
 #undef mix
@@ -1464,8 +3034,6 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 	/* persistent ports may be put in netmap mode
 	 * before being attached to a bridge
 	 */
-	if (vpna->na_bdg)
-		BDG_WLOCK(vpna->na_bdg);
 	if (onoff) {
 		for_rx_tx(t) {
 			for (i = 0; i < nma_get_nrings(na, t) + 1; i++) {
@@ -1492,72 +3060,354 @@ netmap_vp_reg(struct netmap_adapter *na, int onoff)
 			}
 		}
 	}
+	/* the data path checks the mode of the destination rings
+	 * without locks, wait until the change is visible
+	 */
 	if (vpna->na_bdg)
-		BDG_WUNLOCK(vpna->na_bdg);
+		nm_bdg_sync(vpna->na_bdg, NULL, NULL);
 	return 0;
 }
 
 
+/* first entry of the forwarding table bucket for addr in VLAN vid */
+static inline struct nm_hash_ent *
+nm_bdg_ht_bucket(struct nm_bridge *b, const uint8_t *addr, u_int vid)
+{
+	return b->ht + (nm_bridge_rthash(addr, vid) & b->ht_mask) *
+		NM_BDG_HASH_WAYS;
+}
+
 /*
- * Lookup function for a learning bridge.
- * Update the hash table with the source address,
- * and then returns the destination port index, and the
- * ring in *dst_ring (at the moment, always use ring 0)
+ * Insert or refresh the entry for mac in bucket e.
+ * A new address takes a free or expired entry if there is one,
+ * otherwise it evicts the least recently refreshed one.
  */
-u_int
-netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
-		struct netmap_vp_adapter *na)
+static void
+nm_bdg_ht_learn(struct nm_bridge *b, struct nm_hash_ent *e, uint64_t mac,
+		u_int port, uint32_t now)
+{
+	struct nm_hash_ent *victim = NULL;
+	int i;
+
+	mac |= NM_HT_VALID;
+	for (i = 0; i < NM_BDG_HASH_WAYS; i++, e++) {
+		if (e->mac == mac) {
+			e->ports = port;
+			e->stamp = now;
+			return;
+		}
+		if (!nm_bdg_ht_live(b, e, now)) {
+			if (victim == NULL || nm_bdg_ht_live(b, victim, now))
+				victim = e;
+		} else if (victim == NULL || (nm_bdg_ht_live(b, victim, now) &&
+			    now - e->stamp > now - victim->stamp)) {
+			victim = e;
+		}
+	}
+	if (nm_bdg_ht_live(b, victim, now))
+		b->ht_evictions++;
+	b->ht_learned++;
+	victim->mac = mac;
+	victim->ports = port;
+	victim->stamp = now;
+}
+
+/*
+ * Return the ethernet header of the packet in ft, past the
+ * virtio-net header, or NULL if the format is not valid.
+ */
+uint8_t *
+nm_bdg_eth_hdr(struct nm_bdg_fwd *ft, struct netmap_vp_adapter *na,
+		u_int *len)
 {
-	uint8_t *buf = ft->ft_buf;
 	u_int buf_len = ft->ft_len;
-	struct nm_hash_ent *ht = na->na_bdg->ht;
-	uint32_t sh, dh;
-	u_int dst, mysrc = na->bdg_port;
-	uint64_t smac, dmac;
 
 	/* safety check, unfortunately we have many cases */
 	if (buf_len >= 14 + na->up.virt_hdr_len) {
 		/* virthdr + mac_hdr in the same slot */
-		buf += na->up.virt_hdr_len;
-		buf_len -= na->up.virt_hdr_len;
+		*len = buf_len - na->up.virt_hdr_len;
+		return (uint8_t *)ft->ft_buf + na->up.virt_hdr_len;
 	} else if (buf_len == na->up.virt_hdr_len && ft->ft_flags & NS_MOREFRAG) {
 		/* only header in first fragment */
-		ft++;
-		buf = ft->ft_buf;
-		buf_len = ft->ft_len;
-	} else {
-		RD(5, "invalid buf format, length %d", buf_len);
-		return NM_BDG_NOPORT;
+		*len = ft[1].ft_len;
+		return ft[1].ft_buf;
+	}
+	RD(5, "invalid buf format, length %d", buf_len);
+	return NULL;
+}
+
+/*
+ * VLAN of a frame entering the bridge from na, or 0 if the frame
+ * is not admitted. Untagged and priority tagged frames belong to
+ * the pvid of the port, tagged ones must be in its VLANs.
+ */
+static inline u_int
+nm_bdg_vlan_in(const struct netmap_vp_adapter *na, const uint8_t *buf,
+		u_int len)
+{
+	u_int vid = 0;
+
+	if (len >= 18 && buf[12] == 0x81 && buf[13] == 0x00)
+		vid = ((buf[14] << 8) | buf[15]) & 0xfff;
+	if (vid == 0)
+		return na->bdg_pvid;
+	return NM_VLAN_ISSET(na, vid) ? vid : 0;
+}
+
+/*
+ * What to do with the VLAN tag of a frame sent from src to dst,
+ * see nm_bdg_vlan_out().
+ */
+#define NM_VLAN_SKIP	-1	/* dst is not in the VLAN of the frame */
+#define NM_VLAN_KEEP	0	/* send the frame as is */
+#define NM_VLAN_PUSH	1	/* add a tag with the VLAN of the frame */
+#define NM_VLAN_POP	2	/* remove the tag */
+#define NM_VLAN_SETVID	3	/* rewrite the VID of a priority tag */
+
+/*
+ * Egress check of a VLAN aware bridge: return one of NM_VLAN_*
+ * for the frame in ft, and its VLAN in *vid.
+ */
+static inline int
+nm_bdg_vlan_out(struct netmap_vp_adapter *src, struct netmap_vp_adapter *dst,
+		struct nm_bdg_fwd *ft, u_int *vid)
+{
+	u_int len, v = 0, tagged = 0;
+	uint8_t *buf = nm_bdg_eth_hdr(ft, src, &len);
+
+	if (buf == NULL)
+		return NM_VLAN_SKIP;
+	if (len >= 18 && buf[12] == 0x81 && buf[13] == 0x00) {
+		tagged = 1;
+		v = ((buf[14] << 8) | buf[15]) & 0xfff;
+	}
+	if (v == 0) {
+		v = src->bdg_pvid;
+		if (tagged)	/* priority tag, VID 0 */
+			tagged = 2;
+	}
+	if (v == 0 || !NM_VLAN_ISSET(src, v) || !NM_VLAN_ISSET(dst, v))
+		return NM_VLAN_SKIP;
+	*vid = v;
+	if (v == dst->bdg_pvid)
+		return tagged ? NM_VLAN_POP : NM_VLAN_KEEP;
+	if (tagged == 2)	/* must leave with the VID of the frame */
+		return NM_VLAN_SETVID;
+	return tagged ? NM_VLAN_KEEP : NM_VLAN_PUSH;
+}
+
+/*
+ * Copy the frame in src (len bytes, starting with a header of off
+ * bytes) to dst, adding (NM_VLAN_PUSH) or removing (NM_VLAN_POP)
+ * the 802.1Q tag, or setting its VID and keeping the priority
+ * (NM_VLAN_SETVID). Return the new length, or 0 if it does not fit.
+ */
+static inline u_int
+nm_bdg_vlan_copy(const uint8_t *src, uint8_t *dst, u_int len, u_int off,
+		int act, u_int vid, u_int bufsize)
+{
+	const u_int h = off + 12; /* up to the source address */
+
+	if (act == NM_VLAN_POP) {
+		memcpy(dst, src, h);
+		memcpy(dst + h, src + h + 4, len - h - 4);
+		return len - 4;
+	}
+	if (act == NM_VLAN_SETVID) {
+		if (len > bufsize)
+			return 0;
+		memcpy(dst, src, len);
+		dst[h + 2] = (src[h + 2] & 0xf0) | (vid >> 8);
+		dst[h + 3] = vid & 0xff;
+		return len;
 	}
+	if (len + 4 > bufsize)
+		return 0;
+	memcpy(dst, src, h);
+	dst[h] = 0x81;
+	dst[h + 1] = 0x00;
+	dst[h + 2] = vid >> 8;
+	dst[h + 3] = vid & 0xff;
+	memcpy(dst + h + 4, src + h, len - h);
+	return len + 4;
+}
+
+/*
+ * Learn the source address in buf and return the destination port.
+ * vid is the VLAN of the frame (0 if the bridge is not VLAN aware).
+ * sb and db are the buckets of the source and destination address,
+ * or NULL to compute them here. For unicast destinations with more
+ * than one rx ring, *dst_ring is chosen by the flow hash.
+ */
+static inline u_int
+nm_bdg_learn_lookup(struct netmap_vp_adapter *na, uint8_t *buf, u_int len,
+		u_int vid, struct nm_hash_ent *sb, struct nm_hash_ent *db,
+		uint32_t now, uint8_t *dst_ring)
+{
+	struct nm_bridge *b = na->na_bdg;
+	u_int dst, mysrc = na->bdg_port;
+	uint64_t smac, dmac;
+	int i;
+
 	dmac = le64toh(*(uint64_t *)(buf)) & 0xffffffffffff;
 	smac = le64toh(*(uint64_t *)(buf + 4));
 	smac >>= 16;
+	if (vid) {
+		dmac |= NM_HT_VID(vid);
+		smac |= NM_HT_VID(vid);
+	}
 
 	/*
 	 * The hash is somewhat expensive, there might be some
-	 * worthwhile optimizations here.
+	 * worthwhile optimizations here. The entry of the last source
+	 * is refreshed at most once per second, to keep it from aging.
 	 */
-	if (((buf[6] & 1) == 0) && (na->last_smac != smac)) { /* valid src */
+	if (((buf[6] & 1) == 0) &&
+	    (na->last_smac != smac || na->last_stamp != now)) { /* valid src */
 		uint8_t *s = buf+6;
-		sh = nm_bridge_rthash(s); // XXX hash of source
-		/* update source port forwarding entry */
-		na->last_smac = ht[sh].mac = smac;	/* XXX expire ? */
-		ht[sh].ports = mysrc;
+		if (sb == NULL)
+			sb = nm_bdg_ht_bucket(b, s, vid);
+		nm_bdg_ht_learn(b, sb, smac, mysrc, now);
+		na->last_smac = smac;
+		na->last_stamp = now;
 		if (netmap_verbose)
 		    D("src %02x:%02x:%02x:%02x:%02x:%02x on port %d",
 			s[0], s[1], s[2], s[3], s[4], s[5], mysrc);
 	}
 	dst = NM_BDG_BROADCAST;
 	if ((buf[0] & 1) == 0) { /* unicast */
-		dh = nm_bridge_rthash(buf); // XXX hash of dst
-		if (ht[dh].mac == dmac) {	/* found dst */
-			dst = ht[dh].ports;
+		if (db == NULL)
+			db = nm_bdg_ht_bucket(b, buf, vid);
+		dmac |= NM_HT_VALID;
+		for (i = 0; i < NM_BDG_HASH_WAYS; i++, db++) {
+			if (db->mac == dmac) {	/* found dst */
+				if (nm_bdg_ht_live(b, db, now))
+					dst = db->ports;
+				break;
+			}
 		}
 		/* XXX otherwise return NM_BDG_UNKNOWN ? */
+		if (dst == NM_BDG_BROADCAST) {
+			b->ht_misses++;
+		} else if (bridge_flow_hash && dst < b->bdg_max_ports) {
+			/* read once, a detach may clear the slot */
+			struct netmap_vp_adapter *dna =
+				NM_ACCESS_ONCE(b->bdg_ports[dst]);
+			u_int nrings = dna ? dna->up.num_rx_rings : 0;
+
+			if (nrings > NM_BDG_MAXRINGS)
+				nrings = NM_BDG_MAXRINGS;
+			if (nrings > 1)
+				*dst_ring = nm_bdg_flow_hash(buf, len) % nrings;
+		}
+	}
+	return dst;
+}
+
+/*
+ * Lookup function for a learning bridge.
+ * Update the hash table with the source address,
+ * and then returns the destination port index, and the
+ * ring in *dst_ring. Unicast traffic is spread over the rx rings
+ * of the destination by a symmetric flow hash, so packets of the
+ * same flow stay in order; otherwise *dst_ring is left unchanged.
+ */
+u_int
+netmap_bdg_learning(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_bridge *b = na->na_bdg;
+	u_int len, vid = 0, dst;
+	uint8_t *buf = nm_bdg_eth_hdr(ft, na, &len);
+
+	if (buf == NULL)
+		return NM_BDG_NOPORT;
+	if (unlikely(b->bdg_vlan)) {
+		vid = nm_bdg_vlan_in(na, buf, len);
+		if (vid == 0)
+			return NM_BDG_NOPORT;
 	}
+	dst = nm_bdg_learn_lookup(na, buf, len, vid, NULL, NULL,
+			time_second, dst_ring);
+	/* restrict multicast to the members of its group, if any */
+	if (dst == NM_BDG_BROADCAST && unlikely(b->bdg_ngroups) &&
+	    (buf[0] & 1))
+		ft->ft_group = nm_bdg_mg_find(b, buf, vid);
 	return dst;
 }
 
+/*
+ * Batch version of netmap_bdg_learning().
+ * Packets are processed NM_BDG_LOOKUP_STRIDE at a time: first we
+ * compute the hashes of all addresses and prefetch the buckets,
+ * then we learn and resolve the destinations, so the cache misses
+ * on the table overlap with the hash computation.
+ * Packets are still learned and resolved in order.
+ */
+void
+netmap_bdg_learning_batch(struct nm_bdg_fwd *ft, u_int n,
+		struct nm_bdg_dst *dst, u_int ring_nr,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_bridge *b = na->na_bdg;
+	uint8_t *hdr[NM_BDG_LOOKUP_STRIDE];
+	u_int len[NM_BDG_LOOKUP_STRIDE];
+	struct nm_hash_ent *sb[NM_BDG_LOOKUP_STRIDE];
+	struct nm_hash_ent *db[NM_BDG_LOOKUP_STRIDE];
+	u_int idx[NM_BDG_LOOKUP_STRIDE];
+	uint16_t vid[NM_BDG_LOOKUP_STRIDE];
+	uint32_t now = time_second;
+	uint64_t smac, last_smac = na->last_smac;
+	u_int i = 0, k, m, vlan = b->bdg_vlan;
+
+	while (i < n) {
+		for (m = 0; m < NM_BDG_LOOKUP_STRIDE && i < n;
+				i += ft[i].ft_frags) {
+			dst[i].dst_ring = ring_nr;
+			hdr[m] = nm_bdg_eth_hdr(&ft[i], na, &len[m]);
+			if (unlikely(hdr[m] == NULL)) {
+				dst[i].dst_port = NM_BDG_NOPORT;
+				continue;
+			}
+			vid[m] = 0;
+			if (unlikely(vlan)) {
+				vid[m] = nm_bdg_vlan_in(na, hdr[m], len[m]);
+				if (vid[m] == 0) {
+					dst[i].dst_port = NM_BDG_NOPORT;
+					continue;
+				}
+			}
+			/*
+			 * Bulk flows repeat the source of the previous
+			 * packet, which is learnt already: skip its bucket,
+			 * nm_bdg_learn_lookup() computes it if still needed.
+			 */
+			smac = le64toh(*(uint64_t *)(hdr[m] + 4)) >> 16;
+			if (vid[m])
+				smac |= NM_HT_VID(vid[m]);
+			sb[m] = NULL;
+			if (smac != last_smac) {
+				sb[m] = nm_bdg_ht_bucket(b, hdr[m] + 6, vid[m]);
+				__builtin_prefetch(sb[m]);
+				last_smac = smac;
+			}
+			db[m] = nm_bdg_ht_bucket(b, hdr[m], vid[m]);
+			__builtin_prefetch(db[m]);
+			idx[m++] = i;
+		}
+		for (k = 0; k < m; k++) {
+			struct nm_bdg_dst *d = &dst[idx[k]];
+
+			d->dst_port = nm_bdg_learn_lookup(na, hdr[k], len[k],
+					vid[k], sb[k], db[k], now, &d->dst_ring);
+			if (d->dst_port == NM_BDG_BROADCAST &&
+			    unlikely(b->bdg_ngroups) && (hdr[k][0] & 1))
+				ft[idx[k]].ft_group =
+					nm_bdg_mg_find(b, hdr[k], vid[k]);
+		}
+	}
+}
+
 
 /*
  * Available space in the ring. Only used in VALE code
@@ -1630,33 +3480,193 @@ nm_kr_lease(struct netmap_kring *k, u_int n, int is_rx)
 	return lease_idx;
 }
 
+/* slot of destination d_i in the hash of destinations of a batch */
+static inline u_int
+nm_bdg_dsthash(u_int d_i)
+{
+	return (uint32_t)(d_i * 0x9e3779b1U) >> (32 - NM_BDG_DSTHASH_BITS);
+}
+
+/*
+ * Return the queue for destination d_i (port * NM_BDG_MAXRINGS + ring),
+ * or NULL if the batch has no packets for it.
+ */
+static inline struct nm_bdg_q *
+nm_bdg_dstq_find(struct nm_bdg_q *dst_ents, const uint16_t *dsth, u_int d_i)
+{
+	u_int h = nm_bdg_dsthash(d_i);
+
+	for (; dsth[h] != NM_BDG_DSTQ_NULL; h = (h + 1) & (NM_BDG_DSTHASH - 1)) {
+		if (dst_ents[dsth[h]].bq_dst == d_i)
+			return dst_ents + dsth[h];
+	}
+	return NULL;
+}
+
+/*
+ * Same as above, but create the queue if it does not exist.
+ * Queues are taken in order from dst_ents, *num_dsts counts them.
+ * There is at most one queue per packet and the hash has more than
+ * twice as many slots, so the probe always terminates.
+ */
+static inline struct nm_bdg_q *
+nm_bdg_dstq_get(struct nm_bdg_q *dst_ents, uint16_t *dsth, u_int d_i,
+		u_int *num_dsts)
+{
+	u_int h = nm_bdg_dsthash(d_i);
+	struct nm_bdg_q *d;
+
+	for (; dsth[h] != NM_BDG_DSTQ_NULL; h = (h + 1) & (NM_BDG_DSTHASH - 1)) {
+		if (dst_ents[dsth[h]].bq_dst == d_i)
+			return dst_ents + dsth[h];
+	}
+	d = dst_ents + *num_dsts;
+	d->bq_head = d->bq_tail = NM_FT_NULL;
+	d->bq_len = 0;
+	d->bq_dst = d_i;
+	d->bq_hslot = h;
+	dsth[h] = (*num_dsts)++;
+	return d;
+}
+
+/*
+ * Refill the token bucket of the tx ring kring of a rate limited
+ * port, and return the available bytes. Each tx ring has its own
+ * bucket, with an equal part of the rate and burst of the port,
+ * so that rings never share state. The clock is read once per
+ * batch; if less than one byte is due, the refill is deferred
+ * so that slow rates do not lose the fractions.
+ */
+static uint64_t
+nm_bdg_police_refill(struct netmap_vp_adapter *na,
+		struct netmap_kring *kring, uint64_t rate)
+{
+	uint64_t now, dt, add, burst;
+	u_int nr = na->up.num_tx_rings;
+
+	now = nm_os_uptime_ns() / 1000; /* monotonic, us */
+	rate /= nr;
+	burst = na->bdg_burst / nr;
+	if (burst < NM_BDG_MINBURST)
+		burst = NM_BDG_MINBURST;
+	dt = now - kring->nkr_bdg_tstamp;
+	if (dt > 1000000)
+		dt = 1000000; /* more than enough to fill any burst */
+	add = rate * dt / 1000000;
+	if (add > 0 || dt == 0)
+		kring->nkr_bdg_tstamp = now;
+	kring->nkr_bdg_tokens += add;
+	if (kring->nkr_bdg_tokens > burst)
+		kring->nkr_bdg_tokens = burst;
+	return kring->nkr_bdg_tokens;
+}
+
+/*
+ * Broadcast slots of a batch, split by multicast group, so that
+ * only the members of a group reserve space for its packets.
+ * Groups beyond NM_BDG_BATCH_GROUPS are counted in br_all (the
+ * packets are still filtered, the reservation is just larger).
+ */
+struct nm_bdg_brd {
+	u_int		br_all;		/* slots for every port */
+	u_int		br_ngroups;
+	uint8_t		br_group[NM_BDG_BATCH_GROUPS];	/* ft_group */
+	uint16_t	br_len[NM_BDG_BATCH_GROUPS];
+};
+
+static inline void
+nm_bdg_brd_add(struct nm_bdg_brd *br, u_int g, u_int len)
+{
+	u_int k;
+
+	if (g != 0) {
+		for (k = 0; k < br->br_ngroups; k++) {
+			if (br->br_group[k] == g) {
+				br->br_len[k] += len;
+				return;
+			}
+		}
+		if (k < NM_BDG_BATCH_GROUPS) {
+			br->br_group[k] = g;
+			br->br_len[k] = len;
+			br->br_ngroups++;
+			return;
+		}
+	}
+	br->br_all += len;
+}
+
+/* broadcast slots of the batch for port */
+static inline u_int
+nm_bdg_brd_len(const struct nm_bridge *b, const struct nm_bdg_brd *br,
+		u_int port)
+{
+	u_int k, len = br->br_all;
+
+	for (k = 0; k < br->br_ngroups; k++) {
+		if (nm_bdg_mg_isset(b, br->br_group[k] - 1, port))
+			len += br->br_len[k];
+	}
+	return len;
+}
+
 /*
  *
  * This flush routine supports only unicast and broadcast but a large
  * number of ports, and lets us replace the learn and dispatch functions.
+ * The cost of a batch depends on the destinations it contains (and
+ * on the number of active ports for broadcast), not on the maximum
+ * number of ports of the switch.
  */
 int
 nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
-		u_int ring_nr)
+		struct netmap_kring *src_kring)
 {
-	struct nm_bdg_q *dst_ents, *brddst;
-	uint16_t num_dsts = 0, *dsts;
+	struct nm_bdg_q *dst_ents, *brddst, brdonly;
+	uint16_t *dsth;
+	struct nm_bdg_dst *dst_res;
+	uint32_t *dstmap;
 	struct nm_bridge *b = na->na_bdg;
-	u_int i, me = na->bdg_port;
+	struct nm_bdg_portlist *pl;
+	struct nm_bdg_lookup *lk;
+	struct nm_bdg_brd brd;
+	u_int i, brd_j, num_dsts = 0, me = na->bdg_port;
+	u_int ring_nr = src_kring->ring_id;
+	u_int n_brd = 0, n_noport = 0, n_drop = 0; /* for src_kring */
+	u_int vlan = NM_ACCESS_ONCE(b->bdg_vlan);
+	uint64_t rate = NM_ACCESS_ONCE(na->bdg_rate), tokens = 0;
+	u_int n_policed = 0;
 
 	/*
 	 * The work area (pointed by ft) is followed by an array of
-	 * pointers to queues , dst_ents; there are NM_BDG_MAXRINGS
-	 * queues per port plus one for the broadcast traffic.
-	 * Then we have an array of destination indexes.
+	 * queues, dst_ents: one for each destination (port and ring)
+	 * in the batch, allocated in order, plus one for the broadcast
+	 * traffic at the end.
+	 * Then we have the hash of the destinations, which maps
+	 * port and ring to a queue, the results of the batch lookup
+	 * and a bitmap of the ports that have at least one queue.
+	 * Only the entries used by a batch are touched, and cleared
+	 * at the end, so the cost does not depend on the number of
+	 * ports (the bitmap of a 256 port switch is 32 bytes).
 	 */
 	dst_ents = (struct nm_bdg_q *)(ft + NM_BDG_BATCH_MAX);
-	dsts = (uint16_t *)(dst_ents + NM_BDG_MAXPORTS * NM_BDG_MAXRINGS + 1);
-
+	brddst = dst_ents + NM_BDG_BATCH_MAX;
+	dsth = (uint16_t *)(brddst + 1);
+	dst_res = (struct nm_bdg_dst *)(dsth + NM_BDG_DSTHASH);
+	dstmap = (uint32_t *)(dst_res + NM_BDG_BATCH_MAX);
+
+	/* the callbacks may be replaced while we run, see REGOPS */
+	lk = NM_ACCESS_ONCE(b->bdg_rlookup);
+	if (lk->lookup_batch)
+		lk->lookup_batch(ft, n, dst_res, ring_nr, na, lk->private_data);
+
+	brd.br_all = brd.br_ngroups = 0;
+	if (unlikely(rate))
+		tokens = nm_bdg_police_refill(na, src_kring, rate);
 	/* first pass: find a destination for each packet in the batch */
 	for (i = 0; likely(i < n); i += ft[i].ft_frags) {
 		uint8_t dst_ring = ring_nr; /* default, same ring as origin */
-		uint16_t dst_port, d_i;
+		uint16_t dst_port;
 		struct nm_bdg_q *d;
 
 		ND("slot %d frags %d", i, ft[i].ft_frags);
@@ -1664,29 +3674,48 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		   fragment nor at the very beginning of the second. */
 		if (unlikely(na->up.virt_hdr_len > ft[i].ft_len))
 			continue;
-		dst_port = b->bdg_ops.lookup(&ft[i], &dst_ring, na);
+		if (unlikely(rate)) {
+			/* ingress policer, drop what exceeds the bucket */
+			uint64_t plen = 0;
+			u_int k;
+
+			for (k = i; k < i + ft[i].ft_frags; k++)
+				plen += ft[k].ft_len;
+			if (plen > tokens) {
+				n_policed++;
+				continue;
+			}
+			tokens -= plen;
+		}
+		if (lk->lookup_batch) {
+			dst_port = dst_res[i].dst_port;
+			dst_ring = dst_res[i].dst_ring;
+		} else {
+			dst_port = lk->lookup(&ft[i], &dst_ring, na,
+					lk->private_data);
+		}
 		if (netmap_verbose > 255)
 			RD(5, "slot %d port %d -> %d", i, me, dst_port);
-		if (dst_port == NM_BDG_NOPORT)
+		if (dst_port == NM_BDG_NOPORT) {
+			n_noport++;
 			continue; /* this packet is identified to be dropped */
-		else if (unlikely(dst_port > NM_BDG_MAXPORTS))
+		} else if (dst_port == NM_BDG_BROADCAST) {
+			n_brd++;
+			nm_bdg_brd_add(&brd, ft[i].ft_group, ft[i].ft_frags);
+			d = brddst; /* broadcasts always go to ring 0 */
+		} else if (unlikely(dst_port >= b->bdg_max_ports ||
+		    dst_port == me || !b->bdg_ports[dst_port]))
 			continue;
-		else if (dst_port == NM_BDG_BROADCAST)
-			dst_ring = 0; /* broadcasts always go to ring 0 */
-		else if (unlikely(dst_port == me ||
-		    !b->bdg_ports[dst_port]))
-			continue;
-
-		/* get a position in the scratch pad */
-		d_i = dst_port * NM_BDG_MAXRINGS + dst_ring;
-		d = dst_ents + d_i;
+		else {	/* get a queue in the scratch pad */
+			d = nm_bdg_dstq_get(dst_ents, dsth,
+				dst_port * NM_BDG_MAXRINGS +
+				(dst_ring & (NM_BDG_MAXRINGS - 1)), &num_dsts);
+			dstmap[dst_port >> 5] |= 1U << (dst_port & 31);
+		}
 
 		/* append the first fragment to the list */
 		if (d->bq_head == NM_FT_NULL) { /* new destination */
 			d->bq_head = d->bq_tail = i;
-			/* remember this position to be scanned later */
-			if (dst_port != NM_BDG_BROADCAST)
-				dsts[num_dsts++] = d_i;
 		} else {
 			ft[d->bq_tail].ft_next = i;
 			d->bq_tail = i;
@@ -1696,44 +3725,65 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 
 	/*
 	 * Broadcast traffic goes to ring 0 on all destinations.
-	 * So we need to add these rings to the list of ports to scan.
-	 * XXX at the moment we scan all NM_BDG_MAXPORTS ports, which is
-	 * expensive. We should keep a compact list of active destinations
-	 * so we could shorten this loop.
+	 * Ports that have a queue for ring 0 get it together with their
+	 * unicast traffic. For the others, after the queues, we walk
+	 * the list of active ports (from brd_j) using an empty queue,
+	 * skipping the ports that are not in the groups of the batch.
+	 * Multicast packets are only copied to the members of their
+	 * group (ft_group).
 	 */
-	brddst = dst_ents + NM_BDG_BROADCAST * NM_BDG_MAXRINGS;
-	if (brddst->bq_head != NM_FT_NULL) {
-		u_int j;
-		for (j = 0; likely(j < b->bdg_active_ports); j++) {
-			uint16_t d_i;
-			i = b->bdg_port_index[j];
-			if (unlikely(i == me))
-				continue;
-			d_i = i * NM_BDG_MAXRINGS;
-			if (dst_ents[d_i].bq_head == NM_FT_NULL)
-				dsts[num_dsts++] = d_i;
-		}
-	}
+	brdonly.bq_head = brdonly.bq_tail = NM_FT_NULL;
+	brdonly.bq_len = 0;
+	brd_j = 0;
+	pl = NM_ACCESS_ONCE(b->bdg_rports);
 
 	ND(5, "pass 1 done %d pkts %d dsts", n, num_dsts);
 	/* second pass: scan destinations */
-	for (i = 0; i < num_dsts; i++) {
+	for (i = 0; ; i++) {
 		struct netmap_vp_adapter *dst_na;
-		struct netmap_kring *kring;
+		struct netmap_kring *kring = NULL;
 		struct netmap_ring *ring;
 		u_int dst_nr, lim, j, d_i, next, brd_next;
 		u_int needed, howmany;
+		u_int queued = 0, sent = 0, pkts = 0; /* slots, slots, packets */
+		uint64_t bytes = 0;
 		int retry = netmap_txsync_retry;
 		struct nm_bdg_q *d;
 		uint32_t my_start = 0, lease_idx = 0;
 		int nrings;
 		int virt_hdr_mismatch = 0;
-
-		d_i = dsts[i];
+		int zcopy;
+
+		if (i < num_dsts) {
+			d = dst_ents + i;
+			d_i = d->bq_dst;
+		} else if (brddst->bq_head != NM_FT_NULL) {
+			/* next port that only gets broadcast traffic.
+			 * Ports without a bit in dstmap have no queue,
+			 * the hash is only checked for the others.
+			 */
+			for (d_i = NM_BDG_NOPORT; brd_j < pl->pl_n; ) {
+				u_int p = pl->pl_idx[brd_j++];
+
+				if (p != me && (!(dstmap[p >> 5] &
+				    (1U << (p & 31))) ||
+				    nm_bdg_dstq_find(dst_ents, dsth,
+				    p * NM_BDG_MAXRINGS) == NULL) &&
+				    (brd.br_ngroups == 0 ||
+				     nm_bdg_brd_len(b, &brd, p) != 0)) {
+					d_i = p * NM_BDG_MAXRINGS;
+					break;
+				}
+			}
+			if (d_i == NM_BDG_NOPORT)
+				break;
+			d = &brdonly;
+		} else {
+			break;
+		}
 		ND("second pass %d port %d", i, d_i);
-		d = dst_ents + d_i;
 		// XXX fix the division
-		dst_na = b->bdg_ports[d_i/NM_BDG_MAXRINGS];
+		dst_na = NM_ACCESS_ONCE(b->bdg_ports[d_i/NM_BDG_MAXRINGS]);
 		/* protect from the lookup function returning an inactive
 		 * destination port
 		 */
@@ -1761,7 +3811,10 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		 * we have claimed, so we will need to handle the leftover
 		 * ones when we regain the lock.
 		 */
-		needed = d->bq_len + brddst->bq_len;
+		queued = needed = d->bq_len + brddst->bq_len;
+		if (unlikely(brd.br_ngroups) && brddst->bq_len)
+			needed = d->bq_len +
+				nm_bdg_brd_len(b, &brd, d_i / NM_BDG_MAXRINGS);
 
 		if (unlikely(dst_na->up.virt_hdr_len != na->up.virt_hdr_len)) {
 			RD(3, "virt_hdr_mismatch, src %d dst %d", na->up.virt_hdr_len,
@@ -1797,6 +3850,11 @@ nm_bdg_flush(struct nm_bdg_fwd *ft, u_int n, struct netmap_vp_adapter *na,
 		kring = &dst_na->up.rx_rings[dst_nr];
 		ring = kring->ring;
 		lim = kring->nkr_num_slots - 1;
+		/* unicast packets between ports in the same memory region
+		 * can be moved by swapping buffers instead of copying
+		 */
+		zcopy = bridge_zcopy && !virt_hdr_mismatch &&
+			dst_na->up.nm_mem == na->up.nm_mem;
 
 retry:
 
@@ -1819,6 +3877,14 @@ retry:
 		}
 		my_start = j = kring->nkr_hwlease;
 		howmany = nm_kr_space(kring, 1);
+		if (unlikely(na->bdg_share < 100)) {
+			/* the source may only fill bdg_share percent
+			 * of the ring, the rest is left to the others
+			 */
+			u_int rsv = (lim + 1) * (100 - na->bdg_share) / 100;
+
+			howmany = howmany > rsv ? howmany - rsv : 0;
+		}
 		if (needed < howmany)
 			howmany = needed;
 		lease_idx = nm_kr_lease(kring, howmany, 1);
@@ -1832,7 +3898,8 @@ retry:
 		while (howmany > 0) {
 			struct netmap_slot *slot;
 			struct nm_bdg_fwd *ft_p, *ft_end;
-			u_int cnt;
+			u_int cnt, vid, vlen;
+			int swap = 0, vact;
 
 			/* find the queue from which we pick next packet.
 			 * NM_FT_NULL is always higher than valid indexes
@@ -1843,17 +3910,68 @@ retry:
 			if (next < brd_next) {
 				ft_p = ft + next;
 				next = ft_p->ft_next;
+				swap = zcopy; /* only unicast buffers can move */
 			} else { /* insert broadcast */
 				ft_p = ft + brd_next;
 				brd_next = ft_p->ft_next;
 			}
 			cnt = ft_p->ft_frags; // cnt > 0
+			if (unlikely(ft_p->ft_group) && !nm_bdg_mg_isset(b,
+			    ft_p->ft_group - 1, d_i / NM_BDG_MAXRINGS)) {
+				queued -= cnt; /* not a member, not a drop */
+				goto next_pkt;
+			}
 			if (unlikely(cnt > howmany))
 			    break; /* no more space */
+			if (unlikely(vlan)) {
+				vact = nm_bdg_vlan_out(na, dst_na, ft_p, &vid);
+				if (vact == NM_VLAN_SKIP) {
+					/* not for this port, not a drop */
+					queued -= cnt;
+					if (!virt_hdr_mismatch)
+						needed -= cnt;
+					goto next_pkt;
+				}
+				if (vact != NM_VLAN_KEEP) {
+					/* the tag changes, so we must copy.
+					 * Only single slot frames are supported.
+					 */
+					slot = &ring->slot[j];
+					vlen = 0;
+					if (cnt == 1 && !virt_hdr_mismatch &&
+					    !(ft_p->ft_flags & NS_INDIRECT))
+						vlen = nm_bdg_vlan_copy(ft_p->ft_buf,
+						    NMB(&dst_na->up, slot),
+						    ft_p->ft_len, na->up.virt_hdr_len,
+						    vact, vid,
+						    NETMAP_BUF_SIZE_IDX(&dst_na->up,
+							slot->buf_idx));
+					if (vlen == 0) { /* counted as a drop */
+						RD(5, "cannot retag frame to %s",
+							dst_na->up.name);
+						goto next_pkt;
+					}
+					slot->len = vlen;
+					slot->flags = 1 << 8;
+					j = nm_next(j, lim);
+					needed--;
+					howmany--;
+					pkts++;
+					sent++;
+					bytes += vlen;
+					goto next_pkt;
+				}
+			}
 			if (netmap_verbose && cnt > 1)
 				RD(5, "rx %d frags to %d", cnt, j);
 			ft_end = ft_p + cnt;
+			pkts++;
+			sent += cnt;
 			if (unlikely(virt_hdr_mismatch)) {
+				struct nm_bdg_fwd *f;
+
+				for (f = ft_p; f != ft_end; f++)
+					bytes += f->ft_len;
 				bdg_mismatch_datapath(na, dst_na, ft_p, ring, &j, lim, &howmany);
 			} else {
 				howmany -= cnt;
@@ -1861,7 +3979,33 @@ retry:
 					char *dst, *src = ft_p->ft_buf;
 					size_t copy_len = ft_p->ft_len, dst_len = copy_len;
 
+					bytes += dst_len;
 					slot = &ring->slot[j];
+					/* swap only within a buffer class,
+					 * rings do not mix them
+					 */
+					if (swap && ft_p->ft_slot != NULL &&
+					    (slot->buf_idx >= dst_na->up.na_lut.lfirst) ==
+					    (ft_p->ft_slot->buf_idx >= dst_na->up.na_lut.lfirst)) {
+						/* give the source our empty buffer */
+						struct netmap_slot *src_slot = ft_p->ft_slot;
+						uint32_t idx = slot->buf_idx;
+
+						slot->buf_idx = src_slot->buf_idx;
+						src_slot->buf_idx = idx;
+						src_slot->flags |= NS_BUF_CHANGED;
+						/* as in the copy below */
+						if (unlikely(dst_len > NETMAP_BUF_SIZE_IDX(
+						    &dst_na->up, slot->buf_idx))) {
+							RD(5, "invalid len %d, down to 64",
+								(int)dst_len);
+							dst_len = 64;
+						}
+						slot->len = dst_len;
+						slot->flags = (cnt << 8) | NS_MOREFRAG |
+							NS_BUF_CHANGED;
+						goto next_frag;
+					}
 					dst = NMB(&dst_na->up, slot);
 
 					ND("send [%d] %d(%d) bytes at %s:%d",
@@ -1870,8 +4014,12 @@ retry:
 					/* round to a multiple of 64 */
 					copy_len = (copy_len + 63) & ~63;
 
-					if (unlikely(copy_len > NETMAP_BUF_SIZE(&dst_na->up) ||
-						     copy_len > NETMAP_BUF_SIZE(&na->up))) {
+					if (unlikely(copy_len > NETMAP_BUF_SIZE_IDX(&dst_na->up,
+							slot->buf_idx) ||
+						     copy_len > (ft_p->ft_slot ?
+							NETMAP_BUF_SIZE_IDX(&na->up,
+							    ft_p->ft_slot->buf_idx) :
+							NETMAP_BUF_SIZE(&na->up)))) {
 						RD(5, "invalid len %d, down to 64", (int)copy_len);
 						copy_len = dst_len = 64; // XXX
 					}
@@ -1886,12 +4034,14 @@ retry:
 					}
 					slot->len = dst_len;
 					slot->flags = (cnt << 8)| NS_MOREFRAG;
+next_frag:
 					j = nm_next(j, lim);
 					needed--;
 					ft_p++;
 				} while (ft_p != ft_end);
-				slot->flags = (cnt << 8); /* clear flag on last entry */
+				slot->flags &= ~NS_MOREFRAG; /* clear flag on last entry */
 			}
+next_pkt:
 			/* are we done ? */
 			if (next == NM_FT_NULL && brd_next == NM_FT_NULL)
 				break;
@@ -1922,6 +4072,10 @@ retry:
 			}
 		    }
 		    p[lease_idx] = j; /* report I am done */
+		    kring->nkr_bdg_stats.rs_packets += pkts;
+		    kring->nkr_bdg_stats.rs_bytes += bytes;
+		    pkts = 0;
+		    bytes = 0;
 
 		    update_pos = kring->nr_hwtail;
 
@@ -1960,11 +4114,34 @@ retry:
 			mtx_unlock(&kring->q_lock);
 		}
 cleanup:
+		if (unlikely(sent < queued)) {
+			/* no room in the destination ring */
+			n_drop += queued - sent;
+			if (kring != NULL) {
+				mtx_lock(&kring->q_lock);
+				kring->nkr_bdg_stats.rs_dropped += queued - sent;
+				mtx_unlock(&kring->q_lock);
+			}
+		}
 		d->bq_head = d->bq_tail = NM_FT_NULL; /* cleanup */
 		d->bq_len = 0;
 	}
+	/* release the queues of this batch */
+	for (i = 0; i < num_dsts; i++) {
+		u_int p = dst_ents[i].bq_dst / NM_BDG_MAXRINGS;
+
+		dsth[dst_ents[i].bq_hslot] = NM_BDG_DSTQ_NULL;
+		dstmap[p >> 5] = 0;
+	}
 	brddst->bq_head = brddst->bq_tail = NM_FT_NULL; /* cleanup */
 	brddst->bq_len = 0;
+	/* src_kring belongs to us, no lock needed */
+	src_kring->nkr_bdg_stats.rs_broadcast += n_brd;
+	src_kring->nkr_bdg_stats.rs_noport += n_noport;
+	src_kring->nkr_bdg_stats.rs_policed += n_policed;
+	if (unlikely(rate))
+		src_kring->nkr_bdg_tokens = tokens;
+	src_kring->nkr_bdg_stats.rs_dropped += n_drop;
 	return 0;
 }
 
@@ -2091,7 +4268,7 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 {
 	struct netmap_vp_adapter *vpna;
 	struct netmap_adapter *na;
-	int error;
+	int error, shared = 0;
 	u_int npipes = 0;
 
 	vpna = malloc(sizeof(*vpna), M_DEVBUF, M_NOWAIT | M_ZERO);
@@ -2133,7 +4310,8 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
         if (netmap_verbose)
 		D("max frame size %u", vpna->mfs);
 
-	na->na_flags |= NAF_BDG_MAYSLEEP;
+	/* the switch copies by buffer, so it handles both classes */
+	na->na_flags |= NAF_BDG_MAYSLEEP | NAF_LARGE_BUFS;
 	/* persistent VALE ports look like hw devices
 	 * with a native netmap adapter
 	 */
@@ -2145,23 +4323,45 @@ netmap_vp_create(struct nmreq *nmr, struct ifnet *ifp, struct netmap_vp_adapter
 	na->nm_krings_create = netmap_vp_krings_create;
 	na->nm_krings_delete = netmap_vp_krings_delete;
 	na->nm_dtor = netmap_vp_dtor;
-	na->nm_mem = netmap_mem_private_new(na->name,
+	if (nmr->nr_flags & NR_SHARE_MEM) {
+		/* the port wants to share an existing memory region,
+		 * e.g. to exchange buffers with the other ports
+		 * without copies (see bridge_zcopy)
+		 */
+		na->nm_mem = netmap_mem_find(nmr->nr_arg2);
+		if (na->nm_mem == NULL) {
+			error = EINVAL;
+			goto err;
+		}
+		shared = 1;
+	} else {
+		na->nm_mem = netmap_mem_private_new(na->name,
 			na->num_tx_rings, na->num_tx_desc,
 			na->num_rx_rings, na->num_rx_desc,
-			nmr->nr_arg3, npipes, &error);
-	if (na->nm_mem == NULL)
-		goto err;
+			nmr->nr_arg3, npipes,
+			(nmr->nr_flags & NR_RX_LARGE_BUFS) ?
+			    na->num_rx_rings * na->num_rx_desc : 0,
+			&error);
+		if (na->nm_mem == NULL)
+			goto err;
+	}
 	na->nm_bdg_attach = netmap_vp_bdg_attach;
 	/* other nmd fields are set in the common routine */
 	error = netmap_attach_common(na);
 	if (error)
 		goto err;
+	if (shared) /* netmap_attach_common() took its own reference */
+		netmap_mem_put(na->nm_mem);
 	*ret = vpna;
 	return 0;
 
 err:
-	if (na->nm_mem != NULL)
-		netmap_mem_delete(na->nm_mem);
+	if (na->nm_mem != NULL) {
+		if (shared)
+			netmap_mem_put(na->nm_mem);
+		else
+			netmap_mem_delete(na->nm_mem);
+	}
 	free(vpna, M_DEVBUF);
 	return error;
 }
@@ -2388,6 +4588,8 @@ netmap_bwrap_reg(struct netmap_adapter *na, int onoff)
 		hwna->na_lut.lut = NULL;
 		hwna->na_lut.objtotal = 0;
 		hwna->na_lut.objsize = 0;
+		hwna->na_lut.lfirst = 0;
+		hwna->na_lut.lobjsize = 0;
 	}
 
 	return 0;
@@ -2688,32 +4890,42 @@ err_free:
 
 }
 
-struct nm_bridge *
-netmap_init_bridges2(u_int n)
+struct nm_bdg_set *
+netmap_init_bridges2(void)
 {
-	int i;
-	struct nm_bridge *b;
+	struct nm_bdg_set *bs;
 
-	b = malloc(sizeof(struct nm_bridge) * n, M_DEVBUF,
-		M_NOWAIT | M_ZERO);
-	if (b == NULL)
+	bs = malloc(sizeof(*bs), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (bs == NULL)
 		return NULL;
-	for (i = 0; i < n; i++)
-		BDG_RWINIT(&b[i]);
-	return b;
+	bs->bs_hash = malloc(NM_BDG_NAMEHASH * sizeof(*bs->bs_hash),
+		M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (bs->bs_hash == NULL) {
+		free(bs, M_DEVBUF);
+		return NULL;
+	}
+	bs->bs_hmask = NM_BDG_NAMEHASH - 1;
+	return bs;
 }
 
 void
-netmap_uninit_bridges2(struct nm_bridge *b, u_int n)
+netmap_uninit_bridges2(struct nm_bdg_set *bs)
 {
-	int i;
+	struct nm_bridge *b;
 
-	if (b == NULL)
+	if (bs == NULL)
 		return;
 
-	for (i = 0; i < n; i++)
-		BDG_RWDESTROY(&b[i]);
-	free(b, M_DEVBUF);
+	/* only persistent switches without ports can be left here */
+	while ((b = bs->bs_head) != NULL) {
+		nm_bdg_set_remove(b);
+		nm_bdg_ht_free(b);
+		nm_bdg_ports_free(b);
+		BDG_RWDESTROY(b);
+		free(b, M_DEVBUF);
+	}
+	free(bs->bs_hash, M_DEVBUF);
+	free(bs, M_DEVBUF);
 }
 
 int
@@ -2722,7 +4934,7 @@ netmap_init_bridges(void)
 #ifdef CONFIG_NET_NS
 	return netmap_bns_register();
 #else
-	nm_bridges = netmap_init_bridges2(NM_BRIDGES);
+	nm_bridges = netmap_init_bridges2();
 	if (nm_bridges == NULL)
 		return ENOMEM;
 	return 0;
@@ -2735,7 +4947,7 @@ netmap_uninit_bridges(void)
 #ifdef CONFIG_NET_NS
 	netmap_bns_unregister();
 #else
-	netmap_uninit_bridges2(nm_bridges, NM_BRIDGES);
+	netmap_uninit_bridges2(nm_bridges);
 #endif
 }
 #endif /* WITH_VALE */
@@ -0,0 +1,465 @@
+/*
+ * Copyright (C) 2016 Universita` di Pisa. All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *   1. Redistributions of source code must retain the above copyright
+ *      notice, this list of conditions and the following disclaimer.
+ *   2. Redistributions in binary form must reproduce the above copyright
+ *      notice, this list of conditions and the following disclaimer in the
+ *      documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Exact match flow table for VALE switches.
+ *
+ * This is a lookup module (struct netmap_bdg_ops) that sends IPv4
+ * and IPv6 packets to a port and ring according to their 5-tuple.
+ * It is selected with NETMAP_BDG_REGOPS and nr_arg1 =
+ * NETMAP_BDG_OPS_FLOW, and flows are installed and removed with
+ * NIOCCONFIG (struct nm_flow_req in net/netmap.h).
+ *
+ * The table is set associative, NM_FLOW_WAYS entries per bucket,
+ * and its size is fixed when the module is attached to a switch.
+ * Lookups do not take locks. Updates are serialized by ft_lock and
+ * each entry carries a sequence number, odd while the entry is
+ * being written: a reader that finds an odd or changed sequence
+ * number reads the entry again. Entries are never freed while the
+ * table is in use, so readers never see released memory.
+ */
+
+#if defined(__FreeBSD__)
+#include <sys/cdefs.h> /* prerequisite */
+
+#include <sys/types.h>
+#include <sys/errno.h>
+#include <sys/param.h>	/* defines used in kernel.h */
+#include <sys/kernel.h>	/* types used in module initialization */
+#include <sys/lock.h>
+#include <sys/mutex.h>
+#include <sys/malloc.h>
+#include <sys/sockio.h>
+#include <sys/socketvar.h>	/* struct socket */
+#include <sys/socket.h> /* sockaddrs */
+#include <net/if.h>
+#include <net/if_var.h>
+#include <machine/bus.h>	/* bus_dmamap_* */
+#include <machine/atomic.h>
+#include <sys/endian.h>
+
+#define nm_flow_rmb()	rmb()
+#define nm_flow_wmb()	wmb()
+
+#elif defined(linux)
+
+#include "bsd_glue.h"
+
+#define nm_flow_rmb()	smp_rmb()
+#define nm_flow_wmb()	smp_wmb()
+
+#elif defined(__APPLE__)
+
+#warning OSX support is only partial
+#include "osx_glue.h"
+
+#else
+
+#error	Unsupported platform
+
+#endif /* unsupported */
+
+#include <net/netmap.h>
+#include <dev/netmap/netmap_kern.h>
+
+#ifdef WITH_VALE
+
+#define NM_FLOW_WAYS		4	/* entries per bucket */
+#define NM_FLOW_DEFSIZE		4096	/* default number of entries */
+#define NM_FLOW_MAXSIZE		(1 << 20)
+#define NM_FLOW_STRIDE		16	/* packets hashed before lookup */
+#define NM_FLOW_RETRIES		8	/* reads of an entry being updated */
+
+/* the key of a flow, in network byte order */
+struct nm_flow_key {
+	union {
+		struct {
+			uint32_t	src[4];
+			uint32_t	dst[4];
+			uint16_t	sport;
+			uint16_t	dport;
+			uint8_t		proto;
+			uint8_t		af;	/* 4 or 6 */
+			uint16_t	pad;	/* always 0 */
+		} f;
+		uint64_t	w[5];
+	};
+};
+
+struct nm_flow_ent {
+	volatile uint32_t fe_seq;	/* odd while being written */
+	uint16_t	fe_port;	/* destination port */
+	uint8_t		fe_ring;	/* destination ring */
+	uint8_t		fe_valid;
+	struct nm_flow_key fe_key;
+};
+
+struct nm_flow_table {
+	struct nm_flow_ent *ft_ent;	/* ft_mask + 1 buckets */
+	u_int		ft_mask;
+	u_int		ft_count;	/* flows in the table */
+	volatile u_int	ft_default;	/* port for unmatched packets */
+	NM_LOCK_T	ft_lock;	/* serializes updates */
+};
+
+/* parse the 5-tuple of the frame in buf. Return 0 if it is not IP */
+static int
+nm_flow_parse(const uint8_t *buf, u_int len, struct nm_flow_key *k)
+{
+	const uint8_t *l4 = NULL;
+	u_int off = 14;
+	uint16_t type;
+
+	k->w[0] = k->w[1] = k->w[2] = k->w[3] = k->w[4] = 0;
+	if (len < off)
+		return 0;
+	type = (buf[12] << 8) | buf[13];
+	if (type == 0x8100 && len >= off + 4) { /* skip one 802.1Q tag */
+		type = (buf[16] << 8) | buf[17];
+		off += 4;
+	}
+	buf += off;
+	len -= off;
+
+	switch (type) {
+	case 0x0800: { /* IPv4 */
+		u_int hl;
+
+		if (len < 20)
+			return 0;
+		hl = (buf[0] & 0xf) << 2;
+		if (hl < 20)
+			return 0;
+		k->f.af = 4;
+		k->f.proto = buf[9];
+		memcpy(&k->f.src[0], buf + 12, 4);
+		memcpy(&k->f.dst[0], buf + 16, 4);
+		/* only the first fragment carries the ports */
+		if ((buf[6] & 0x3f) == 0 && buf[7] == 0 && len >= hl + 4)
+			l4 = buf + hl;
+		break;
+	}
+
+	case 0x86dd: /* IPv6, no extension headers */
+		if (len < 40)
+			return 0;
+		k->f.af = 6;
+		k->f.proto = buf[6];
+		memcpy(k->f.src, buf + 8, 16);
+		memcpy(k->f.dst, buf + 24, 16);
+		if (len >= 44)
+			l4 = buf + 40;
+		break;
+
+	default:
+		return 0;
+	}
+
+	if (l4 && (k->f.proto == 6 /* TCP */ || k->f.proto == 17 /* UDP */ ||
+	    k->f.proto == 132 /* SCTP */)) {
+		memcpy(&k->f.sport, l4, 2);
+		memcpy(&k->f.dport, l4 + 2, 2);
+	}
+	return 1;
+}
+
+static inline uint32_t
+nm_flow_hash(const struct nm_flow_key *k)
+{
+	uint64_t h = 0x9e3779b97f4a7c15ULL;
+	int i;
+
+	for (i = 0; i < 5; i++) {
+		h ^= k->w[i];
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 32;
+	}
+	return (uint32_t)h;
+}
+
+static inline int
+nm_flow_key_eq(const struct nm_flow_key *a, const struct nm_flow_key *b)
+{
+	return ((a->w[0] ^ b->w[0]) | (a->w[1] ^ b->w[1]) |
+		(a->w[2] ^ b->w[2]) | (a->w[3] ^ b->w[3]) |
+		(a->w[4] ^ b->w[4])) == 0;
+}
+
+static inline struct nm_flow_ent *
+nm_flow_bucket(struct nm_flow_table *t, uint32_t h)
+{
+	return t->ft_ent + (h & t->ft_mask) * NM_FLOW_WAYS;
+}
+
+/*
+ * Look for k in bucket e, without locks. Return the destination
+ * port and set *ring, or return NM_BDG_NOPORT + 1 if not found.
+ */
+static inline u_int
+nm_flow_find(struct nm_flow_ent *e, const struct nm_flow_key *k,
+		uint8_t *ring)
+{
+	int i, tries;
+
+	for (i = 0; i < NM_FLOW_WAYS; i++, e++) {
+		for (tries = 0; tries < NM_FLOW_RETRIES; tries++) {
+			uint32_t seq = e->fe_seq;
+			u_int port, match;
+			uint8_t r;
+
+			if (seq & 1)
+				continue;	/* being written */
+			nm_flow_rmb();
+			match = e->fe_valid && nm_flow_key_eq(&e->fe_key, k);
+			port = e->fe_port;
+			r = e->fe_ring;
+			nm_flow_rmb();
+			if (e->fe_seq != seq)
+				continue;	/* changed while reading */
+			if (!match)
+				break;		/* next way */
+			*ring = r;
+			return port;
+		}
+	}
+	return NM_BDG_NOPORT + 1;
+}
+
+/*
+ * Resolve a batch of n slots. Packets are handled NM_FLOW_STRIDE at
+ * a time: first we parse and hash them and prefetch their buckets,
+ * then we search the buckets.
+ */
+static void
+nm_flow_lookup_batch(struct nm_bdg_fwd *ft, u_int n, struct nm_bdg_dst *dst,
+		u_int ring_nr, struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_flow_table *t = private_data;
+	struct nm_flow_key key[NM_FLOW_STRIDE];
+	struct nm_flow_ent *bkt[NM_FLOW_STRIDE];
+	u_int idx[NM_FLOW_STRIDE];
+	u_int i = 0, k, m, def = t->ft_default;
+
+	while (i < n) {
+		for (m = 0; m < NM_FLOW_STRIDE && i < n;
+				i += ft[i].ft_frags) {
+			uint8_t *buf;
+			u_int len;
+
+			dst[i].dst_port = def;
+			dst[i].dst_ring = ring_nr;
+			buf = nm_bdg_eth_hdr(&ft[i], na, &len);
+			if (unlikely(buf == NULL)) {
+				dst[i].dst_port = NM_BDG_NOPORT;
+				continue;
+			}
+			if (!nm_flow_parse(buf, len, &key[m]))
+				continue;
+			bkt[m] = nm_flow_bucket(t, nm_flow_hash(&key[m]));
+			__builtin_prefetch(bkt[m]);
+			idx[m++] = i;
+		}
+		for (k = 0; k < m; k++) {
+			struct nm_bdg_dst *d = &dst[idx[k]];
+			uint8_t r;
+			u_int port = nm_flow_find(bkt[k], &key[k], &r);
+
+			if (port <= NM_BDG_NOPORT) {
+				d->dst_port = port;
+				d->dst_ring = r;
+			}
+		}
+	}
+}
+
+static u_int
+nm_flow_lookup(struct nm_bdg_fwd *ft, uint8_t *dst_ring,
+		struct netmap_vp_adapter *na, void *private_data)
+{
+	struct nm_bdg_dst d;
+
+	nm_flow_lookup_batch(ft, 1, &d, *dst_ring, na, private_data);
+	*dst_ring = d.dst_ring;
+	return d.dst_port;
+}
+
+/* update entry e, with ft_lock held */
+static void
+nm_flow_write(struct nm_flow_ent *e, const struct nm_flow_key *k,
+		u_int port, uint8_t ring, int valid)
+{
+	e->fe_seq++;	/* odd, readers keep off */
+	nm_flow_wmb();
+	if (k != NULL)
+		e->fe_key = *k;
+	e->fe_port = port;
+	e->fe_ring = ring;
+	e->fe_valid = valid;
+	nm_flow_wmb();
+	e->fe_seq++;
+}
+
+/* translate the fr_port of a request */
+static u_int
+nm_flow_port(uint16_t port)
+{
+	if (port == NM_FLOW_DROP)
+		return NM_BDG_NOPORT;
+	if (port == NM_FLOW_FLOOD)
+		return NM_BDG_BROADCAST;
+	return port;
+}
+
+static int
+nm_flow_config(struct nm_ifreq *ifr, void *private_data)
+{
+	struct nm_flow_table *t = private_data;
+	struct nm_flow_req *req = (struct nm_flow_req *)ifr->data;
+	struct nm_flow_key k;
+	struct nm_flow_ent *e, *free_e = NULL;
+	u_int port;
+	int i, error = 0;
+
+	if (t == NULL)
+		return EINVAL;
+	port = nm_flow_port(req->fr_port);
+	if (port >= NM_BDG_MAXPORTS && port != NM_BDG_NOPORT &&
+	    port != NM_BDG_BROADCAST)
+		return EINVAL;
+
+	if (req->fr_cmd == NM_FLOW_ADD || req->fr_cmd == NM_FLOW_DEL) {
+		if (req->fr_af != 4 && req->fr_af != 6)
+			return EINVAL;
+		bzero(&k, sizeof(k));
+		k.f.af = req->fr_af;
+		k.f.proto = req->fr_proto;
+		k.f.sport = req->fr_sport;
+		k.f.dport = req->fr_dport;
+		memcpy(k.f.src, req->fr_src, req->fr_af == 4 ? 4 : 16);
+		memcpy(k.f.dst, req->fr_dst, req->fr_af == 4 ? 4 : 16);
+	}
+
+	mtx_lock(&t->ft_lock);
+	switch (req->fr_cmd) {
+	case NM_FLOW_ADD:
+	case NM_FLOW_DEL:
+		e = nm_flow_bucket(t, nm_flow_hash(&k));
+		for (i = 0; i < NM_FLOW_WAYS; i++, e++) {
+			if (!e->fe_valid) {
+				if (free_e == NULL)
+					free_e = e;
+			} else if (nm_flow_key_eq(&e->fe_key, &k)) {
+				break;
+			}
+		}
+		if (req->fr_cmd == NM_FLOW_DEL) {
+			if (i == NM_FLOW_WAYS) {
+				error = ENOENT;
+			} else {
+				nm_flow_write(e, NULL, 0, 0, 0);
+				t->ft_count--;
+			}
+		} else if (i < NM_FLOW_WAYS) {	/* replace */
+			nm_flow_write(e, NULL, port, req->fr_ring, 1);
+		} else if (free_e == NULL) {
+			error = ENOSPC;	/* bucket full */
+		} else {
+			nm_flow_write(free_e, &k, port, req->fr_ring, 1);
+			t->ft_count++;
+		}
+		break;
+
+	case NM_FLOW_DEFAULT:
+		t->ft_default = port;
+		break;
+
+	case NM_FLOW_FLUSH:
+		for (i = 0; i < (t->ft_mask + 1) * NM_FLOW_WAYS; i++) {
+			if (t->ft_ent[i].fe_valid)
+				nm_flow_write(&t->ft_ent[i], NULL, 0, 0, 0);
+		}
+		t->ft_count = 0;
+		break;
+
+	default:
+		error = EINVAL;
+		break;
+	}
+	req->fr_count = t->ft_count;
+	mtx_unlock(&t->ft_lock);
+	return error;
+}
+
+/* create the table, with nmr->nr_arg3 entries (rounded up) */
+static void *
+nm_flow_init(struct nmreq *nmr)
+{
+	struct nm_flow_table *t;
+	u_int n = NM_FLOW_WAYS, entries = nmr->nr_arg3;
+	size_t l;
+
+	if (entries == 0)
+		entries = NM_FLOW_DEFSIZE;
+	else if (entries > NM_FLOW_MAXSIZE)
+		entries = NM_FLOW_MAXSIZE;
+	while (n < entries)
+		n <<= 1;
+	t = malloc(sizeof(*t), M_DEVBUF, M_NOWAIT | M_ZERO);
+	if (t == NULL)
+		return NULL;
+	l = n * sizeof(struct nm_flow_ent);
+	t->ft_ent = nm_bdg_valloc(l);
+	if (t->ft_ent == NULL) {
+		free(t, M_DEVBUF);
+		return NULL;
+	}
+	t->ft_mask = n / NM_FLOW_WAYS - 1;
+	t->ft_default = NM_BDG_NOPORT;
+	mtx_init(&t->ft_lock, "nm_flow_lock", NULL, MTX_DEF);
+	ND("flow table with %u entries", n);
+	return t;
+}
+
+static void
+nm_flow_fini(void *private_data)
+{
+	struct nm_flow_table *t = private_data;
+
+	if (t == NULL)
+		return;
+	mtx_destroy(&t->ft_lock);
+	nm_bdg_vfree(t->ft_ent);
+	free(t, M_DEVBUF);
+}
+
+struct netmap_bdg_ops netmap_bdg_flow_ops = {
+	.lookup = nm_flow_lookup,
+	.config = nm_flow_config,
+	.lookup_batch = nm_flow_lookup_batch,
+	.init = nm_flow_init,
+	.fini = nm_flow_fini,
+};
+
+#endif /* WITH_VALE */
@@ -115,6 +115,9 @@
  *   as the index. On close, ni_bufs_head must point to the list of
  *   buffers to be released.
  *
+ *   More extra buffers can be obtained later with NETMAP_MEM_GROW,
+ *   which may append memory to the region (see below).
+ *
  * + NIOCREGIF can request space for extra rings (and buffers)
  *   allocated in the same memory space. The number of extra rings
  *   is in nr_arg1, and is advisory. This is a no-op on NICs where
@@ -332,7 +335,8 @@ struct netmap_if {
 	const uint32_t	ni_rx_rings;	/* number of HW rx rings */
 
 	uint32_t	ni_bufs_head;	/* head index for extra bufs */
-	uint32_t	ni_spare1[5];
+	const uint32_t	ni_memsize;	/* current size of the region */
+	uint32_t	ni_spare1[4];
 	/*
 	 * The following array contains the offset of each netmap ring
 	 * from this structure, in the following order:
@@ -431,10 +435,27 @@ struct netmap_if {
  *		Region '1' is the global allocator, normally shared
  *		by all interfaces. Other values are private regions.
  *		If two ports the same region zero-copy is possible.
+ *		A new VALE port created with NR_SHARE_MEM in nr_flags
+ *		joins the region given in nr_arg2, which must exist,
+ *		instead of creating a private one.
  *
  * nr_arg3 (in/out)	number of extra buffers to be allocated.
  *
+ * nr_numa_node (in/out) with NR_NUMA_NODE in nr_flags, the NUMA
+ *		node where the memory region should be allocated.
+ *		Otherwise regions of NICs follow the node of the NIC.
+ *		A region in use by other ports is not moved.
+ *		On return (also for NIOCGINFO) the node of the region,
+ *		or NETMAP_NUMA_ANY if it is not bound to one.
  *
+ * NR_RX_LARGE_BUFS in nr_flags asks for rx rings filled with
+ *		buffers of the large class of the region (VALE ports
+ *		only, ignored elsewhere), so that jumbo frames fit in
+ *		one slot. A new VALE port sizes its private region
+ *		accordingly. Such rings report the large size in
+ *		nr_buf_size and NETMAP_BUF() works on them, but their
+ *		buffers can only be swapped with rings of the same
+ *		class; use NETMAP_MEM_CLASSES to locate any buffer.
  *
  * nr_cmd (in)	if non-zero indicates a special command:
  *	NETMAP_BDG_ATTACH	 and nr_name = vale*:ifname
@@ -450,6 +471,14 @@ struct netmap_if {
  *	NETMAP_BDG_LIST
  *		list the configuration of VALE switches.
  *
+ *	NETMAP_BDG_REGOPS
+ *		select the lookup function of switch nr_name:
+ *		nr_arg1 = NETMAP_BDG_OPS_LEARNING for the learning
+ *		bridge (the default), NETMAP_BDG_OPS_FLOW for the exact
+ *		match flow table, with nr_arg3 entries (0 means the
+ *		default). Flows are then managed with NIOCCONFIG and a
+ *		struct nm_flow_req. Used by vale-ctl -F ... and -f ...
+ *
  *	NETMAP_BDG_VNET_HDR
  *		Set the virtio-net header length used by the client
  *		of a VALE switch port.
@@ -461,6 +490,122 @@ struct netmap_if {
  *	NETMAP_BDG_DELIF
  *		delete a persistent VALE port. Used by vale-ctl -d ...
  *
+ *	NETMAP_BDG_NEWBDG
+ *		create a VALE switch with name nr_name, which persists
+ *		until NETMAP_BDG_DELBDG even when it has no ports.
+ *		nr_arg3 is the size of the forwarding table (entries),
+ *		nr_arg2 the ageing time of its entries in seconds
+ *		(NETMAP_BDG_NOAGE for entries that never expire) and
+ *		nr_arg1 the maximum number of ports
+ *		(0 means the system defaults). Used by vale-ctl -b ...
+ *
+ *	NETMAP_BDG_DELBDG
+ *		destroy a VALE switch created with NETMAP_BDG_NEWBDG.
+ *		The switch must have no ports. Used by vale-ctl -B ...
+ *
+ *	NETMAP_BDG_FTSTATS (with NIOCGINFO)
+ *		copy the forwarding table statistics of switch nr_name
+ *		into the struct nm_bdg_ftstats whose address is stored
+ *		with nmreq_pointer_put(). Used by vale-ctl -s ...
+ *
+ *	NETMAP_BDG_PORTSTATS (with NIOCGINFO)
+ *		copy the counters of port nr_name (vale*:port) into
+ *		the struct nm_bdg_portstats whose address is stored
+ *		with nmreq_pointer_put(). Used by vale-ctl -S ...
+ *
+ *	NETMAP_BDG_VLAN
+ *		configure VLAN nr_arg1 (1..4094) on port nr_name
+ *		(vale*:port). nr_arg2 = NETMAP_BDG_VLAN_TAGGED makes
+ *		the port a tagged member of the VLAN,
+ *		NETMAP_BDG_VLAN_PVID makes it the VLAN of untagged
+ *		frames (sent untagged) and NETMAP_BDG_VLAN_DEL removes
+ *		the port from the VLAN. The first request makes the
+ *		switch VLAN aware; ports start as untagged members
+ *		of VLAN 1. Used by vale-ctl -V ...
+ *
+ *	NETMAP_BDG_MCAST
+ *		add port nr_name (vale*:port) to a multicast group of
+ *		its switch, or remove it, as in the struct
+ *		nm_bdg_mcast_req whose address is stored with
+ *		nmreq_pointer_put(). Multicast frames to a group only
+ *		reach its members, other multicast is flooded.
+ *		Used by vale-ctl -M ...
+ *
+ *	NETMAP_BDG_QOS
+ *		set the QoS parameters of port nr_name (vale*:port):
+ *		nr_arg3 is the rate limit of the traffic the port sends
+ *		into the switch, in kbit/s (0 means no limit),
+ *		nr_arg2 the burst size in Kbytes (0 means 10ms at
+ *		the given rate), nr_arg1 the percentage (1..100, 0
+ *		means 100) of a destination ring the port may fill,
+ *		so that other ports still find room when it is
+ *		congested. Used by vale-ctl -Q ...
+ *
+ *	NETMAP_BDG_BATCHING
+ *		set the batching of port nr_name (vale*:port):
+ *		nr_arg1 is a fixed batch size, nr_arg3 a latency
+ *		target in microseconds for the adaptive batching
+ *		(0 means the bridge_batch and bridge_batch_latency
+ *		sysctls, respectively). Used by vale-ctl -T ...
+ *
+ *	NETMAP_BDG_POLLING_ON, NETMAP_BDG_POLLING_OFF
+ *		start or stop polling the NIC nr_name (vale*:ifname)
+ *		with nr_arg1 kthreads, from the ring/core in
+ *		nr_ringid. With NR_REG_ONE_NIC each kthread polls one
+ *		ring; with NR_REG_ALL_NIC the kthreads, from the core
+ *		in nr_ringid, share all the rings, which move between
+ *		them by load (bridge_poll_steal). With nr_arg3 (or
+ *		the bridge_poll_busy_us sysctl) not 0, the kthreads
+ *		busy-poll only until nr_arg3 microseconds pass without
+ *		packets, then back off and reenable the interrupts.
+ *		Used by vale-ctl -p ...
+ *
+ *	NETMAP_BDG_POLLSTATS (with NIOCGINFO)
+ *		copy the counters of the polling kthreads of
+ *		nr_name (vale*:ifname) into the struct nm_bdg_pollstats
+ *		whose address is stored with nmreq_pointer_put().
+ *		Used by vale-ctl -S ...
+ *
+ *	NETMAP_MEM_GROW (with NIOCREGIF on a bound file descriptor)
+ *		prepend nr_arg3 extra buffers to ni_bufs_head, first
+ *		appending clusters to the buffer pool of the region if
+ *		it has not enough free buffers (up to the buf_max_num
+ *		or priv_buf_max_num sysctl, as set when the region was
+ *		configured). The list must not change during the call.
+ *		On return nr_arg3 is the number of buffers added and
+ *		nr_memsize the size of the region. Existing mappings
+ *		stay valid; the new buffers are in the extent beyond
+ *		them, which the process, and any other user of the
+ *		region, must mmap again to reach. Each netmap_if of
+ *		the region reports the current size in ni_memsize.
+ *
+ *	NETMAP_MEM_EXTMEM (with NIOCREGIF)
+ *		create a memory region in the memory area (e.g. a
+ *		memfd or hugetlbfs mapping) described by the struct
+ *		netmap_extmem_req whose address is stored with
+ *		nmreq_pointer_put(). The pages are pinned and the
+ *		region lives while the file descriptor is open or
+ *		some port uses it. New VALE ports join the region
+ *		with NR_SHARE_MEM and nr_arg2 set to the returned
+ *		nr_memid; their netmap_if, rings and buffers are then
+ *		at the same offsets in the area as in the region, so
+ *		the process can use them through its own mapping.
+ *		The contents of the buffers are not cleared, they stay
+ *		in the area when the region is destroyed.
+ *
+ *	NETMAP_MEM_CLASSES (with NIOCGINFO)
+ *		copy the buffer classes of the memory region of
+ *		nr_name (or of the global region if nr_name is empty)
+ *		into the struct netmap_buf_classes whose address is
+ *		stored with nmreq_pointer_put().
+ *
+ *	NETMAP_MEM_STATS (with NIOCGINFO)
+ *		copy the usage statistics of the memory region of
+ *		nr_name (or of the global region if nr_name is empty)
+ *		into the struct netmap_mem_stats whose address is
+ *		stored with nmreq_pointer_put(). Used to size the
+ *		region from the peak usage and the allocation failures.
+ *
  * nr_arg1, nr_arg2, nr_arg3  (in/out)		command specific
  *
  *
@@ -505,14 +650,34 @@ struct nmreq {
 #define NETMAP_BDG_POLLING_ON	10	/* delete polling kthread */
 #define NETMAP_BDG_POLLING_OFF	11	/* delete polling kthread */
 #define NETMAP_VNET_HDR_GET	12      /* get the port virtio-net-hdr length */
+#define NETMAP_BDG_NEWBDG	13	/* create a VALE switch */
+#define NETMAP_BDG_DELBDG	14	/* destroy a VALE switch */
+#define NETMAP_BDG_FTSTATS	15	/* get forwarding table stats */
+#define NETMAP_BDG_PORTSTATS	16	/* get port counters */
+#define NETMAP_BDG_VLAN		17	/* configure the VLANs of a port */
+#define NETMAP_BDG_MCAST	18	/* join/leave a multicast group */
+#define NETMAP_BDG_QOS		19	/* set rate limit and ring share */
+#define NETMAP_BDG_BATCHING	20	/* set the batching of a port */
+#define NETMAP_BDG_POLLSTATS	21	/* get polling kthread counters */
+#define NETMAP_MEM_CLASSES	22	/* get the buffer classes of a region */
+#define NETMAP_MEM_GROW		23	/* get extra buffers, growing the region */
+#define NETMAP_MEM_EXTMEM	24	/* make a region from user memory */
+#define NETMAP_MEM_STATS	25	/* get the usage of a region */
 	uint16_t	nr_arg1;	/* reserve extra rings in NIOCREGIF */
 #define NETMAP_BDG_HOST		1	/* attach the host stack on ATTACH */
+#define NETMAP_BDG_OPS_LEARNING	0	/* REGOPS: learning bridge */
+#define NETMAP_BDG_OPS_FLOW	1	/* REGOPS: exact match flow table */
 
 	uint16_t	nr_arg2;
+#define NETMAP_BDG_VLAN_TAGGED	0	/* VLAN: tagged member */
+#define NETMAP_BDG_VLAN_PVID	1	/* VLAN: untagged member */
+#define NETMAP_BDG_VLAN_DEL	2	/* VLAN: not a member */
+#define NETMAP_BDG_NOAGE	0xffff	/* NEWBDG: entries never expire */
 	uint32_t	nr_arg3;	/* req. extra buffers in NIOCREGIF */
 	uint32_t	nr_flags;
 	/* various modes, extends nr_ringid */
-	uint32_t	spare2[1];
+	uint32_t	nr_numa_node;	/* node of the memory region */
+#define NETMAP_NUMA_ANY		0xffffffff
 };
 
 #define NR_REG_MASK		0xf /* values for nr_flags */
@@ -541,6 +706,12 @@ enum {	NR_REG_DEFAULT	= 0,	/* backward compat, should not be used. */
  * to use those headers. If the flag is set, the application can use the
  * NETMAP_VNET_HDR_GET command to figure out the header length. */
 #define NR_ACCEPT_VNET_HDR	0x8000
+/* allocate the memory region on the node in nr_numa_node */
+#define NR_NUMA_NODE		0x10000
+/* fill the rx rings with large buffers, where supported */
+#define NR_RX_LARGE_BUFS	0x20000
+/* a new VALE port uses the existing region in nr_arg2 */
+#define NR_SHARE_MEM		0x40000
 
 
 /*
@@ -612,6 +783,194 @@ nm_ring_empty(struct netmap_ring *ring)
 	return (ring->cur == ring->tail);
 }
 
+/*
+ * Commands that exchange more data than fits in struct nmreq
+ * store the address of a user buffer starting from nr_arg1.
+ */
+static inline void
+nmreq_pointer_put(struct nmreq *nmr, void *userptr)
+{
+	uintptr_t *pp = (uintptr_t *)&nmr->nr_arg1;
+	*pp = (uintptr_t)userptr;
+}
+
+static inline void *
+nmreq_pointer_get(const struct nmreq *nmr)
+{
+	const uintptr_t *pp = (const uintptr_t *)&nmr->nr_arg1;
+	return (void *)*pp;
+}
+
+/*
+ * Forwarding table statistics of a VALE switch (NETMAP_BDG_FTSTATS).
+ * The table is set associative, ft_ways entries per bucket.
+ * An eviction replaces a live entry because its bucket is full.
+ */
+struct nm_bdg_ftstats {
+	uint32_t	ft_entries;	/* total entries */
+	uint32_t	ft_ways;	/* entries per bucket */
+	uint32_t	ft_age;		/* ageing time (s), 0 means never */
+	uint32_t	ft_used;	/* live entries */
+	uint64_t	ft_learned;	/* addresses inserted */
+	uint64_t	ft_evictions;	/* live entries replaced */
+	uint64_t	ft_misses;	/* unicast lookups flooded */
+};
+
+/*
+ * Counters of a ring of a VALE port (NETMAP_BDG_PORTSTATS).
+ * On tx rings they count the traffic the port sends into the
+ * switch, on rx rings the traffic the switch delivers to it.
+ * Drops are in slots: on tx, slots not delivered to some
+ * destination (summed over destinations); on rx, slots that
+ * did not fit in the ring.
+ */
+struct nm_bdg_ringstats {
+	uint64_t	rs_packets;
+	uint64_t	rs_bytes;
+	uint64_t	rs_dropped;
+	uint64_t	rs_broadcast;	/* tx only, NM_BDG_BROADCAST */
+	uint64_t	rs_noport;	/* tx only, NM_BDG_NOPORT */
+	uint64_t	rs_policed;	/* tx only, over the rate limit */
+	uint64_t	rs_flushes;	/* tx only, batches forwarded */
+	uint32_t	rs_batch;	/* tx only, current batch limit */
+	uint32_t	rs_pkt_ns;	/* tx only, estimated ns per packet */
+};
+
+/*
+ * Counters of a VALE port, since its rings were created.
+ * Ring i is accounted in entry i % NM_BDG_STATS_RINGS.
+ */
+#define NM_BDG_STATS_RINGS	16
+struct nm_bdg_portstats {
+	uint32_t	ps_port;	/* index in the switch */
+	uint16_t	ps_tx_rings;	/* valid entries in ps_tx */
+	uint16_t	ps_rx_rings;	/* valid entries in ps_rx */
+	struct nm_bdg_ringstats ps_tx[NM_BDG_STATS_RINGS];
+	struct nm_bdg_ringstats ps_rx[NM_BDG_STATS_RINGS];
+};
+
+/*
+ * Counters of a kthread polling a NIC attached to a VALE switch.
+ * A poll is busy if the switch got packets from the rings of the
+ * kthread since the previous poll. Rings move from overloaded to
+ * idle kthreads (bridge_poll_steal). The time of the kthread is
+ * split between busy polls, empty polls and sleeps, so that
+ * pk_busy_ns over the sum of the three is its utilization.
+ */
+struct nm_bdg_pollstat {
+	uint32_t	pk_cpu;		/* core the kthread is bound to */
+	uint32_t	pk_mode;
+#define NM_POLL_BUSY	0	/* busy-polling */
+#define NM_POLL_BACKOFF	1	/* sleeping longer between polls */
+#define NM_POLL_IDLE	2	/* as BACKOFF, with interrupts enabled */
+	uint64_t	pk_polls;
+	uint64_t	pk_busy_polls;
+	uint64_t	pk_busy_ns;
+	uint64_t	pk_spin_ns;	/* in empty polls */
+	uint64_t	pk_sleep_ns;
+	uint64_t	pk_idle;	/* times it went NM_POLL_IDLE */
+	uint64_t	pk_load;	/* packets/s in the last window */
+	uint64_t	pk_stolen;	/* rings taken from other kthreads */
+	uint32_t	pk_rings;	/* rings it polls now */
+	uint32_t	pk_spare;
+};
+
+/*
+ * Counters of the polling kthreads of a NIC (NETMAP_BDG_POLLSTATS).
+ * Kthreads after the first NM_BDG_POLL_MAXTHREADS are not reported.
+ */
+#define NM_BDG_POLL_MAXTHREADS	16
+struct nm_bdg_pollstats {
+	uint32_t	pl_nthreads;	/* valid entries in pl_kt */
+	uint32_t	pl_busy_us;	/* 0: always busy-polling */
+	uint64_t	pl_intr_on;	/* times interrupts were reenabled */
+	struct nm_bdg_pollstat pl_kt[NM_BDG_POLL_MAXTHREADS];
+};
+
+/*
+ * Multicast group membership of a VALE port (NETMAP_BDG_MCAST).
+ * A switch has up to 64 groups; a group is deleted when its last
+ * member leaves. mr_vid is the VLAN of the group on VLAN aware
+ * switches, and must be 0 otherwise.
+ */
+struct nm_bdg_mcast_req {
+	uint16_t	mr_cmd;
+#define NM_MCAST_JOIN	1
+#define NM_MCAST_LEAVE	2
+	uint16_t	mr_vid;
+	uint8_t		mr_mac[6];	/* multicast address */
+};
+
+/*
+ * Buffer classes of a memory region (NETMAP_MEM_CLASSES).
+ * Class 0 holds the regular buffers, class 1, if present, the large
+ * ones. Buffer i of class c is at offset
+ * bc_offset + (i - bc_first) * bc_size from the start of the region.
+ */
+#define NETMAP_BUF_CLASSES	2
+struct netmap_buf_class {
+	uint64_t	bc_offset;	/* of the first buffer */
+	uint32_t	bc_first;	/* index of the first buffer */
+	uint32_t	bc_num;		/* number of buffers */
+	uint32_t	bc_size;	/* buffer size */
+	uint32_t	bc_spare;
+};
+
+struct netmap_buf_classes {
+	uint32_t	nc_num;		/* valid entries in nc_class */
+	uint32_t	nc_spare;
+	struct netmap_buf_class nc_class[NETMAP_BUF_CLASSES];
+};
+
+/*
+ * Usage of a memory region (NETMAP_MEM_STATS), one entry per pool:
+ * netmap_if, rings, buffers and large buffers. Objects of clusters
+ * not allocated yet (dev.netmap.buf_lazy) are not in ps_total.
+ * ps_runs and ps_maxrun tell how fragmented the free objects are.
+ * The counters restart when the region is reconfigured.
+ */
+#define NETMAP_MEM_POOLS	4
+struct netmap_pool_stats {
+	uint32_t	ps_total;	/* objects */
+	uint32_t	ps_free;	/* free objects, ps_cached included */
+	uint32_t	ps_cached;	/* free in the per-CPU caches */
+	uint32_t	ps_peak;	/* max objects in use or cached */
+	uint32_t	ps_size;	/* object size */
+	uint32_t	ps_runs;	/* runs of contiguous free objects */
+	uint32_t	ps_maxrun;	/* longest run */
+	uint32_t	ps_spare;
+	uint64_t	ps_fail;	/* failed allocations */
+};
+
+struct netmap_mem_stats {
+	uint32_t	ms_memsize;	/* size of the region */
+	uint16_t	ms_memid;
+	uint16_t	ms_npools;	/* valid entries in ms_pool */
+	uint32_t	ms_extra_bufs;	/* extra buffers held by all ports */
+	uint32_t	ms_na_extra_bufs; /* held by the port of nr_name */
+	struct netmap_pool_stats ms_pool[NETMAP_MEM_POOLS];
+};
+
+/*
+ * External memory area for NETMAP_MEM_EXTMEM. The area starts at
+ * nr_memaddr (page aligned) and holds, in order, the netmap_if
+ * objects, the rings and the buffers, which take the rest of it.
+ * Zero values of (i/o) fields select the defaults of the global region
+ * (e.g. dev.netmap.if_num), and all are updated with the values in use.
+ */
+struct netmap_extmem_req {
+	uint64_t	nr_memaddr;	/* (i) start of the area */
+	uint32_t	nr_memsize;	/* (i) size of the area */
+	uint32_t	nr_if_num;	/* (i/o) number of netmap_if */
+	uint32_t	nr_if_size;	/* (i/o) size of a netmap_if */
+	uint32_t	nr_ring_num;	/* (i/o) number of rings */
+	uint32_t	nr_ring_size;	/* (i/o) size of a ring */
+	uint32_t	nr_buf_num;	/* (o) number of buffers */
+	uint32_t	nr_buf_size;	/* (i/o) size of a buffer */
+	uint16_t	nr_memid;	/* (o) id of the new region */
+	uint16_t	nr_spare;
+};
+
 /*
  * Opaque structure that is passed to an external kernel
  * module via ioctl(fd, NIOCCONFIG, req) for a user-owned
@@ -623,6 +982,37 @@ struct nm_ifreq {
 	char data[NM_IFRDATA_LEN];
 };
 
+/*
+ * Request for the flow table of a VALE switch, in the data of a
+ * struct nm_ifreq passed with NIOCCONFIG (nifr_name is the switch).
+ * A flow is the 5-tuple fr_af, fr_proto, fr_src:fr_sport,
+ * fr_dst:fr_dport, with addresses and ports in network byte order
+ * (IPv4 addresses in the first 4 bytes). Packets without ports
+ * (other protocols, IPv4 fragments, IPv6 extension headers) match
+ * the flows with both ports 0. fr_port is a port index in the
+ * switch (see vale-ctl -l), fr_ring a ring of that port.
+ * On return fr_count is the number of flows in the table.
+ */
+struct nm_flow_req {
+	uint16_t	fr_cmd;
+#define NM_FLOW_ADD	1	/* add or replace a flow */
+#define NM_FLOW_DEL	2	/* remove a flow */
+#define NM_FLOW_DEFAULT	3	/* fr_port for unmatched packets */
+#define NM_FLOW_FLUSH	4	/* remove all flows */
+	uint16_t	fr_port;
+#define NM_FLOW_DROP	0xffff	/* fr_port: drop the packet */
+#define NM_FLOW_FLOOD	0xfffe	/* fr_port: send to all ports */
+	uint8_t		fr_ring;
+	uint8_t		fr_af;		/* 4 or 6 */
+	uint8_t		fr_proto;	/* IPPROTO_* */
+	uint8_t		fr_pad;
+	uint16_t	fr_sport;
+	uint16_t	fr_dport;
+	uint8_t		fr_src[16];
+	uint8_t		fr_dst[16];
+	uint32_t	fr_count;	/* out */
+};
+
 /*
  * netmap kernel thread configuration
  */
@@ -88,6 +88,7 @@
 //#define	IFNAMSIZ 256
 #endif
 
+#include <stddef.h>		/* NULL */
 #include <stdint.h>
 #include <sys/socket.h>		/* apple needs sockaddr */
 #include <net/if.h>		/* IFNAMSIZ */
@@ -147,6 +148,28 @@ nm_ring_space(struct netmap_ring *ring)
 }
 
 
+/*
+ * Address of buffer idx of any class, given the start of the memory
+ * region and the classes returned by NIOCGINFO with NETMAP_MEM_CLASSES.
+ * NETMAP_BUF() only works for the buffers of the ring's own class.
+ * Returns NULL for a bad index.
+ */
+static inline char *
+nm_class_buf(void *mem, const struct netmap_buf_classes *bc, uint32_t idx)
+{
+	uint32_t i;
+
+	for (i = 0; i < bc->nc_num; i++) {
+		const struct netmap_buf_class *c = &bc->nc_class[i];
+
+		if (idx >= c->bc_first && idx - c->bc_first < c->bc_num)
+			return (char *)mem + c->bc_offset +
+				(uint64_t)(idx - c->bc_first) * c->bc_size;
+	}
+	return NULL;
+}
+
+
 #ifdef NETMAP_WITH_LIBS
 /*
  * Support for simple I/O libraries.
@@ -898,7 +921,8 @@ nm_mmap(struct nm_desc *d, const struct nm_desc *parent)
 	}
 	{
 		struct netmap_if *nifp = NETMAP_IF(d->mem, d->req.nr_offset);
-		struct netmap_ring *r = NETMAP_RXRING(nifp, );
+		/* tx rings never use the large buffers */
+		struct netmap_ring *r = NETMAP_TXRING(nifp, 0);
 
 		*(struct netmap_if **)(uintptr_t)&(d->nifp) = nifp;
 		*(struct netmap_ring **)(uintptr_t)&d->some_ring = r;